@@ -0,0 +1,853 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * lmic-bench: microbenchmarks for the LMIC hot paths.
+ *
+ * Runs against the simulated HAL (simhal.c), so results are comparable
+ * between hosts only for the SPI transaction counts. Timings are the best
+ * of several runs in nanoseconds per operation.
+ *
+ *   lmic-bench [-o out.json] [--baseline old.json] [--threshold pct] [--filter str]
+ *   lmic-bench --verify
+ *
+ * With --baseline every result is compared against the value of the same
+ * name in a previous run. Timings regress if slower by more than the
+ * threshold (default 10%), counts regress on any increase. The exit code
+ * is 1 if anything regressed.
+ *
+ * --verify checks the airtime table behind calcAirTime() against the
+ * formula for every rps/length and both against the Semtech reference,
+ * then runs functional checks of the MAC and radio driver on the sim.
+ *******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Pull in the MAC itself to reach its static functions.
+// Its debug prints would corrupt the JSON on stdout.
+#define printf(...) ((void)0)
+#include "../lmic/lmic.c"
+#undef printf
+#include "../lmic/radio.h"
+#include "../lmic/gateway.h"
+#include "../lmic/snapshot.h"
+#include "simhal.h"
+#include "spitrace.h"
+
+#define MAX_RESULTS   128
+#define MIN_RUN_NS    20000000ULL   // calibrate each case to at least 20ms
+#define REPEAT        5
+
+struct result_t {
+    char   name[48];
+    char   unit[8];    // "ns" or "count"
+    double value;
+};
+
+static struct result_t results[MAX_RESULTS];
+static int nresults;
+static const char* filter;
+
+typedef void (benchfn_t)(u4_t n, void* arg);
+
+static unsigned long long nanos (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int selected (const char* name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void report (const char* name, const char* unit, double value) {
+    if( nresults == MAX_RESULTS )
+        return;
+    struct result_t* r = &results[nresults++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    snprintf(r->unit, sizeof(r->unit), "%s", unit);
+    r->value = value;
+}
+
+// Time fn, scaling the iteration count until a run takes MIN_RUN_NS,
+// then report the best of REPEAT runs per operation.
+static void timeit (const char* name, benchfn_t* fn, void* arg) {
+    if( !selected(name) )
+        return;
+    u4_t n = 1;
+    unsigned long long t;
+    for(;;) {
+        t = nanos();
+        fn(n, arg);
+        t = nanos() - t;
+        if( t >= MIN_RUN_NS || n >= 0x40000000 )
+            break;
+        n *= 2;
+    }
+    double best = (double)t / n;
+    for( int i=1; i<REPEAT; i++ ) {
+        t = nanos();
+        fn(n, arg);
+        t = nanos() - t;
+        if( (double)t / n < best )
+            best = (double)t / n;
+    }
+    report(name, "ns", best);
+}
+
+// -----------------------------------------------------------------------------
+// Fixtures
+
+static const u1_t NWKSKEY[16] = { 0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C };
+static const u1_t APPSKEY[16] = { 0x3C, 0x4F, 0xCF, 0x09, 0x88, 0x15, 0xF7, 0xAB, 0xA6, 0xD2, 0xAE, 0x28, 0x16, 0x15, 0x7E, 0x2B };
+static const u4_t DEVADDR = 0x26011234;
+
+void os_getArtEui (u1_t* buf) { memset(buf, 0x01, 8); }
+void os_getDevEui (u1_t* buf) { memset(buf, 0x02, 8); }
+void os_getDevKey (u1_t* buf) { memcpy(buf, NWKSKEY, 16); }
+void onEvent (ev_t ev) { }
+
+static u1_t buf[256];
+
+static void session (void) {
+    LMIC_reset();
+    LMIC_setSession(0x1, DEVADDR, (xref2u1_t)NWKSKEY, (xref2u1_t)APPSKEY);
+    LMIC_setAdrMode(0);
+    LMIC_setLinkCheckMode(0);
+    LMIC_setDrTxpow(DR_SF7, 14);
+}
+
+static void noop (xref2osjob_t job) {
+}
+
+static bit_t opDone;
+
+static void onOpDone (xref2osjob_t job) {
+    opDone = 1;
+}
+
+// -----------------------------------------------------------------------------
+// Cases
+
+struct aesarg_t {
+    u1_t mode;
+    u1_t len;
+};
+
+static void bench_aes (u4_t n, void* arg) {
+    struct aesarg_t* a = (struct aesarg_t*)arg;
+    while( n-- ) {
+        os_copyMem(AESkey, NWKSKEY, 16);
+        os_clearMem(AESaux, 16);
+        AESaux[0] = 0x49;
+        os_aes(a->mode, buf, a->len);
+    }
+}
+
+static void bench_cmac (u4_t n, void* arg) {
+    struct aesarg_t* a = (struct aesarg_t*)arg;
+    while( n-- ) {
+        aescmac_t ctx;
+        os_cmacInit(&ctx, NWKSKEY);
+        os_cmacUpdate(&ctx, buf, a->len);
+        buf[0] ^= (u1_t)os_cmacFinal(&ctx);
+    }
+}
+
+typedef ostime_t (airtimefn_t)(rps_t rps, u1_t plen);
+
+static void bench_airtime (u4_t n, void* arg) {
+    airtimefn_t* volatile fn = (airtimefn_t*)arg;
+    ostime_t sum = 0;
+    while( n-- ) {
+        for( sf_t sf=SF7; sf<=SF12; sf=(sf_t)(sf+1) )
+            sum += fn(MAKERPS(sf, BW125, CR_4_5, 0, 0), 51);
+    }
+    buf[0] ^= (u1_t)sum;
+}
+
+static void bench_buildDataFrame (u4_t n, void* arg) {
+    u1_t len = *(u1_t*)arg;
+    while( n-- ) {
+        LMIC_setTxData2(1, buf, len, 0);
+        LMIC.opmode &= ~OP_TXRXPEND;
+        buildDataFrame();
+    }
+}
+
+static u1_t dnframe[256];
+static int  dnframelen;
+
+// Typical network settings in FOpts: DevStatusReq, LinkADRReq, RXParamSetupReq, DutyCycleReq
+static const u1_t MACOPTS[] = {
+    MCMD_DEVS_REQ,
+    MCMD_LADR_REQ, MCMD_LADR_SF9|MCMD_LADR_14dBm, 0x07, 0x00, MCMD_LADR_REPEAT_1,
+    MCMD_DN2P_SET, DR_SF9, 0x18, 0x4F, 0x84,
+    MCMD_DCAP_REQ, 0x00,
+};
+
+static void mkDownlink (u1_t port, u1_t len, u1_t olen) {
+    u1_t* d = dnframe;
+    d[OFF_DAT_HDR] = HDR_FTYPE_DADN | HDR_MAJOR_V1;
+    os_wlsbf4(d+OFF_DAT_ADDR, DEVADDR);
+    d[OFF_DAT_FCT] = olen;
+    os_wlsbf2(d+OFF_DAT_SEQNO, 1);
+    os_copyMem(d+OFF_DAT_OPTS, MACOPTS, olen);
+    u1_t poff = OFF_DAT_OPTS+olen;
+    d[poff] = port;
+    for( u1_t i=0; i<len; i++ )
+        d[poff+1+i] = i;
+    aes_cipher(APPSKEY, DEVADDR, 1, /*dn*/1, d+poff+1, len);
+    aes_appendMic(NWKSKEY, DEVADDR, 1, /*dn*/1, d, poff+1+len);
+    dnframelen = poff+1+len+4;
+}
+
+static void bench_decodeFrame (u4_t n, void* arg) {
+    while( n-- ) {
+        os_copyMem(LMIC.frame, dnframe, dnframelen);
+        LMIC.dataLen = dnframelen;
+        LMIC.seqnoDn = 0;
+        LMIC.txCnt = 0;
+        LMIC.txrxFlags = TXRX_DNW1;
+        if( !decodeFrame() )
+            hal_failed(__FILE__, __LINE__);
+        const dnmsg_t* m = LMIC_peekDnData(0);
+        if( m != NULL )
+            LMIC_releaseDnData(m);
+    }
+}
+
+static void bench_parseMacCmds (u4_t n, void* arg) {
+    while( n-- ) {
+        LMIC.macAnsLen = 0;
+        parseMacCmds((xref2u1_t)MACOPTS, sizeof(MACOPTS));
+    }
+}
+
+static void bench_packMacOpts (u4_t n, void* arg) {
+    u1_t opts[FCT_OPTLEN];
+    while( n-- )
+        buf[0] ^= packMacOpts(opts, 0);
+}
+
+#define CHURN_JOBS 16
+
+static void bench_timerChurn (u4_t n, void* arg) {
+    static osjob_t jobs[CHURN_JOBS];
+    u4_t seed = 1;
+    while( n-- ) {
+        ostime_t now = os_getTime();
+        for( int i=0; i<CHURN_JOBS; i++ ) {
+            seed = seed * 1103515245 + 12345;
+            os_setTimedCallback(&jobs[i], now + (seed >> 16), FUNC_ADDR(noop));
+        }
+        for( int i=CHURN_JOBS; --i>=0; )
+            os_clearCallback(&jobs[i]);
+    }
+}
+
+static void bench_nextTx (u4_t n, void* arg) {
+    ostime_t now = os_getTime();
+    while( n-- ) {
+        nextTx(now);
+        now += 1;
+    }
+}
+
+// SPI transactions of one radio operation, IRQ handling included
+static void spiCount (const char* name, u1_t mode) {
+    char label[48];
+    LMIC.osjob.func = FUNC_ADDR(onOpDone);
+    opDone = 0;
+    sim_clearCounters();
+#if defined(CFG_spitrace)
+    spitrace_reset();
+#endif
+    os_radio(mode);
+    // until the IRQ job ran - the radio maintenance job never ends
+    while( !opDone && os_runloopOnce() )
+        ;
+    snprintf(label, sizeof(label), "%s/xfers", name);
+    if( selected(label) ) report(label, "count", SIM.spixfers);
+    snprintf(label, sizeof(label), "%s/bytes", name);
+    if( selected(label) ) report(label, "count", SIM.spibytes);
+#if defined(CFG_spitrace)
+    // split by radio operation
+    static const char* const ops[SPIOP_MAX] = { "other", "starttx", "startrx", "irq", "startcad" };
+    for( u1_t op=0; op<SPIOP_MAX; op++ ) {
+        const spitrace_opstat_t* s = spitrace_stats(op);
+        if( s->xfers == 0 )
+            continue;
+        snprintf(label, sizeof(label), "%s/%s/xfers", name, ops[op]);
+        if( selected(label) ) report(label, "count", s->xfers);
+    }
+#endif
+}
+
+static void bench_spi (void) {
+    session();
+    LMIC.freq = 868100000;
+    LMIC.rps = updr2rps(DR_SF7);
+    LMIC.txpow = 14;
+    os_radio(RADIO_RST);
+
+    os_copyMem(LMIC.frame, dnframe, dnframelen);
+    LMIC.dataLen = dnframelen;
+    spiCount("spi/tx", RADIO_TX);
+
+    LMIC.rxtime = os_getTime() + 10;
+    LMIC.rxsyms = 8;
+    spiCount("spi/rx_timeout", RADIO_RX);
+
+    sim_setDownlink(dnframe, dnframelen);
+    LMIC.rxtime = os_getTime() + 10;
+    spiCount("spi/rx", RADIO_RX);
+
+    spiCount("spi/cad", RADIO_CAD);
+
+    os_radio(RADIO_RST);
+}
+
+// -----------------------------------------------------------------------------
+// Airtime verification
+
+// Airtime in seconds as given by the SX1276 datasheet / Semtech LoRa calculator.
+// Low data rate optimization as assumed by calcAirTime() - SF11 and SF12.
+static double refAirTime (rps_t rps, u1_t plen) {
+    if( getSf(rps) == FSK )
+        return (plen+5+3+1+2) * 8 / 50000.0;
+    int sf = getSf(rps) + (7-SF7);
+    int de = getSf(rps) >= SF11;
+    double tsym = (double)(1<<sf) / (125000 << getBw(rps));
+    double n = ceil((8.0*plen - 4*sf + 28 + (getNocrc(rps) ? 0 : 16) - (getIh(rps) ? 20 : 0)) / (4*(sf-2*de)));
+    return (8 + 4.25 + 8 + fmax(n, 0) * (getCr(rps)+5)) * tsym;
+}
+
+// The table must match the formula exactly. The formula may differ from the
+// reference by one tick of rounding plus the truncated divisor it uses for
+// SF10 and up (< 1/8192).
+static int verifyAirtime (void) {
+    int failed = 0;
+    for( int sf=FSK; sf<=SF12; sf++ ) {
+        for( int bw=BW125; bw<=BW500; bw++ ) {
+            ostime_t maxdev = 0;
+            for( int rest=0; rest<16; rest++ ) {
+                rps_t rps = MAKERPS(sf, bw, rest&3, (rest>>2)&1, rest>>3);
+                for( int plen=0; plen<256; plen++ ) {
+                    ostime_t t = calcAirTime(rps, plen);
+                    ostime_t f = airTimeOf(rps, plen);
+                    ostime_t r = (ostime_t)lround(refAirTime(rps, plen) * OSTICKS_PER_SEC);
+                    ostime_t dev = t > r ? t-r : r-t;
+                    if( t != f || dev > 1 + r/8192 ) {
+                        if( failed++ < 10 )
+                            fprintf(stderr, "rps=0x%03x plen=%d: table=%d formula=%d reference=%d\n", rps, plen, t, f, r);
+                    }
+                    if( dev > maxdev )
+                        maxdev = dev;
+                }
+            }
+            printf("%s%d/bw%d: max deviation from reference %d ticks\n",
+                   sf == FSK ? "fsk" : "sf", sf == FSK ? 0 : sf+(7-SF7), 125 << bw, maxdev);
+        }
+    }
+    printf("airtime %s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
+
+// -----------------------------------------------------------------------------
+// Functional checks
+
+static int check (const char* name, int failed) {
+    printf("%s %s\n", name, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+// Run jobs until a frame went out after txcnt frames, at most maxjobs
+static bit_t runUntilTx (u4_t txcnt, int maxjobs) {
+    while( SIM.txcnt == txcnt && maxjobs-- > 0 && os_runloopOnce() )
+        ;
+    return SIM.txcnt != txcnt;
+}
+
+// Decrypted FRMPayload of the last uplink, returns its length
+static int lastUplink (u1_t* payload) {
+    int poff = OFF_DAT_OPTS + (SIM.tx[OFF_DAT_FCT] & FCT_OPTLEN) + 1;
+    int len  = SIM.txlen - poff - 4;
+    if( len < 0 )
+        return 0;   // no port, no payload
+    os_copyMem(payload, SIM.tx+poff, len);
+    aes_cipher(APPSKEY, DEVADDR, os_rlsbf2(SIM.tx+OFF_DAT_SEQNO), /*up*/0, payload, len);
+    return len;
+}
+
+// A class C downlink arriving while the application stages a payload
+// must not end up in the uplink
+static int verifyStaging (void) {
+    session();
+    LMIC_setClassC(1);
+    sim_run(5);
+    u1_t maxlen;
+    xref2u1_t p = LMIC_beginTxData(1, 0, &maxlen);
+    memset(p, 0xA5, 8);
+    mkDownlink(1, 11, 0);
+    sim_setDownlink(dnframe, dnframelen);
+    os_radio(RADIO_RXON);   // the receiver picks it up right away
+    sim_run(5);
+    u4_t txcnt = SIM.txcnt;
+    LMIC_commitTxData(8);
+    u1_t pl[MAX_LEN_FRAME];
+    int failed = !runUntilTx(txcnt, 50) || lastUplink(pl) != 8;
+    for( int i=0; i<8 && !failed; i++ )
+        failed = pl[i] != 0xA5;
+    LMIC_setClassC(0);
+    return check("staging/classC", failed);
+}
+
+// The span handed out next to pending MAC answers holds exactly maxlen bytes
+static int verifyTxDataMaxlen (void) {
+    session();
+    u1_t devsreq = MCMD_DEVS_REQ;
+    parseMacCmds(&devsreq, 1);
+    u1_t maxlen;
+    xref2u1_t p = LMIC_beginTxData(1, 0, &maxlen);
+    int failed = maxlen != maxTxPayload(DR_SF7, 3);    // DevStatusAns: 3 bytes
+    memset(p, 0xC3, maxlen);
+    u4_t txcnt = SIM.txcnt;
+    failed |= LMIC_commitTxData(maxlen) != 0;
+    u1_t pl[MAX_LEN_FRAME];
+    failed |= !runUntilTx(txcnt, 50) || lastUplink(pl) != maxlen || (SIM.tx[OFF_DAT_FCT] & FCT_OPTLEN) != 3;
+    for( int i=0; i<maxlen && !failed; i++ )
+        failed = pl[i] != 0xC3;
+    return check("txdata/maxlen", failed);
+}
+
+static u1_t txqStatus;
+static int  txqCalls;
+
+static void onTxq (void* ctx, u1_t status) {
+    txqStatus = status;
+    txqCalls++;
+}
+
+// A queued payload must not be reported sent when the frame went out without it
+static int verifyTxqSize (void) {
+    int failed = 0;
+    u1_t pl[MAX_LEN_FRAME];
+    memset(buf, 0x5A, sizeof(buf));
+
+    // EU868 M=230 above DR3
+    failed |= maxTxPayload(DR_SF7, 0) != 222;
+
+    // Too large for the current DR
+    session();
+    LMIC_setDrTxpow(DR_SF12, 14);
+    failed |= LMIC_queueTx(1, buf, maxTxPayload(DR_SF12, 0)+1, 0, 0, 0, onTxq, NULL) != -2;
+
+    // Fits when queued, DR lowered before it goes out
+    session();
+    u4_t txcnt = SIM.txcnt;
+    LMIC_queueTx(1, buf, 1, 0, 0, 0, NULL, NULL);   // keeps the radio busy
+    failed |= SIM.txcnt == txcnt;
+    txqCalls = 0;
+    failed |= LMIC_queueTx(1, buf, 100, 0, 0, 0, onTxq, NULL) < 0;
+    LMIC_setDrTxpow(DR_SF12, 14);
+    for( int n=0; txqCalls == 0 && n < 100 && os_runloopOnce(); n++ )
+        ;
+    failed |= txqCalls != 1 || txqStatus != TXQ_TOOLARGE;
+
+    // Fits alone but not with the pending MAC answers - goes with the next frame
+    session();
+    u1_t devsreq = MCMD_DEVS_REQ;
+    parseMacCmds(&devsreq, 1);
+    u1_t dlen = maxTxPayload(DR_SF7, 0);
+    txqCalls = 0;
+    txcnt = SIM.txcnt;
+    failed |= LMIC_queueTx(1, buf, dlen, 0, 0, 0, onTxq, NULL) < 0;
+    failed |= !runUntilTx(txcnt, 50) || lastUplink(pl) != 0 || txqCalls != 0;
+    for( int n=0; txqCalls == 0 && n < 100 && os_runloopOnce(); n++ )
+        ;
+    failed |= txqCalls != 1 || txqStatus != TXQ_SENT || lastUplink(pl) != dlen || pl[0] != 0x5A;
+    return check("txq/size", failed);
+}
+
+// A raw inverted TX must not leave MAC uplinks inverted
+static int verifyIq (void) {
+    static osjob_t rawjob;
+    rawcfg_t cfg = { 868100000, makeRps(SF7, BW125, CR_4_5, 0, 0), 14, RAW_IQ_INVERTED, RAW_SYNC_PUBLIC };
+    session();
+    radio_rawTx(0, &rawjob, noop, &cfg, buf, 4);
+    sim_run(5);
+    int failed = (SIM.txiq & 0x41) != 0x40 || SIM.txiq2 != 0x19;
+    radio_rawStop(0);
+    u4_t txcnt = SIM.txcnt;
+    LMIC_queueTx(1, buf, 4, 0, 0, 0, NULL, NULL);
+    failed |= !runUntilTx(txcnt, 50) || (SIM.txiq & 0x41) != 0x01 || SIM.txiq2 != 0x1D;
+    return check("iq/raw", failed);
+}
+
+static int gwSock = -1;              // our end of the gateway's UDP link
+static struct sockaddr_in gwAddr;   // the gateway's end, from its first datagram
+static char dgram[GW_MAX_DGRAM+1];
+
+// Start the gateway towards a loopback socket, -1 on failure
+static int gwStart (void) {
+    struct sockaddr_in a;
+    socklen_t alen = sizeof(a);
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    gwSock = socket(AF_INET, SOCK_DGRAM, 0);
+    if( gwSock < 0 || bind(gwSock, (struct sockaddr*)&a, sizeof(a)) < 0
+        || getsockname(gwSock, (struct sockaddr*)&a, &alen) < 0 )
+        return -1;
+    rawcfg_t cfg = { 868100000, makeRps(SF7, BW125, CR_4_5, 0, 0), 14, RAW_IQ_NORMAL, RAW_SYNC_PUBLIC };
+    u1_t eui[8] = { 0 };
+    return gateway_start(0, &cfg, eui, "127.0.0.1", ntohs(a.sin_port));
+}
+
+// Next datagram from the gateway into dgram, its length or -1 if none is waiting
+static int gwRecv (void) {
+    socklen_t alen = sizeof(gwAddr);
+    ssize_t n = recvfrom(gwSock, dgram, GW_MAX_DGRAM, MSG_DONTWAIT, (struct sockaddr*)&gwAddr, &alen);
+    if( n >= 0 )
+        dgram[n] = 0;
+    return n;
+}
+
+static void gwStop (void) {
+    gateway_stop();
+    if( gwSock >= 0 )
+        close(gwSock);
+    gwSock = -1;
+}
+
+// The gateway forwards frames with their RSSI in dBm
+static int verifyGatewayRssi (void) {
+    sim_setDownlink(buf, 8);    // received with RegPktRssiValue 60 and a positive SNR
+    int failed = gwStart() < 0;
+    sim_run(3);
+    int rssi = 0, n;
+    while( !failed && (n = gwRecv()) >= 0 ) {
+        char* p = n > 12 ? strstr(dgram+12, "\"rssi\":") : NULL;
+        if( p )
+            rssi = atoi(p + 7);
+    }
+    gwStop();
+    return check("gateway/rssi", failed || rssi != 60 - 157);
+}
+
+// Every downlink the gateway cannot send is answered with a TX_ACK error
+static int verifyGatewayTxAck (void) {
+    int failed = gwStart() < 0;
+    sim_run(3);
+    while( gwRecv() >= 0 )      // PULL_DATA tells us where the gateway is
+        ;
+    char late[200];
+    snprintf(late, sizeof(late), "{\"txpk\":{\"tmst\":%u,\"freq\":869.525,\"modu\":\"LORA\",\"datr\":\"SF9BW125\",\"data\":\"AQID\"}}",
+             (u4_t)os_getTime() * (u4_t)(1000000/OSTICKS_PER_SEC) - 1000000);
+    const char* const cases[][2] = {
+        { "{\"ack\":1}", "INVALID_TXPK" },
+        { "{\"txpk\":{\"imme\":true,\"freq\":869.525,\"modu\":\"FSK\",\"datr\":50000,\"data\":\"AQID\"}}", "INVALID_TXPK" },
+        { "{\"txpk\":{\"imme\":true,\"freq\":915.2,\"modu\":\"LORA\",\"datr\":\"SF9BW125\",\"data\":\"AQID\"}}", "TX_FREQ" },
+        { late, "TOO_LATE" },
+    };
+    for( u1_t i=0; i<sizeof(cases)/sizeof(cases[0]) && !failed; i++ ) {
+        char resp[256] = { 2, 0x7A, (char)i, 3 };   // PULL_RESP, token 7A<i>
+        int n = snprintf(resp+4, sizeof(resp)-4, "%s", cases[i][0]);
+        sendto(gwSock, resp, 4+n, 0, (struct sockaddr*)&gwAddr, sizeof(gwAddr));
+        sim_run(3);
+        int acked = 0;
+        while( (n = gwRecv()) >= 0 ) {
+            if( n > 12 && dgram[3] == 5 && (u1_t)dgram[1] == 0x7A && (u1_t)dgram[2] == i )
+                acked = strstr(dgram+12, cases[i][1]) != NULL;
+        }
+        failed |= !acked;
+    }
+    gwStop();
+    return check("gateway/txack", failed);
+}
+
+// Crystal estimate after a downlink with FEI register value fe, received with
+// normal or inverted I/Q
+static const xtalstat_t* xtalAfterRx (bit_t inverted, s4_t fe) {
+    session();
+    radio_setXtal(0, 0);
+    LMIC.freq   = 868100000;
+    LMIC.rps    = updr2rps(DR_SF7);
+    LMIC.rxtime = os_getTime();
+    LMIC.osjob.func = FUNC_ADDR(noop);
+    mkDownlink(1, 4, 0);
+    sim_setDownlink(dnframe, dnframelen);
+    hal_disableIRQs();
+    os_radio(RADIO_RX);     // RxDone is handled when IRQs are enabled again
+    SIM.reg[0x33] = inverted ? SIM.reg[0x33] | 0x40 : SIM.reg[0x33] & ~0x40;
+    SIM.reg[0x28] = (fe >> 16) & 0x0F;
+    SIM.reg[0x29] = fe >> 8;
+    SIM.reg[0x2A] = fe;
+    hal_enableIRQs();
+    sim_run(5);
+    return radio_xtalStat(0);
+}
+
+// Inverted I/Q flips the sign of the frequency error the radio reports
+static int verifyXtalIq (void) {
+    s4_t fei = xtalAfterRx(0, 1000)->fei;
+    s4_t ppb = radio_xtalStat(0)->ppb;
+    int failed = fei <= 0 || ppb >= 0;  // signal above us - crystal slow
+    failed |= xtalAfterRx(1, 1000)->fei != -fei || radio_xtalStat(0)->ppb != -ppb;
+    radio_setXtal(0, 0);
+    return check("xtal/iq", failed);
+}
+
+// Airtime of the last hour stays counted across the ostime wrap
+static int verifyAirlogWrap (void) {
+    session();
+    ostime_t t = (ostime_t)0xFFF00000;    // 52 s before the wrap
+    LMIC.airlogStart = t;
+    airlogAdd(0, t, ms2osticks(1000));
+    int failed = airlogUsed(0, t + sec2osticks(2*60)) != ms2osticks(1000);
+    failed |= airlogUsed(0, t + sec2osticks(59*60)) != ms2osticks(1000);
+    failed |= airlogUsed(0, t + sec2osticks(61*60)) != 0;
+    // ...and across the wrap of the minute count
+    session();
+    LMIC.airlogStart = t;
+    LMIC.airlogNow   = AIRLOG_WRAP - 16;
+    airlogAdd(0, t, ms2osticks(1000));
+    airlogAdd(0, t + sec2osticks(16*60), ms2osticks(500));
+    failed |= airlogUsed(0, t + sec2osticks(17*60)) != ms2osticks(1500);
+    failed |= airlogUsed(0, t + sec2osticks(61*60)) != ms2osticks(500);
+    return check("airlog/wrap", failed);
+}
+
+// A CAD that completes with no uplink held for it must not send or reschedule one
+static int verifyLbtProbe (void) {
+    session();
+    LMIC_setLbt(1);
+    SIM.cadbusy = 0;
+    u4_t txcnt = SIM.txcnt;
+    LMIC_queueTx(1, buf, 4, 0, 0, 0, NULL, NULL);
+    int failed = !runUntilTx(txcnt, 50);
+    for( int n=0; (LMIC.opmode & OP_TXRXPEND) != 0 && n < 50 && os_runloopOnce(); n++ )
+        ;
+    lbtstat_t stat = LMIC.lbtStat;
+    u1_t chnl = LMIC.txChnl;
+    ostime_t txend = LMIC.txend;
+    txcnt = SIM.txcnt;
+    LMIC.osjob.func = FUNC_ADDR(processCad);    // probe ends on the MAC's CAD handler
+    os_radio(RADIO_CAD);
+    sim_run(5);
+    failed |= SIM.txcnt != txcnt || (LMIC.opmode & OP_TXRXPEND) != 0 || LMIC.txChnl != chnl || LMIC.txend != txend;
+    failed |= memcmp(&stat, &LMIC.lbtStat, sizeof(stat)) != 0;
+    LMIC_setLbt(0);
+    return check("lbt/probe", failed);
+}
+
+// A noise sweep must not cut off a class C downlink being received
+static int verifySweepClassC (void) {
+    session();
+    LMIC_setClassC(1);
+    sim_run(5);
+    SIM.rxbusy = 1;
+    LMIC_setNoiseSweep(sec2osticks(60));
+    sim_run(10);
+    int failed = LMIC.noiseCnt != 0 || LMIC.sweepChnl != 0;
+    SIM.rxbusy = 0;
+    for( int n=0; LMIC.noiseCnt == 0 && n < 50 && os_runloopOnce(); n++ )
+        ;
+    failed |= LMIC.noiseCnt != 1;
+    LMIC_setNoiseSweep(0);
+    LMIC_setClassC(0);
+    return check("sweep/classC", failed);
+}
+
+// A class C session restored from a snapshot listens right away
+static int verifySnapshotClassC (void) {
+    char path[] = "/tmp/lmic-bench-XXXXXX";
+    int fd = mkstemp(path);
+    int failed = fd < 0 || snapshot_open(path) < 0;
+    if( fd >= 0 )
+        close(fd);
+    session();
+    LMIC_setClassC(1);
+    sim_run(5);
+    failed |= snapshot_save() < 0;
+    LMIC_reset();
+    failed |= snapshot_restore() != 1;
+    sim_run(5);
+    failed |= (SIM.reg[0x01] & 0x87) != 0x85;  // LoRa continuous RX
+    snapshot_close();
+    unlink(path);
+    LMIC_setClassC(0);
+    return check("snapshot/classC", failed);
+}
+
+static int verify (void) {
+    int failed = verifyAirtime();
+    os_init();
+    failed |= verifyStaging();
+    failed |= verifyTxDataMaxlen();
+    failed |= verifyTxqSize();
+    failed |= verifyIq();
+    failed |= verifyGatewayRssi();
+    failed |= verifyGatewayTxAck();
+    failed |= verifyXtalIq();
+    failed |= verifyAirlogWrap();
+    failed |= verifyLbtProbe();
+    failed |= verifySweepClassC();
+    failed |= verifySnapshotClassC();
+    return failed;
+}
+
+// -----------------------------------------------------------------------------
+// Baseline comparison and output
+
+static int lookupBaseline (FILE* fp, const char* name, double* value) {
+    char line[256], bname[48];
+    double v;
+    rewind(fp);
+    while( fgets(line, sizeof(line), fp) != NULL ) {
+        const char* p = strstr(line, "\"name\": \"");
+        const char* q = strstr(line, "\"value\": ");
+        if( p == NULL || q == NULL )
+            continue;
+        if( sscanf(p+9, "%47[^\"]", bname) == 1 && sscanf(q+9, "%lf", &v) == 1 && strcmp(bname, name) == 0 ) {
+            *value = v;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int output (FILE* out, FILE* base, double threshold) {
+    int regressions = 0;
+    fprintf(out, "{\n  \"bench\": \"lmic-bench\",\n  \"results\": [\n");
+    for( int i=0; i<nresults; i++ ) {
+        struct result_t* r = &results[i];
+        double bv;
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.2f", r->name, r->unit, r->value);
+        if( base != NULL && lookupBaseline(base, r->name, &bv) ) {
+            double delta = bv != 0 ? (r->value - bv) * 100.0 / bv : 0;
+            int regressed = strcmp(r->unit, "count") == 0 ? r->value > bv : delta > threshold;
+            regressions += regressed;
+            fprintf(out, ", \"baseline\": %.2f, \"delta_pct\": %.1f, \"regressed\": %s",
+                    bv, delta, regressed ? "true" : "false");
+        }
+        fprintf(out, "}%s\n", i+1 < nresults ? "," : "");
+    }
+    fprintf(out, "  ]");
+    if( base != NULL )
+        fprintf(out, ",\n  \"regressions\": %d", regressions);
+    fprintf(out, "\n}\n");
+    return regressions;
+}
+
+static void usage (void) {
+    fprintf(stderr, "usage: lmic-bench [-o out.json] [--baseline old.json] [--threshold pct] [--filter str]\n"
+                    "       lmic-bench --verify\n");
+    exit(2);
+}
+
+int main (int argc, char** argv) {
+    const char* outfile = NULL;
+    const char* basefile = NULL;
+    double threshold = 10.0;
+
+    for( int i=1; i<argc; i++ ) {
+        if( i+1 < argc && strcmp(argv[i], "-o") == 0 )
+            outfile = argv[++i];
+        else if( i+1 < argc && strcmp(argv[i], "--baseline") == 0 )
+            basefile = argv[++i];
+        else if( i+1 < argc && strcmp(argv[i], "--threshold") == 0 )
+            threshold = atof(argv[++i]);
+        else if( i+1 < argc && strcmp(argv[i], "--filter") == 0 )
+            filter = argv[++i];
+        else if( argc == 2 && strcmp(argv[i], "--verify") == 0 )
+            return verify();
+        else
+            usage();
+    }
+    FILE* base = NULL;
+    if( basefile != NULL && (base = fopen(basefile, "r")) == NULL ) {
+        perror(basefile);
+        return 2;
+    }
+
+    os_init();
+#if defined(CFG_spitrace)
+    spitrace_enable(1);
+#endif
+    for( int i=0; i<(int)sizeof(buf); i++ )
+        buf[i] = i;
+
+    static const u1_t sizes[] = { 16, 32, 64, 112 };
+    static const struct { const char* name; u1_t mode; } modes[] = {
+        { "ecb", AES_ENC }, { "ctr", AES_CTR }, { "mic", AES_MIC },
+    };
+    char name[48];
+    for( u1_t m=0; m<sizeof(modes)/sizeof(modes[0]); m++ ) {
+        for( u1_t s=0; s<sizeof(sizes); s++ ) {
+            struct aesarg_t a = { modes[m].mode, sizes[s] };
+            snprintf(name, sizeof(name), "os_aes/%s/%d", modes[m].name, sizes[s]);
+            timeit(name, bench_aes, &a);
+        }
+    }
+    for( u1_t s=0; s<sizeof(sizes); s++ ) {
+        struct aesarg_t a = { AES_MIC, sizes[s] };
+        snprintf(name, sizeof(name), "os_cmac/%d", sizes[s]);
+        timeit(name, bench_cmac, &a);
+    }
+
+    timeit("calcAirTime/sf7-12", bench_airtime, (void*)calcAirTime);
+    timeit("airTimeOf/sf7-12", bench_airtime, (void*)airTimeOf);
+
+    static const u1_t plens[] = { 0, 11, 51, 242 };
+    session();
+    for( u1_t s=0; s<sizeof(plens); s++ ) {
+        u1_t len = plens[s];
+        snprintf(name, sizeof(name), "buildDataFrame/%d", len);
+        timeit(name, bench_buildDataFrame, &len);
+    }
+
+    session();
+    for( u1_t s=0; s<sizeof(plens); s++ ) {
+        mkDownlink(1, plens[s], 0);
+        snprintf(name, sizeof(name), "decodeFrame/%d", plens[s]);
+        timeit(name, bench_decodeFrame, NULL);
+    }
+    mkDownlink(1, 11, sizeof(MACOPTS));
+    snprintf(name, sizeof(name), "decodeFrame/11+fopts%d", (int)sizeof(MACOPTS));
+    timeit(name, bench_decodeFrame, NULL);
+
+    session();
+    timeit("macCmds/parse", bench_parseMacCmds, NULL);
+    timeit("macCmds/pack", bench_packMacOpts, NULL);
+
+    timeit("os_timer/churn16", bench_timerChurn, NULL);
+
+    session();
+    timeit("nextTx", bench_nextTx, NULL);
+    LMIC_setChnlPolicy(CHNL_QUALITY);
+    timeit("nextTx/quality", bench_nextTx, NULL);
+
+    mkDownlink(1, 11, 0);
+    bench_spi();
+
+    FILE* out = stdout;
+    if( outfile != NULL && (out = fopen(outfile, "w")) == NULL ) {
+        perror(outfile);
+        return 2;
+    }
+    int regressions = output(out, base, threshold);
+    if( out != stdout )
+        fclose(out);
+    if( base != NULL )
+        fclose(base);
+    return regressions ? 1 : 0;
+}
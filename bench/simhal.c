@@ -0,0 +1,258 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Simulated HAL, see simhal.h.
+ *******************************************************************************/
+
+#include "simhal.h"
+#include "spitrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// SX127x register addresses used by the model
+#define REG_FIFO            0x00
+#define REG_OPMODE          0x01
+#define LORA_FIFOADDRPTR    0x0D
+#define LORA_FIFOTXBASE     0x0E
+#define LORA_FIFORXBASE     0x0F
+#define LORA_FIFORXCURRENT  0x10
+#define LORA_IRQFLAGS       0x12
+#define LORA_RXNBBYTES      0x13
+#define LORA_MODEMSTAT      0x18
+#define LORA_PKTSNR         0x19
+#define LORA_PKTRSSI        0x1A
+#define LORA_PAYLOADLENGTH  0x22
+#define LORA_RSSIWIDEBAND   0x2C
+#define FSK_PAYLOADLENGTH   0x32
+#define LORA_INVERTIQ       0x33
+#define LORA_INVERTIQ2      0x3B
+#define FSK_IRQFLAGS1       0x3E
+#define FSK_IRQFLAGS2       0x3F
+#define REG_VERSION         0x42
+
+#define OPMODE_LORA         0x80
+#define OPMODE_MASK         0x07
+#define OPMODE_STANDBY      0x01
+#define OPMODE_TX           0x03
+#define OPMODE_RX           0x05
+#define OPMODE_RX_SINGLE    0x06
+#define OPMODE_CAD          0x07
+
+#define IRQ_LORA_RXTOUT     0x80
+#define IRQ_LORA_RXDONE     0x40
+#define IRQ_LORA_TXDONE     0x08
+#define IRQ_LORA_CDDONE     0x04
+#define IRQ_LORA_CDDETD     0x01
+
+struct simradio_t SIM;
+
+static u4_t simtime = 1;
+static int  irqlevel;
+
+static void simRaise (u1_t dio) {
+    SIM.dio[dio] = 1;
+}
+
+static void loraOpmode (u1_t mode) {
+    switch( mode ) {
+    case OPMODE_TX:
+        SIM.txlen = SIM.reg[LORA_PAYLOADLENGTH];
+        memcpy(SIM.tx, SIM.fifo + SIM.reg[LORA_FIFOTXBASE], SIM.txlen);
+        SIM.txiq  = SIM.reg[LORA_INVERTIQ];
+        SIM.txiq2 = SIM.reg[LORA_INVERTIQ2];
+        SIM.reg[LORA_IRQFLAGS] |= IRQ_LORA_TXDONE;
+        SIM.reg[REG_OPMODE] = (SIM.reg[REG_OPMODE] & ~OPMODE_MASK) | OPMODE_STANDBY;
+        SIM.txcnt++;
+        simRaise(0);
+        break;
+    case OPMODE_RX:
+    case OPMODE_RX_SINGLE:
+        if( SIM.dllen >= 0 ) {
+            memcpy(SIM.fifo + SIM.reg[LORA_FIFORXBASE], SIM.dl, SIM.dllen);
+            SIM.reg[LORA_FIFORXCURRENT] = SIM.reg[LORA_FIFORXBASE];
+            SIM.reg[LORA_RXNBBYTES] = SIM.dllen;
+            SIM.reg[LORA_PKTSNR]  = 20;   // 5dB
+            SIM.reg[LORA_PKTRSSI] = 60;
+            SIM.reg[LORA_IRQFLAGS] |= IRQ_LORA_RXDONE;
+            SIM.dllen = -1;
+            SIM.rxcnt++;
+            simRaise(0);
+        } else if( mode == OPMODE_RX_SINGLE ) {
+            SIM.reg[LORA_IRQFLAGS] |= IRQ_LORA_RXTOUT;
+            simRaise(1);
+        }
+        break;
+    case OPMODE_CAD:
+        SIM.reg[LORA_IRQFLAGS] |= IRQ_LORA_CDDONE | (SIM.cadbusy ? IRQ_LORA_CDDETD : 0);
+        simRaise(0);
+        break;
+    }
+}
+
+static void fskOpmode (u1_t mode) {
+    switch( mode ) {
+    case OPMODE_TX:
+        SIM.reg[FSK_IRQFLAGS2] |= 0x08;   // PacketSent
+        SIM.txcnt++;
+        simRaise(0);
+        break;
+    case OPMODE_RX:
+        if( SIM.dllen >= 0 ) {
+            SIM.reg[FSK_PAYLOADLENGTH] = SIM.dllen;
+            memcpy(SIM.fifo, SIM.dl, SIM.dllen);
+            SIM.reg[FSK_IRQFLAGS2] |= 0x04;   // PayloadReady
+            SIM.dllen = -1;
+            SIM.rxcnt++;
+            simRaise(0);
+        } else {
+            SIM.reg[FSK_IRQFLAGS1] |= 0x04;   // Timeout
+            simRaise(2);
+        }
+        break;
+    }
+}
+
+static u1_t simRead (u1_t addr) {
+    switch( addr ) {
+    case REG_FIFO:          return SIM.fifo[SIM.reg[LORA_FIFOADDRPTR]++];
+    case REG_VERSION:       return 0x12;
+    case LORA_RSSIWIDEBAND: return (u1_t)rand();
+    case LORA_MODEMSTAT:    return SIM.rxbusy ? 0x0B : 0x04;
+    default:                return SIM.reg[addr];
+    }
+}
+
+static void simWrite (u1_t addr, u1_t val) {
+    switch( addr ) {
+    case REG_FIFO:
+        SIM.fifo[SIM.reg[LORA_FIFOADDRPTR]++] = val;
+        return;
+    case REG_OPMODE:
+        SIM.reg[REG_OPMODE] = val;
+        if( val & OPMODE_LORA )
+            loraOpmode(val & OPMODE_MASK);
+        else
+            fskOpmode(val & OPMODE_MASK);
+        return;
+    case LORA_IRQFLAGS:
+        if( SIM.reg[REG_OPMODE] & OPMODE_LORA ) { // write 1 to clear
+            SIM.reg[LORA_IRQFLAGS] &= ~val;
+            return;
+        }
+        break;
+    }
+    SIM.reg[addr] = val;
+}
+
+void sim_setDownlink (xref2cu1_t frame, int len) {
+    memcpy(SIM.dl, frame, len);
+    SIM.dllen = len;
+}
+
+int sim_run (int maxjobs) {
+    int n = 0;
+    while( n < maxjobs && os_runloopOnce() )
+        n++;
+    return n;
+}
+
+void sim_clearCounters (void) {
+    SIM.spixfers = SIM.spibytes = 0;
+}
+
+// -----------------------------------------------------------------------------
+// HAL
+
+void hal_init (void) {
+    SIM.dllen = -1;
+}
+
+// one radio
+void hal_selectRadio (u1_t radio) {
+    ASSERT(radio == 0);
+}
+
+u1_t hal_currentRadio (void) {
+    return 0;
+}
+
+u1_t hal_radioCount (void) {
+    return 1;
+}
+
+void hal_pin_rxtx (u1_t val) {
+}
+
+void hal_pin_rst (u1_t val) {
+}
+
+void hal_pin_nss (u1_t val) {
+    SPITRACE_NSS(val);
+    if( val == 0 ) {
+        SIM.inxfer = 1;
+    } else {
+        SIM.inxfer = 0;
+        SIM.spixfers++;
+    }
+    SIM.nss = val;
+}
+
+u1_t hal_spi (u1_t out) {
+    SPITRACE_BYTE(out);
+    SIM.spibytes++;
+    if( SIM.inxfer == 1 ) { // address byte
+        SIM.addr = out & 0x7F;
+        SIM.wr = out & 0x80;
+        SIM.inxfer = 2;
+        return 0;
+    }
+    u1_t addr = SIM.addr;
+    if( addr != REG_FIFO ) // burst access auto-increments except on FIFO
+        SIM.addr++;
+    if( SIM.wr ) {
+        simWrite(addr, out);
+        return 0;
+    }
+    return simRead(addr);
+}
+
+void hal_disableIRQs (void) {
+    irqlevel++;
+}
+
+void hal_enableIRQs (void) {
+    if( --irqlevel == 0 ) {
+        for( u1_t i=0; i<3; i++ ) {
+            if( SIM.dio[i] ) {
+                SIM.dio[i] = 0;
+                radio_irq_handler(i);
+            }
+        }
+    }
+}
+
+void hal_sleep (void) {
+}
+
+u4_t hal_ticks (void) {
+    return simtime;
+}
+
+void hal_waitUntil (u4_t time) {
+    if( (s4_t)(time - simtime) > 0 )
+        simtime = time;
+}
+
+// Virtual time - jump straight past the deadline
+u1_t hal_checkTimer (u4_t time) {
+    if( (s4_t)(time - simtime) >= 0 )
+        simtime = time + 1;
+    return 1;
+}
+
+void hal_failed (const char *file, u2_t line) {
+    fprintf(stderr, "FAILURE %s:%d\n", file, line);
+    abort();
+}
@@ -0,0 +1,44 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Simulated HAL for running LMIC off-target: virtual time and a register
+ * level model of the SX127x good enough to drive radio.c through TX, RX,
+ * RX timeouts and CAD without hardware.
+ *******************************************************************************/
+
+#ifndef _simhal_h_
+#define _simhal_h_
+
+#include "lmic.h"
+
+struct simradio_t {
+    u1_t reg[0x80];
+    u1_t fifo[256];
+    u1_t nss, addr, wr, inxfer;
+    u1_t dio[3];        // pending DIO edges, delivered on hal_enableIRQs
+    u1_t dl[256];       // frame to deliver on next RX (see sim_setDownlink)
+    int  dllen;         // -1 if none pending
+    u1_t tx[256];       // last transmitted frame
+    int  txlen;
+    u1_t txiq, txiq2;   // RegInvertIQ and RegInvertIQ2 at the last LoRa TX
+    u1_t cadbusy;       // CAD reports activity
+    u1_t rxbusy;        // modem status reports a frame coming in
+    u4_t spixfers;      // NSS assertions
+    u4_t spibytes;      // bytes clocked incl. address byte
+    u4_t txcnt, rxcnt;
+};
+extern struct simradio_t SIM;
+
+//! Queue a frame to be received by the next RX window.
+void sim_setDownlink (xref2cu1_t frame, int len);
+
+//! Run jobs until the scheduler is idle or `maxjobs` have run.
+//! Timed jobs are run immediately by advancing virtual time.
+int sim_run (int maxjobs);
+
+//! Reset SPI counters.
+void sim_clearCounters (void);
+
+#endif // _simhal_h_
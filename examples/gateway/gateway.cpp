@@ -0,0 +1,71 @@
+/*******************************************************************************
+ * Single channel gateway: listens on one frequency and spreading factor and
+ * forwards every LoRa frame to a network server with the Semtech UDP packet
+ * forwarder protocol, see lmic/gateway.h.
+ *
+ *   gateway [host [port [freq [sf]]]]
+ *
+ * defaults: localhost 1700 868100000 7 - e.g. a local stand-in server for
+ * testing. Change GWEUI to the EUI registered for this gateway.
+ *
+ * Do not forget to define the radio type correctly in config.h.
+ *******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <lmic.h>
+#include <hal.h>
+#include <local_hal.h>
+#include <gateway.h>
+
+// Gateway EUI (MSB first)
+static const u1_t GWEUI[8] = { 0xB8, 0x27, 0xEB, 0xFF, 0xFE, 0x00, 0x00, 0x01 };
+
+// Not used - no LoRaWAN MAC runs in this example
+void os_getArtEui (u1_t* buf) { }
+void os_getDevEui (u1_t* buf) { }
+void os_getDevKey (u1_t* buf) { }
+void onEvent (ev_t ev) { }
+
+// Pin mapping
+lmic_pinmap pins = {
+  .nss = 6,
+  .rxtx = UNUSED_PIN, // Not connected on RFM92/RFM95
+  .rst = 0,  // Needed on RFM92/RFM95
+  .dio = {7,4,5}
+};
+
+static osjob_t reportjob;
+
+static void report (osjob_t* j) {
+    const gwstat_t* st = gateway_stat();
+    fprintf(stdout, "rx %u forwarded %u datagrams %u acks %u errors %u\n",
+            st->rxnb, st->rxfw, st->dgrams, st->acks, st->errors);
+    os_setTimedCallback(j, os_getTime()+sec2osticks(60), report);
+}
+
+int main (int argc, char** argv) {
+    const char* host = argc > 1 ? argv[1] : "localhost";
+    u2_t port = argc > 2 ? atoi(argv[2]) : GW_PORT;
+    rawcfg_t cfg;
+    cfg.freq  = argc > 3 ? strtoul(argv[3], NULL, 0) : 868100000;
+    int sf    = argc > 4 ? atoi(argv[4]) : 7;
+    if( sf < 7 || sf > 12 ) {
+        fprintf(stderr, "sf must be 7..12\n");
+        return 1;
+    }
+    cfg.rps   = makeRps((sf_t)(SF7 + sf - 7), BW125, CR_4_5, 0, 0);
+    cfg.txpow = 14;
+    cfg.iq    = RAW_IQ_NORMAL;  // uplinks
+    cfg.sync  = RAW_SYNC_PUBLIC;
+
+    os_init();
+    if( gateway_start(0, &cfg, GWEUI, host, port) < 0 ) {
+        fprintf(stderr, "cannot reach %s:%u\n", host, port);
+        return 1;
+    }
+    fprintf(stdout, "forwarding %u Hz SF%d to %s:%u\n", cfg.freq, sf, host, port);
+    report(&reportjob);
+    os_runloop();
+    return 0;
+}
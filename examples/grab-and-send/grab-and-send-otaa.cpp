@@ -28,10 +28,15 @@
 #include <time.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <unistd.h>
 #include <wiringPi.h>
 #include <lmic.h>
 #include <hal.h>
 #include <local_hal.h>
+#include <snapshot.h>
+#include <fcntlog.h>
+
+#define JOURNAL "/framectrdata/lmic.journal"
 
 
 // This EUI must be in little-endian format, so least-significant-byte
@@ -55,11 +60,33 @@ static const u1_t APPKEY[16] = { 0x82, 0xE8, 0x70, 0xB5, 0xA1, 0x1F, 0x33, 0xDB,
 void os_getDevKey (u1_t* buf) { memcpy(buf, APPKEY, 16);}
 
 u4_t cntr=0;
-u1_t senddata[] = {"No data yet!                               "};
 u4_t senddatalen = 0;
 long long lasttime = 0;
 FILE* howmanyprocess;
 static osjob_t sendjob;
+static u4_t syncedDn;
+
+// Frame counters must never be reused - stop instead of sending with
+// counters that would not survive a restart
+static void journalFailed() {
+    perror("Error: Could not update " JOURNAL);
+    LMIC_shutdown();
+    snapshot_sync();
+    exit(1);
+}
+
+// Reserve the next block of uplink counters if needed, persist seqnoDn if it moved
+static void updateFramectrs() {
+    if(fcntlog_update() < 0) {
+        journalFailed();
+    }
+    if(LMIC.seqnoDn != syncedDn) {
+        if(fcntlog_sync() < 0) {
+            journalFailed();
+        }
+        syncedDn = LMIC.seqnoDn;
+    }
+}
 
 // Pin mapping
 lmic_pinmap pins = {
@@ -89,11 +116,20 @@ void onEvent (ev_t ev) {
                 fprintf(stdout, "EV_JOINING\n");
                 break;
             case EV_JOINED:
-                fprintf(stdout, "EV_JOINED\n");
+                fprintf(stdout, "EV_JOINED after %d ms, %d requests, %d ms airtime%s\n",
+                        osticks2ms(LMIC.joinStat.latency), LMIC.joinStat.attempts,
+                        osticks2ms(LMIC.joinStat.airtime), LMIC.joinStat.hinted ? " (hint)" : "");
 
                 // Disable link check validation (automatically enabled
                 // during join, but not supported by TTN at this time).
                 LMIC_setLinkCheckMode(0);
+                // New session, counters start over - so does the journal
+                unlink(JOURNAL);
+                if(fcntlog_open(JOURNAL, FCNTLOG_BLOCK) < 0) {
+                    journalFailed();
+                }
+                syncedDn = LMIC.seqnoDn;
+                snapshot_save();
                 break;
             case EV_RFU1:
                 fprintf(stdout, "EV_RFU1\n");
@@ -114,6 +150,8 @@ void onEvent (ev_t ev) {
                     //debug_buf(LMIC.frame+LMIC.dataBeg, LMIC.dataLen);
                     fprintf(stdout, "Data Received!\n");
                 }
+                updateFramectrs();
+                snapshot_save();
                 break;
             case EV_LOST_TSYNC:
                 fprintf(stdout, "EV_LOST_TSYNC\n");
@@ -162,7 +200,6 @@ static void do_send(osjob_t* j){
       /* Write data to send */
       if(time > lasttime && people >= 0) {
           senddatalen = 1;
-          senddata[0] = (unsigned char)people;
       } else {
           senddatalen = 0;
       }
@@ -173,12 +210,27 @@ static void do_send(osjob_t* j){
       // Check if there is not a current TX/RX job running
     if (LMIC.opmode & (1 << 7)) {
       fprintf(stdout, "OP_TXRXPEND, not sending. Resetting...");
+      // The snapshot is from the last EV_TXCOMPLETE, its counters may have
+      // been used on air since - keep the live ones
+      u4_t seqnoUp = LMIC.seqnoUp, seqnoDn = LMIC.seqnoDn;
       LMIC_reset();
+      snapshot_restore();
+      LMIC.seqnoUp = seqnoUp;
+      LMIC.seqnoDn = seqnoDn;
+      updateFramectrs();
     } else if(senddatalen > 0) {
-      // Prepare upstream data transmission at the next possible time.
-      LMIC_setTxData2(1, senddata, senddatalen, 0);
-      //set last transmitted time
-      lasttime = time;
+      // Write the payload straight into the next frame, it goes out at the next possible time.
+      u1_t maxlen;
+      xref2u1_t payload = LMIC_beginTxData(1, 0, &maxlen);
+      if(senddatalen <= maxlen) {
+          payload[0] = (unsigned char)people;
+          LMIC_commitTxData(senddatalen);
+          //set last transmitted time
+          lasttime = time;
+      } else {
+          // Pending MAC answers leave no room at this data rate - try again next round
+          fprintf(stdout, "Payload too large (%u > %u), not sending\n", senddatalen, maxlen);
+      }
     }
     // Schedule a timed job to run at the given timestamp (absolute system time)
     os_setTimedCallback(j, os_getTime()+sec2osticks(30), do_send);
@@ -194,6 +246,19 @@ void setup() {
   LMIC_setDrTxpow(DR_SF9,14);
 
   LMIC_reset();
+
+  // Continue the last session instead of joining again
+  if(snapshot_open("/framectrdata/lmic.snapshot") < 0) {
+      fprintf(stderr, "Cannot open snapshot file\n");
+  } else if(snapshot_restore() == 1) {
+      fprintf(stdout, "Session restored, devaddr %08x\n", LMIC.devaddr);
+  }
+  // Counters of the restored session, the journal keeps the higher ones
+  if(fcntlog_open(JOURNAL, FCNTLOG_BLOCK) < 0) {
+      perror("Error: Could not open " JOURNAL);
+      exit(1);
+  }
+  syncedDn = LMIC.seqnoDn;
 }
 
 void loop() {
@@ -211,6 +276,8 @@ void intHandler(int dummy) {
         pclose(howmanyprocess);
     }
     LMIC_shutdown();
+    fcntlog_sync();
+    snapshot_sync();
     exit(0);
 }
 
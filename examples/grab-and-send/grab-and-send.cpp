@@ -33,6 +33,7 @@
 #include <lmic.h>
 #include <hal.h>
 #include <local_hal.h>
+#include <fcntlog.h>
 
 // LoRaWAN Application identifier (AppEUI)
 // Not used in this example
@@ -74,9 +75,9 @@ void os_getDevKey (u1_t* buf) {
 }
 
 u4_t cntr=0;
-u1_t senddata[] = {"No data yet!                               "};
-u4_t senddatalen = 0;
 long long lasttime = 0;
+// a queued people count older than this is not worth sending anymore
+#define STALE_SECS 300
 //FILE* howmanyprocess;
 static osjob_t sendjob;
 
@@ -164,6 +165,8 @@ int readTTNConnectionDataFromFile() {
     return 1;
 }
 
+static u4_t syncedDn;   // seqnoDn in the journal
+
 void LMIC_setup() {
     // Reset the MAC state. Session and pending data transfers will be discarded.
     LMIC_reset();
@@ -171,20 +174,21 @@ void LMIC_setup() {
     // by joining the network, precomputed session parameters are be provided.
     LMIC_setSession (0x1, DEVADDR, (u1_t*)DEVKEY, (u1_t*)ARTKEY);
     //Get framecounters from persistent storage
-    FILE* fp = fopen("/framectrdata/framectrs.txt", "r");
-    char buf[1024];
-    if(fp != NULL) {
-        // Get output line by line
-        while(fgets(buf, sizeof(buf), fp) != NULL) {
-            char* pEnd;
-            LMIC.seqnoUp = (u4_t) strtol(buf, &pEnd, 10);
-            LMIC.seqnoDn = (u4_t) strtol(pEnd, NULL, 10);
-            fprintf(stdout, "Got up frames %u and downframes %u from file!\n", LMIC.seqnoUp, LMIC.seqnoDn);
-        }
-        fclose(fp);
+    int rc = fcntlog_open("/framectrdata/framectrs.journal", FCNTLOG_BLOCK);
+    if(rc < 0) {
+        perror("Error: Could not open /framectrdata/framectrs.journal");
+        exit(1);
+    }
+    // Counters of older versions, which rewrote this file on every uplink
+    if(fcntlog_import("/framectrdata/framectrs.txt") > 0) {
+        rc = 1;
+    }
+    if(rc > 0) {
+        fprintf(stdout, "Got up frames %u and downframes %u from file!\n", LMIC.seqnoUp, LMIC.seqnoDn);
     } else {
         fprintf(stdout, "Could not find stroed framecounters, starting with default 0!\n");
     }
+    syncedDn = LMIC.seqnoDn;
     // Disable data rate adaptation
     LMIC_setAdrMode(0);
     // Disable link check validation
@@ -197,14 +201,37 @@ void LMIC_setup() {
     LMIC.dn2Dr = DR_SF9;
     // Set data rate and transmit power (note: txpow seems to be ignored by the library)
     LMIC_setDrTxpow(DR_SF9,14);
+    // Let the device move between SF7 and SF12 from downlink margins (starting at SF9),
+    // keeping ~90% of confirmed uplinks acked
+    LMIC_setLinkCtl(230);
+    // Mains powered - keep listening on RX2 so control commands arrive right away
+    LMIC_setClassC(1);
     //
 }
 
+// Frame counters must never be reused - stop instead of sending with
+// counters that would not survive a restart
+static void journalFailed() {
+    perror("Error: Could not update /framectrdata/framectrs.journal");
+    LMIC_shutdown();
+    exit(1);
+}
+
+// Uplink counters are reserved in blocks, so this only writes when a block is used up
+// or seqnoDn moved - downlinks with MAC commands only advance it too
 void updateFramectrs() {
-    FILE* fp = fopen("/framectrdata/framectrs.txt", "w");
-    fprintf(fp, "%u %u", LMIC.seqnoUp, LMIC.seqnoDn);
-    fprintf(stdout, "Updated framecounters upframes %u, downframes %u\n", LMIC.seqnoUp, LMIC.seqnoDn);
-    fclose(fp);
+    if(fcntlog_update() < 0) {
+        journalFailed();
+    }
+    if(LMIC.seqnoDn == syncedDn) {
+        return;
+    }
+    if(fcntlog_sync() < 0) {
+        journalFailed();
+    }
+    syncedDn = LMIC.seqnoDn;
+    fprintf(stdout, "Updated framecounters upframes %u (reserved up to %u), downframes %u\n",
+            LMIC.seqnoUp, fcntlog_limit(), LMIC.seqnoDn);
 }
 
 //param datastr null terminated string
@@ -236,7 +263,7 @@ void rstrip(char* buff) {
     }
 }
 
-void processReceivedData(char* data, int len) {
+void processReceivedData(const u1_t* data, int len) {
     char command[len + 200];
     size_t cx = 0;
     fprintf(stdout, "Got data bytes: ");
@@ -312,6 +339,17 @@ void processReceivedData(char* data, int len) {
     }
 }
 
+// Process and release every downlink the MAC has buffered since the last call
+void processDownlinks() {
+    const dnmsg_t* msg;
+    while((msg = LMIC_peekDnData(0)) != NULL) {
+        fprintf(stdout, "Data Received on port %d!\n", msg->port);
+        processReceivedData(msg->data, msg->dataLen);
+        LMIC_releaseDnData(msg);
+    }
+    updateFramectrs();
+}
+
 void onEvent (ev_t ev) {
     //debug_event(ev);
 
@@ -353,15 +391,9 @@ void onEvent (ev_t ev) {
                 if (LMIC.txrxFlags & TXRX_ACK) {
                     fprintf(stdout, "Received ack\n");
                 }
-                //update framecounters in persistent storage
-                updateFramectrs();
-                if(LMIC.dataLen) { // data received in rx slot after tx
-                    //debug_buf(LMIC.frame+LMIC.dataBeg, LMIC.dataLen);
-                    char receivedData[LMIC.dataLen];
-                    memcpy(receivedData, LMIC.frame+LMIC.dataBeg, LMIC.dataLen);
-                    fprintf(stdout, "Data Received!\n");
-                    processReceivedData(receivedData, sizeof(receivedData));
-                }
+                // data received in rx slot after tx, then reserve the next block
+                // of framecounters in persistent storage if needed
+                processDownlinks();
                 break;
             case EV_LOST_TSYNC:
                 fprintf(stdout, "EV_LOST_TSYNC\n");
@@ -370,8 +402,9 @@ void onEvent (ev_t ev) {
                 fprintf(stdout, "EV_RESET\n");
                 break;
             case EV_RXCOMPLETE:
-                // data received in ping slot
+                // data received in class C RX (or ping slot)
                 fprintf(stdout, "EV_RXCOMPLETE\n");
+                processDownlinks();
                 break;
             case EV_LINK_DEAD:
                 fprintf(stdout, "EV_LINK_DEAD\n");
@@ -385,6 +418,12 @@ void onEvent (ev_t ev) {
     }
 }
 
+// Completion of a queued reading
+static void tx_done(void* ctx, u1_t status) {
+    static const char* const names[] = { "sent", "acked", "not acked", "expired", "canceled" };
+    fprintf(stdout, "Reading %s, %d queued\n", names[status], LMIC_txQueueLen());
+}
+
 static void do_send(osjob_t* j){
       time_t t=time(NULL);
       fprintf(stdout, "[%x] (%ld) %s\n", hal_ticks(), t, ctime(&t));
@@ -429,24 +468,15 @@ static void do_send(osjob_t* j){
       }
       printf("Got time: %lld people: %d from file\n", time, people);
 
-      /* Write data to send */
-      if(time > lasttime && people >= 0) {
-          senddatalen = 1;
-          senddata[0] = (unsigned char)people;
-      } else {
-          senddatalen = 0;
-      }
-
       /* Send data */
 
-      // Show TX channel (channel numbers are local to LMIC)
-      // Check if there is not a current TX/RX job running
-    if (LMIC.opmode & (1 << 7)) {
-      fprintf(stdout, "OP_TXRXPEND, not sending. Resetting...");
-      LMIC_setup();
-    } else if(senddatalen > 0) {
-      // Prepare upstream data transmission at the next possible time.
-      LMIC_setTxData2(1, senddata, senddatalen, 0);
+    if(time > lasttime && people >= 0) {
+      // Queue the reading - the MAC sends it when the duty cycle allows and
+      // drops it if it is still waiting once the count is stale.
+      u1_t payload = (u1_t)people;
+      if (LMIC_queueTx(1, &payload, 1, 0, 0, os_getTime()+sec2osticks(STALE_SECS), tx_done, NULL) < 0) {
+        fprintf(stdout, "Uplink queue full, dropping reading\n");
+      }
       //set last transmitted time
       lasttime = time;
     }
@@ -204,16 +204,16 @@ u4_t AESAUX[16/sizeof(u4_t)];
 u4_t AESKEY[11*16/sizeof(u4_t)];
 
 // generate 1+10 roundkeys for encryption with 128-bit key
-// read 128-bit key from AESKEY in MSBF, generate roundkey words in place
-static void aesroundkeys () {
+// read 128-bit key from rk in MSBF, generate roundkey words in place
+static void aesroundkeys (u4_t* rk) {
     int i;
     u4_t b;
 
     for( i=0; i<4; i++) {
-        AESKEY[i] = swapmsbf(AESKEY[i]);
+        rk[i] = swapmsbf(rk[i]);
     }
     
-    b = AESKEY[3];
+    b = rk[3];
     for( ; i<44; i++ ) {
         if( i%4==0 ) {
             // b = SubWord(RotWord(b)) xor Rcon[i/4]
@@ -223,13 +223,42 @@ static void aesroundkeys () {
                 (AES_S[   b >> 24 ]      ) ^
                  AES_RCON[(i-4)/4];
         }
-        AESKEY[i] = b ^= AESKEY[i-4];
+        rk[i] = b ^= rk[i-4];
     }
 }
 
+// encrypt block in a0-a3 with roundkeys at rk - uses t0-t3,ki,ke as scratch
+#define AES_encrypt(rk)        ki = (rk);                      \
+                               ke = ki + 8*4;                  \
+                               a0 ^= ki[0];                    \
+                               a1 ^= ki[1];                    \
+                               a2 ^= ki[2];                    \
+                               a3 ^= ki[3];                    \
+                               do {                            \
+                                   AES_key4 (t1,t2,t3,t0,4);   \
+                                   AES_expr4(t1,t2,t3,t0,a0);  \
+                                   AES_expr4(t2,t3,t0,t1,a1);  \
+                                   AES_expr4(t3,t0,t1,t2,a2);  \
+                                   AES_expr4(t0,t1,t2,t3,a3);  \
+                                   AES_key4 (a1,a2,a3,a0,8);   \
+                                   AES_expr4(a1,a2,a3,a0,t0);  \
+                                   AES_expr4(a2,a3,a0,a1,t1);  \
+                                   AES_expr4(a3,a0,a1,a2,t2);  \
+                                   AES_expr4(a0,a1,a2,a3,t3);  \
+                               } while( (ki+=8) < ke );        \
+                               AES_key4 (t1,t2,t3,t0,4);       \
+                               AES_expr4(t1,t2,t3,t0,a0);      \
+                               AES_expr4(t2,t3,t0,t1,a1);      \
+                               AES_expr4(t3,t0,t1,t2,a2);      \
+                               AES_expr4(t0,t1,t2,t3,a3);      \
+                               AES_expr(a0,t0,t1,t2,t3,8);     \
+                               AES_expr(a1,t1,t2,t3,t0,9);     \
+                               AES_expr(a2,t2,t3,t0,t1,10);    \
+                               AES_expr(a3,t3,t0,t1,t2,11)
+
 u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
         
-        aesroundkeys();
+        aesroundkeys(AESKEY);
 
         if( mode & AES_MICNOAUX ) {
             AESAUX[0] = AESAUX[1] = AESAUX[2] = AESAUX[3] = 0;
@@ -240,7 +269,7 @@ u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
             AESAUX[3] = swapmsbf(AESAUX[3]);
         }
 
-        while( (signed char)len > 0 ) {
+        while( (s2_t)len > 0 ) {
             u4_t a0, a1, a2, a3;
             u4_t t0, t1, t2, t3;
             u4_t *ki, *ke;
@@ -275,36 +304,7 @@ u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
             }
 
             // perform AES encryption on block in a0-a3
-            ki = AESKEY;
-            ke = ki + 8*4;
-            a0 ^= ki[0];
-            a1 ^= ki[1];
-            a2 ^= ki[2];
-            a3 ^= ki[3];
-            do {
-                AES_key4 (t1,t2,t3,t0,4);
-                AES_expr4(t1,t2,t3,t0,a0);
-                AES_expr4(t2,t3,t0,t1,a1);
-                AES_expr4(t3,t0,t1,t2,a2);
-                AES_expr4(t0,t1,t2,t3,a3);
-
-                AES_key4 (a1,a2,a3,a0,8);
-                AES_expr4(a1,a2,a3,a0,t0);
-                AES_expr4(a2,a3,a0,a1,t1);
-                AES_expr4(a3,a0,a1,a2,t2);
-                AES_expr4(a0,a1,a2,a3,t3);
-            } while( (ki+=8) < ke );
-
-            AES_key4 (t1,t2,t3,t0,4);
-            AES_expr4(t1,t2,t3,t0,a0);
-            AES_expr4(t2,t3,t0,t1,a1);
-            AES_expr4(t3,t0,t1,t2,a2);
-            AES_expr4(t0,t1,t2,t3,a3);
-
-            AES_expr(a0,t0,t1,t2,t3,8);
-            AES_expr(a1,t1,t2,t3,t0,9);
-            AES_expr(a2,t2,t3,t0,t1,10);
-            AES_expr(a3,t3,t0,t1,t2,11);
+            AES_encrypt(AESKEY);
             // result of AES encryption in a0-a3
 
             if( mode & AES_MIC ) {
@@ -365,3 +365,91 @@ u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
         return AESAUX[0];
 }
 
+
+// ================================================================================
+// Incremental AES-CMAC
+
+// Roundkeys of the most recently used CMAC key - LoRaWAN traffic mostly
+// reuses the same NwkSKey so expansion is skipped on repeated use.
+static u4_t CMACKEY[11*16/sizeof(u4_t)];
+static u1_t CMACRAW[16];
+static u1_t cmacKeyValid;
+
+// Absorb one full 16-byte block (not the final one) into the CBC state
+static void cmacblock (aescmac_t* ctx, xref2cu1_t p, u4_t k0, u4_t k1, u4_t k2, u4_t k3) {
+    u4_t a0, a1, a2, a3;
+    u4_t t0, t1, t2, t3;
+    const u4_t *ki, *ke;
+
+    a0 = ctx->x[0] ^ msbf4_read(p+0)  ^ k0;
+    a1 = ctx->x[1] ^ msbf4_read(p+4)  ^ k1;
+    a2 = ctx->x[2] ^ msbf4_read(p+8)  ^ k2;
+    a3 = ctx->x[3] ^ msbf4_read(p+12) ^ k3;
+    AES_encrypt(CMACKEY);
+    ctx->x[0] = a0;
+    ctx->x[1] = a1;
+    ctx->x[2] = a2;
+    ctx->x[3] = a3;
+}
+
+void os_cmacInit (aescmac_t* ctx, xref2cu1_t key) {
+    if( !cmacKeyValid || memcmp(CMACRAW, key, 16) != 0 ) {
+        os_copyMem(CMACRAW, key, 16);
+        os_copyMem(CMACKEY, key, 16);
+        aesroundkeys(CMACKEY);
+        cmacKeyValid = 1;
+    }
+    ctx->x[0] = ctx->x[1] = ctx->x[2] = ctx->x[3] = 0;
+    ctx->blen = 0;
+}
+
+void os_cmacUpdate (aescmac_t* ctx, xref2cu1_t data, uint len) {
+    while( len > 0 ) {
+        // The last block gets special treatment in os_cmacFinal -
+        // only absorb a full block once we know more data follows.
+        if( ctx->blen == 16 ) {
+            cmacblock(ctx, ctx->buf, 0, 0, 0, 0);
+            ctx->blen = 0;
+        }
+        if( ctx->blen == 0 && len > 16 ) {
+            // aligned - consume directly from caller's span
+            cmacblock(ctx, data, 0, 0, 0, 0);
+            data += 16;
+            len  -= 16;
+            continue;
+        }
+        uint n = 16 - ctx->blen;
+        if( n > len )
+            n = len;
+        os_copyMem(ctx->buf+ctx->blen, data, n);
+        ctx->blen += n;
+        data += n;
+        len  -= n;
+    }
+}
+
+u4_t os_cmacFinal (aescmac_t* ctx) {
+    u4_t a0, a1, a2, a3;
+    u4_t t0, t1, t2, t3;
+    const u4_t *ki, *ke;
+
+    // derive subkey K1 (full last block) or K2 (padded) from E(0)
+    a0 = a1 = a2 = a3 = 0;
+    AES_encrypt(CMACKEY);
+    t1 = (ctx->blen == 16) ? 1 : 2;
+    do {
+        t0 = a0 >> 31;
+        a0 = (a0 << 1) | (a1 >> 31);
+        a1 = (a1 << 1) | (a2 >> 31);
+        a2 = (a2 << 1) | (a3 >> 31);
+        a3 = (a3 << 1);
+        if( t0 ) a3 ^= 0x87;
+    } while( --t1 );
+
+    if( ctx->blen < 16 ) {
+        ctx->buf[ctx->blen] = 0x80;
+        os_clearMem(ctx->buf+ctx->blen+1, 15-ctx->blen);
+    }
+    cmacblock(ctx, ctx->buf, a0, a1, a2, a3);
+    return ctx->x[0];
+}
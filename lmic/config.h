@@ -6,7 +6,13 @@
 //#define CFG_us915 1
 
 #define US_PER_OSTICK 50
+
+// SX127x modules driven by this process, see hal_addRadio()
+#define MAX_RADIOS 4
 //#define  OSTICKS_PER_SEC 20000
 
+// trace SPI transactions, see spitrace.h
+//#define CFG_spitrace 1
+
 #endif
 
@@ -0,0 +1,195 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Frame counter journal, see fcntlog.h.
+ *******************************************************************************/
+
+#include "fcntlog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Record: magic, uplink limit, seqnoDn, CRC-32 of the first 12 bytes (all LSB first)
+enum { REC_LEN = 16 };
+#define REC_MAGIC 0x314A4346   // "FCJ1"
+
+static char path[FILENAME_MAX];
+static int  fd = -1;
+static u2_t block;
+static u2_t nrec;       // records in the journal file
+static u4_t limit;      // uplinks below this are reserved
+static u4_t dnSaved;    // seqnoDn of the last record
+
+static void mkrec (u1_t* rec, u4_t lim, u4_t dn) {
+    os_wlsbf4(rec+0, REC_MAGIC);
+    os_wlsbf4(rec+4, lim);
+    os_wlsbf4(rec+8, dn);
+    os_wlsbf4(rec+12, os_crc32(rec, 12));
+}
+
+static int writeAll (int f, const u1_t* buf, int len) {
+    while( len > 0 ) {
+        ssize_t n = write(f, buf, len);
+        if( n < 0 ) {
+            if( errno == EINTR )
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Make a rename in the journal's directory durable
+static int syncDir (void) {
+    char dir[FILENAME_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char* slash = strrchr(dir, '/');
+    if( slash == dir )
+        slash[1] = 0;
+    else if( slash != NULL )
+        *slash = 0;
+    else
+        snprintf(dir, sizeof(dir), ".");
+    int d = open(dir, O_RDONLY);
+    if( d < 0 )
+        return -1;
+    int rc = fsync(d);
+    close(d);
+    return rc;
+}
+
+// Replace the journal by a file holding a single record
+static int compact (const u1_t* rec) {
+    char tmp[FILENAME_MAX+4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int t = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if( t < 0 )
+        return -1;
+    if( writeAll(t, rec, REC_LEN) < 0 || fsync(t) < 0 ) {
+        close(t);
+        unlink(tmp);
+        return -1;
+    }
+    close(t);
+    if( rename(tmp, path) < 0 ) {
+        unlink(tmp);
+        return -1;
+    }
+    if( fd >= 0 )
+        close(fd);
+    if( (fd = open(path, O_WRONLY|O_APPEND)) < 0 )
+        return -1;
+    nrec = 1;
+    return syncDir();
+}
+
+static int append (u4_t lim, u4_t dn) {
+    if( path[0] == 0 ) {
+        errno = EBADF;    // not open
+        return -1;
+    }
+    u1_t rec[REC_LEN];
+    mkrec(rec, lim, dn);
+    if( fd < 0 || nrec >= FCNTLOG_MAXREC ) {
+        if( compact(rec) < 0 )
+            return -1;
+    } else {
+        if( writeAll(fd, rec, REC_LEN) < 0 || fsync(fd) < 0 )
+            return -1;
+        nrec += 1;
+    }
+    limit   = lim;
+    dnSaved = dn;
+    return 0;
+}
+
+int fcntlog_open (const char* p, u2_t blk) {
+    fcntlog_close();
+    if( snprintf(path, sizeof(path), "%s", p) >= (int)sizeof(path) ) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    block = blk != 0 ? blk : (u2_t)FCNTLOG_BLOCK;
+    nrec  = 0;
+
+    // Last valid record wins - a torn append at the end is ignored
+    int found = 0, clean = 1;
+    u4_t lim = 0, dn = 0;
+    FILE* fp = fopen(path, "rb");
+    if( fp != NULL ) {
+        u1_t rec[REC_LEN];
+        size_t n;
+        while( (n = fread(rec, 1, REC_LEN, fp)) > 0 ) {
+            if( n == REC_LEN && os_rlsbf4(rec) == REC_MAGIC && os_rlsbf4(rec+12) == os_crc32(rec, 12) ) {
+                lim = os_rlsbf4(rec+4);
+                dn  = os_rlsbf4(rec+8);
+                found = 1;
+                nrec += 1;
+            } else {
+                clean = 0;
+            }
+        }
+        fclose(fp);
+    } else if( errno != ENOENT ) {
+        return -1;
+    }
+    if( found ) {
+        if( (s4_t)(lim - LMIC.seqnoUp) > 0 )
+            LMIC.seqnoUp = lim;
+        if( (s4_t)(dn - LMIC.seqnoDn) > 0 )
+            LMIC.seqnoDn = dn;
+    }
+    // A damaged journal is rewritten so appends stay record aligned
+    if( found && clean && (fd = open(path, O_WRONLY|O_APPEND)) < 0 )
+        return -1;
+    if( append(LMIC.seqnoUp + block, LMIC.seqnoDn) < 0 )
+        return -1;
+    return found;
+}
+
+int fcntlog_import (const char* txtpath) {
+    FILE* fp = fopen(txtpath, "r");
+    if( fp == NULL )
+        return errno == ENOENT ? 0 : -1;
+    unsigned long up, dn;
+    int n = fscanf(fp, "%lu %lu", &up, &dn);
+    fclose(fp);
+    if( n != 2 || (s4_t)((u4_t)up - LMIC.seqnoUp) <= 0 )
+        return 0;
+    LMIC.seqnoUp = up;
+    if( (s4_t)((u4_t)dn - LMIC.seqnoDn) > 0 )
+        LMIC.seqnoDn = dn;
+    return fcntlog_sync() < 0 ? -1 : 1;
+}
+
+int fcntlog_update (void) {
+    // Reserve before the next uplink would need a counter beyond the block
+    if( (s4_t)(limit - LMIC.seqnoUp) > 0 )
+        return 0;
+    return append(LMIC.seqnoUp + block, LMIC.seqnoDn);
+}
+
+int fcntlog_sync (void) {
+    u4_t lim = (s4_t)(limit - LMIC.seqnoUp) > 0 ? limit : LMIC.seqnoUp + block;
+    if( lim == limit && LMIC.seqnoDn == dnSaved )
+        return 0;
+    return append(lim, LMIC.seqnoDn);
+}
+
+u4_t fcntlog_limit (void) {
+    return limit;
+}
+
+void fcntlog_close (void) {
+    if( fd >= 0 )
+        close(fd);
+    fd = -1;
+    path[0] = 0;
+}
@@ -0,0 +1,47 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Frame counter journal. Persists LMIC.seqnoUp/seqnoDn as an append-only
+ * file of checksummed records. Uplink counters are reserved in blocks: a
+ * record allows all uplinks below its limit, so only one fsync'ed append
+ * is needed every `block` uplinks. After a restart the MAC resumes at the
+ * last limit - counters of the unused rest of a block are skipped, never
+ * reused. The journal is compacted into a single record now and then by
+ * writing a new file and renaming it over the old one.
+ *******************************************************************************/
+
+#ifndef _fcntlog_h_
+#define _fcntlog_h_
+
+#include "lmic.h"
+
+enum { FCNTLOG_BLOCK  =  64 };   // default uplinks per reservation
+enum { FCNTLOG_MAXREC = 256 };   // records before the journal is compacted
+
+//! Open/create the journal at path and restore LMIC.seqnoUp/seqnoDn from it,
+//! then reserve the first block. Call after LMIC_reset()/LMIC_setSession().
+//! Returns 1 if counters were restored, 0 for a new journal, -1 on I/O errors.
+int  fcntlog_open (const char* path, u2_t block);
+
+//! Import counters from a text file "<seqnoUp> <seqnoDn>" (the format the
+//! examples used to rewrite per uplink) if they are ahead of the journal.
+//! Returns 1 if imported, 0 if the file is missing or not newer, -1 on errors.
+int  fcntlog_import (const char* txtpath);
+
+//! Call after each uplink (EV_TXCOMPLETE) - reserves the next block once
+//! the current one is used up. Returns 0 or -1 on I/O errors, in which case
+//! no further uplink should be sent.
+int  fcntlog_update (void);
+
+//! Write the current counters right away, e.g. after a downlink advanced
+//! seqnoDn or before a planned shutdown. Returns 0 or -1.
+int  fcntlog_sync (void);
+
+//! Limit of the current reservation - uplink counters below it are durable.
+u4_t fcntlog_limit (void);
+
+void fcntlog_close (void);
+
+#endif // _fcntlog_h_
@@ -0,0 +1,407 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Single channel gateway, see gateway.h.
+ *******************************************************************************/
+
+#include "gateway.h"
+
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Packet forwarder protocol
+enum { PROTO_VERSION = 2 };
+enum { PKT_PUSH_DATA = 0, PKT_PUSH_ACK = 1, PKT_PULL_DATA = 2,
+       PKT_PULL_RESP = 3, PKT_PULL_ACK = 4, PKT_TX_ACK = 5 };
+enum { HDR_LEN = 12 };  // version, token, type, gateway EUI
+
+static int      sock = -1;
+static u1_t     gwRadio;
+static u1_t     gwEui[8];
+static rawcfg_t gwCfg;
+static u2_t     token;
+static osjob_t  rxjob;
+static osjob_t  statjob;
+static osjob_t  polljob;
+static osjob_t  pulljob;
+static osjob_t  jitjob;
+static osjob_t  txjob;
+static gwstat_t gwStat;
+static u4_t     crcSeen;    // radio CRC errors already counted in rxnb
+
+static char buf[GW_MAX_DGRAM];
+static int  len;            // JSON bytes in buf after the header
+static int  npkt;           // rxpk objects in buf
+
+// Downlinks in order of their time
+typedef struct jitpkt_t jitpkt_t;
+struct jitpkt_t {
+    ostime_t at;
+    ostime_t airtime;
+    rawcfg_t cfg;
+    u1_t     len;
+    u1_t     data[MAX_LEN_FRAME];
+};
+static jitpkt_t jit[GW_JIT_QUEUE];
+static u1_t     jitCnt;
+
+static const char B64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int base64 (char* out, const u1_t* in, int n) {
+    char* p = out;
+    for( int i=0; i<n; i+=3 ) {
+        u4_t v = (u4_t)in[i] << 16 | (i+1 < n ? in[i+1] << 8 : 0) | (i+2 < n ? in[i+2] : 0);
+        *p++ = B64[v >> 18];
+        *p++ = B64[(v >> 12) & 0x3F];
+        *p++ = i+1 < n ? B64[(v >> 6) & 0x3F] : '=';
+        *p++ = i+2 < n ? B64[v & 0x3F] : '=';
+    }
+    return p - out;
+}
+
+static int b64val (char c) {
+    const char* p = c ? strchr(B64, c) : NULL;
+    return p ? p - B64 : -1;
+}
+
+// Decode up to max bytes, returns the length or -1
+static int unbase64 (u1_t* out, int max, const char* in) {
+    int n = 0, bits = 0;
+    u4_t acc = 0;
+    for( int v; (v = b64val(*in)) >= 0; in++ ) {
+        acc = acc << 6 | v;
+        if( (bits += 6) >= 8 ) {
+            bits -= 8;
+            if( n == max )
+                return -1;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+static void header (u1_t type) {
+    token++;
+    buf[0] = PROTO_VERSION;
+    buf[1] = token >> 8;
+    buf[2] = token;
+    buf[3] = type;
+    memcpy(buf+4, gwEui, 8);
+    len = HDR_LEN;
+}
+
+static void push (void) {
+    if( send(sock, buf, len, MSG_DONTWAIT) == len )
+        gwStat.dgrams++;
+    else
+        gwStat.errors++;
+}
+
+static void pollSocket (void);
+
+// Append a rxpk object, 0 if it does not fit with the closing "]}"
+static int append (const char* pk, int n) {
+    const char* sep = npkt ? "," : "{\"rxpk\":[";
+    int slen = strlen(sep);
+    if( len + slen + n + 2 > (int)sizeof(buf) )
+        return 0;
+    memcpy(buf+len, sep, slen);
+    memcpy(buf+len+slen, pk, n);
+    len += slen + n;
+    npkt++;
+    return 1;
+}
+
+static void flush (void) {
+    if( npkt == 0 )
+        return;
+    buf[len++] = ']';
+    buf[len++] = '}';
+    push();
+    npkt = 0;
+}
+
+// ISO 8601 UTC time of os time t
+static int isotime (char* out, int n, ostime_t t) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    s8_t us = (s8_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - osticks2us(os_getTime() - t);
+    time_t sec = us / 1000000;
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    return snprintf(out, n, "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ", tm.tm_year+1900, tm.tm_mon+1,
+                    tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(us % 1000000));
+}
+
+static void addRxpk (const rawframe_t* f) {
+    char pk[512 + MAX_LEN_FRAME*4/3];
+    char tm[96];    // worst case of the int fields isotime() prints
+    isotime(tm, sizeof(tm), f->rxtime);
+    rps_t rps = gwCfg.rps;
+    int n = snprintf(pk, sizeof(pk),
+        "{\"time\":\"%s\",\"tmst\":%u,\"chan\":0,\"rfch\":0,\"freq\":%u.%06u,\"stat\":1,"
+        "\"modu\":\"LORA\",\"datr\":\"SF%dBW%d\",\"codr\":\"4/%d\",\"rssi\":%d,\"lsnr\":%.2f,"
+        "\"size\":%u,\"data\":\"",
+        tm, (u4_t)f->rxtime * (u4_t)(1000000/OSTICKS_PER_SEC),
+        gwCfg.freq / 1000000, gwCfg.freq % 1000000,
+        6 + getSf(rps), 125 << getBw(rps), 5 + getCr(rps),
+        radio_rawRssi(f), f->snr / 4.0, f->len);
+    n += base64(pk+n, f->data, f->len);
+    pk[n++] = '"';
+    pk[n++] = '}';
+
+    if( !append(pk, n) ) {
+        flush();
+        header(PKT_PUSH_DATA);
+        append(pk, n);
+    }
+    gwStat.rxfw++;
+}
+
+static void onRx (xref2osjob_t) {
+    const rawframe_t* f;
+    header(PKT_PUSH_DATA);
+    while( (f = radio_rawPeek(gwRadio)) != NULL ) {
+        gwStat.rxnb++;
+        gwStat.rxok++;
+        addRxpk(f);
+        radio_rawPop(gwRadio);
+    }
+    flush();
+    pollSocket();
+}
+
+static void onStat (xref2osjob_t) {
+    pollSocket();
+    const rawstat_t* rs = radio_rawStat(gwRadio);
+    gwStat.rxnb += rs->crcerr - crcSeen;
+    crcSeen = rs->crcerr;
+    char tm[32];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct tm t;
+    gmtime_r(&ts.tv_sec, &t);
+    strftime(tm, sizeof(tm), "%Y-%m-%d %H:%M:%S GMT", &t);
+    header(PKT_PUSH_DATA);
+    len += snprintf(buf+len, sizeof(buf)-len,
+        "{\"stat\":{\"time\":\"%s\",\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%.1f,\"dwnb\":%u,\"txnb\":%u}}",
+        tm, gwStat.rxnb, gwStat.rxok, gwStat.rxfw, gwStat.dgrams ? 100.0 * gwStat.acks / gwStat.dgrams : 0.0,
+        gwStat.dwnb, gwStat.txnb);
+    push();
+    os_setTimedCallback(&statjob, os_getTime() + sec2osticks(GW_STAT_INTV), onStat);
+}
+
+// ================================================================================
+// Downlinks
+
+// Forwarder timestamp (us, 32 bit) to os time - tmst is os time * us per tick
+static ostime_t tmst2os (u4_t tmst) {
+    ostime_t now = os_getTime();
+    return now + (s4_t)(tmst - (u4_t)now * (u4_t)(1000000/OSTICKS_PER_SEC)) / (1000000/OSTICKS_PER_SEC);
+}
+
+// Start of the value of "key" in a flat JSON object, NULL if missing
+static const char* jsonGet (const char* js, const char* key) {
+    char pat[16];
+    snprintf(pat, sizeof(pat), "\"%s\"", key);
+    const char* p = strstr(js, pat);
+    if( p == NULL )
+        return NULL;
+    p += strlen(pat);
+    while( *p == ' ' || *p == ':' )
+        p++;
+    return p;
+}
+
+static bit_t jsonTrue (const char* js, const char* key) {
+    const char* v = jsonGet(js, key);
+    return v != NULL && strncmp(v, "true", 4) == 0;
+}
+
+static void onTxDone (xref2osjob_t) {
+    gwStat.txnb++;
+}
+
+static void onJit (xref2osjob_t);
+
+static void jitSchedule (void) {
+    if( jitCnt )
+        os_setTimedCallback(&jitjob, jit[0].at - GW_JIT_LEAD, onJit);
+    else
+        os_clearCallback(&jitjob);
+}
+
+static void onJit (xref2osjob_t) {
+    jitpkt_t p = jit[0];
+    memmove(jit, jit+1, --jitCnt * sizeof(jit[0]));
+    if( !radio_rawTxAt(gwRadio, &txjob, onTxDone, &p.cfg, p.data, p.len, p.at) )
+        gwStat.late++;
+    jitSchedule();
+}
+
+// Queue a downlink, returns NULL or the TX_ACK error
+static const char* jitAdd (const jitpkt_t* p) {
+    s4_t ahead = p->at - os_getTime();
+    if( ahead < GW_JIT_LEAD )
+        return "TOO_LATE";
+    if( ahead > sec2osticks(GW_MAX_ADVANCE) )
+        return "TOO_EARLY";
+    if( jitCnt == GW_JIT_QUEUE )
+        return "COLLISION_PACKET";
+    u1_t i;
+    for( i=0; i<jitCnt; i++ ) {
+        const jitpkt_t* q = &jit[i];
+        if( (s4_t)(p->at - (q->at + q->airtime)) < GW_JIT_LEAD && (s4_t)(q->at - (p->at + p->airtime)) < GW_JIT_LEAD )
+            return "COLLISION_PACKET";
+    }
+    for( i=jitCnt; i>0 && (s4_t)(jit[i-1].at - p->at) > 0; i-- )
+        jit[i] = jit[i-1];
+    jit[i] = *p;
+    jitCnt++;
+    jitSchedule();
+    return NULL;
+}
+
+#if defined(CFG_eu868)
+#define GW_FREQ_MIN EU868_FREQ_MIN
+#define GW_FREQ_MAX EU868_FREQ_MAX
+#elif defined(CFG_us915)
+#define GW_FREQ_MIN US915_FREQ_MIN
+#define GW_FREQ_MAX US915_FREQ_MAX
+#endif
+
+// Parse a txpk object, returns NULL or the TX_ACK error if it cannot be sent by this gateway
+static const char* parseTxpk (jitpkt_t* p, const char* js) {
+    const char *freq = jsonGet(js, "freq"), *datr = jsonGet(js, "datr"), *codr = jsonGet(js, "codr");
+    const char *data = jsonGet(js, "data"), *powe = jsonGet(js, "powe"), *tmst = jsonGet(js, "tmst");
+    const char *modu = jsonGet(js, "modu");
+    int sf, bw, cr;
+    if( freq == NULL || datr == NULL || data == NULL || modu == NULL || strncmp(modu, "\"LORA\"", 6) != 0
+        || sscanf(datr, "\"SF%dBW%d\"", &sf, &bw) != 2 || sf < 7 || sf > 12
+        || (bw != 125 && bw != 250 && bw != 500) )
+        return "INVALID_TXPK";
+    cr = codr != NULL && sscanf(codr, "\"4/%d\"", &cr) == 1 && cr >= 5 && cr <= 8 ? cr : 5;
+    int n = unbase64(p->data, MAX_LEN_FRAME, data+1);
+    if( n < 0 )
+        return "INVALID_TXPK";
+    p->len       = n;
+    p->cfg.freq  = (u4_t)(strtod(freq, NULL) * 1e6 + 0.5);
+    if( p->cfg.freq < GW_FREQ_MIN || p->cfg.freq > GW_FREQ_MAX )
+        return "TX_FREQ";
+    p->cfg.rps   = makeRps((sf_t)(SF7 + sf - 7), bw == 125 ? BW125 : bw == 250 ? BW250 : BW500,
+                           (cr_t)(CR_4_5 + cr - 5), 0, jsonTrue(js, "ncrc"));
+    p->cfg.txpow = powe != NULL ? atoi(powe) : 14;
+    p->cfg.iq    = jsonTrue(js, "ipol") ? RAW_IQ_INVERTED : RAW_IQ_NORMAL;
+    p->cfg.sync  = gwCfg.sync;
+    p->airtime   = calcAirTime(p->cfg.rps, p->len);
+    if( jsonTrue(js, "imme") )
+        p->at = os_getTime() + GW_JIT_LEAD + ms2osticks(1);
+    else if( tmst != NULL )
+        p->at = tmst2os(strtoul(tmst, NULL, 10));
+    else
+        return "INVALID_TXPK";
+    return NULL;
+}
+
+static void onPullResp (const u1_t* tok, char* js) {
+    static jitpkt_t p;
+    gwStat.dwnb++;
+    const char* txpk = jsonGet(js, "txpk");
+    const char* err = txpk == NULL ? "INVALID_TXPK" : parseTxpk(&p, txpk);
+    if( err == NULL )
+        err = jitAdd(&p);
+    // TX_ACK echoes the token, no JSON means no error
+    header(PKT_TX_ACK);
+    buf[1] = tok[0];
+    buf[2] = tok[1];
+    if( err != NULL ) {
+        gwStat.rejected++;
+        len += snprintf(buf+len, sizeof(buf)-len, "{\"txpk_ack\":{\"error\":\"%s\"}}", err);
+    }
+    push();
+}
+
+// Handle everything the server sent, without blocking
+static void pollSocket (void) {
+    static u1_t in[HDR_LEN + 1024];
+    ssize_t n;
+    while( (n = recv(sock, in, sizeof(in)-1, MSG_DONTWAIT)) >= 4 ) {
+        if( in[0] != PROTO_VERSION )
+            continue;
+        if( in[3] == PKT_PUSH_ACK )
+            gwStat.acks++;
+        else if( in[3] == PKT_PULL_RESP ) {
+            in[n] = 0;
+            onPullResp(in+1, (char*)in+4);
+        }
+    }
+}
+
+static void onPoll (xref2osjob_t) {
+    pollSocket();
+    os_setTimedCallback(&polljob, os_getTime() + GW_POLL, onPoll);
+}
+
+// Keep the server's downlink path to us open
+static void onPull (xref2osjob_t) {
+    header(PKT_PULL_DATA);
+    push();
+    os_setTimedCallback(&pulljob, os_getTime() + sec2osticks(GW_KEEPALIVE), onPull);
+}
+
+int gateway_start (u1_t radio, const rawcfg_t* cfg, const u1_t* eui, const char* host, u2_t port) {
+    gateway_stop();
+    char sport[8];
+    snprintf(sport, sizeof(sport), "%u", port);
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if( getaddrinfo(host, sport, &hints, &ai) != 0 )
+        return -1;
+    for( struct addrinfo* a = ai; a != NULL && sock < 0; a = a->ai_next ) {
+        sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if( sock >= 0 && connect(sock, a->ai_addr, a->ai_addrlen) < 0 ) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    if( sock < 0 )
+        return -1;
+
+    gwRadio = radio;
+    gwCfg   = *cfg;
+    memcpy(gwEui, eui, 8);
+    memset(&gwStat, 0, sizeof(gwStat));
+    crcSeen = radio_rawStat(radio)->crcerr;
+    token   = os_getRndU2();
+    jitCnt  = 0;
+    radio_rawRx(radio, &rxjob, onRx, cfg);
+    os_setTimedCallback(&statjob, os_getTime() + sec2osticks(GW_STAT_INTV), onStat);
+    onPull(&pulljob);
+    onPoll(&polljob);
+    return 0;
+}
+
+void gateway_stop (void) {
+    if( sock < 0 )
+        return;
+    radio_rawStop(gwRadio);
+    os_clearCallback(&statjob);
+    os_clearCallback(&polljob);
+    os_clearCallback(&pulljob);
+    os_clearCallback(&jitjob);
+    close(sock);
+    sock = -1;
+}
+
+const gwstat_t* gateway_stat (void) {
+    return &gwStat;
+}
@@ -0,0 +1,66 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Single channel gateway: one radio listens continuously on one frequency
+ * and datarate (raw mode, see radio.h) and every frame received is pushed
+ * to a network server with the Semtech UDP packet forwarder protocol
+ * (version 2, PUSH_DATA with "rxpk" and "stat" objects).
+ *
+ * Frames are forwarded from the job run right after the RX interrupt. All
+ * frames waiting in the ring buffer by then go out in one datagram. "tmst"
+ * is the RX done time of the radio interrupt in microseconds (32 bit,
+ * wrapping), like the concentrator counter.
+ *
+ * Downlinks ("txpk" in PULL_RESP) go into a just-in-time queue ordered by
+ * their "tmst", mapped back to os time, or go out right away if "imme".
+ * Each is handed to the radio GW_JIT_LEAD ahead and sent at its exact time
+ * (radio_rawTxAt()), then the receiver resumes - a downlink always wins
+ * over a frame being received. TX_ACK reports TOO_LATE, TOO_EARLY,
+ * COLLISION_PACKET (overlap or queue full), TX_FREQ (outside the band) or
+ * INVALID_TXPK (malformed, or not LoRa) when a downlink is rejected.
+ *
+ * The process must not run the LoRaWAN MAC on the same radio.
+ *******************************************************************************/
+
+#ifndef _gateway_h_
+#define _gateway_h_
+
+#include "lmic.h"
+#include "radio.h"
+
+enum { GW_PORT      = 1700 };   // default server port
+enum { GW_STAT_INTV = 30 };     // seconds between "stat" reports
+enum { GW_MAX_DGRAM = 2400 };   // datagram size, more frames go into another one
+enum { GW_KEEPALIVE = 10 };     // seconds between PULL_DATA
+enum { GW_JIT_QUEUE = 8 };      // downlinks waiting for their time
+enum { GW_MAX_ADVANCE = 30 };   // seconds a downlink may be scheduled ahead
+#define GW_JIT_LEAD   ms2osticks(20)  // downlink handed to the radio this early
+#define GW_POLL       ms2osticks(5)   // socket polled for PULL_RESP
+
+typedef struct gwstat_t gwstat_t;
+struct gwstat_t {
+    u4_t rxnb;      // frames received incl. CRC errors
+    u4_t rxok;      // frames with a good CRC
+    u4_t rxfw;      // frames forwarded
+    u4_t dgrams;    // PUSH_DATA sent
+    u4_t acks;      // PUSH_ACK received
+    u4_t errors;    // failed sends
+    u4_t dwnb;      // downlinks received
+    u4_t txnb;      // downlinks sent
+    u4_t rejected;  // downlinks refused in TX_ACK
+    u4_t late;      // downlinks accepted but missed, e.g. the process stalled
+};
+
+//! Start forwarding frames received with cfg on radio to host:port (name or
+//! address), identified by the gateway EUI eui (8 bytes, MSB first).
+//! Returns 0, or -1 if the host cannot be resolved or the socket fails.
+int  gateway_start (u1_t radio, const rawcfg_t* cfg, const u1_t* eui, const char* host, u2_t port);
+
+//! Stop receiving and close the socket.
+void gateway_stop (void);
+
+const gwstat_t* gateway_stat (void);
+
+#endif // _gateway_h_
@@ -2,53 +2,95 @@
 #include "oslmic.h"
 #include "hal.h"
 #include "local_hal.h"
+#include "spitrace.h"
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
 #include <stdio.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 
 
 int fd;
 
+// -----------------------------------------------------------------------------
+// RADIOS
+
+static lmic_pinmap maps[MAX_RADIOS];
+static u1_t nradios = 1;    // radio 0 is pins
+static u1_t cur;            // selected radio
+
+int hal_addRadio (const lmic_pinmap* map) {
+    if (nradios == MAX_RADIOS)
+        return -1;
+    maps[nradios] = *map;
+    return nradios++;
+}
+
+void hal_selectRadio (u1_t radio) {
+    ASSERT(radio < nradios);
+    cur = radio;
+}
+
+u1_t hal_currentRadio (void) {
+    return cur;
+}
+
+u1_t hal_radioCount (void) {
+    return nradios;
+}
+
 // -----------------------------------------------------------------------------
 // I/O
 
 static void hal_io_init () {
     wiringPiSetup();
-    pinMode(pins.nss, OUTPUT);
-    pinMode(pins.rxtx, OUTPUT);
-    pinMode(pins.rst, OUTPUT);
-    pinMode(pins.dio[0], INPUT);
-    pinMode(pins.dio[1], INPUT);
-    pinMode(pins.dio[2], INPUT);
+    for (u1_t r = 0; r < nradios; r++) {
+        pinMode(maps[r].nss, OUTPUT);
+        digitalWrite(maps[r].nss, 1); // deselect until first use
+        pinMode(maps[r].rxtx, OUTPUT);
+        pinMode(maps[r].rst, OUTPUT);
+        pinMode(maps[r].dio[0], INPUT);
+        pinMode(maps[r].dio[1], INPUT);
+        pinMode(maps[r].dio[2], INPUT);
+    }
 }
 
 // val == 1  => tx 1
 void hal_pin_rxtx (u1_t val) {
-    digitalWrite(pins.rxtx, val);
+    digitalWrite(maps[cur].rxtx, val);
 }
 
 // set radio RST pin to given value (or keep floating!)
 void hal_pin_rst (u1_t val) {
     if(val == 0 || val == 1) { // drive pin
-        pinMode(pins.rst, OUTPUT);
-        digitalWrite(pins.rst, val);
+        pinMode(maps[cur].rst, OUTPUT);
+        digitalWrite(maps[cur].rst, val);
 //        digitalWrite(0, val==0?LOW:HIGH);
     } else { // keep pin floating
-        pinMode(pins.rst, INPUT);
+        pinMode(maps[cur].rst, INPUT);
     }
 }
 
-static bool dio_states[NUM_DIO] = {0};
+static bool dio_states[MAX_RADIOS][NUM_DIO] = {{0}};
+
+// radio_irq_handler() finds the radio selected, the caller's selection is kept
+static void hal_dio_irq (u1_t radio, u1_t dio) {
+    u1_t prev = cur;
+    cur = radio;
+    radio_irq_handler(dio);
+    cur = prev;
+}
 
 static void hal_io_check() {
-    u1_t i;
-    for (i = 0; i < NUM_DIO; ++i) {
-        if (dio_states[i] != digitalRead(pins.dio[i])) {
-            dio_states[i] = !dio_states[i];
-            if (dio_states[i]) {
-                radio_irq_handler(i);
+    u1_t r, i;
+    for (r = 0; r < nradios; ++r) {
+        for (i = 0; i < NUM_DIO; ++i) {
+            if (dio_states[r][i] != digitalRead(maps[r].dio[i])) {
+                dio_states[r][i] = !dio_states[r][i];
+                if (dio_states[r][i]) {
+                    hal_dio_irq(r, i);
+                }
             }
         }
     }
@@ -57,19 +99,26 @@ static void hal_io_check() {
 // -----------------------------------------------------------------------------
 // SPI
 //
-static int spifd;
 
 static void hal_spi_init () {
-    spifd = wiringPiSPISetup(0, 10000000);
+    bool done[2] = {0};
+    for (u1_t r = 0; r < nradios; r++) {
+        if (!done[maps[r].spi & 1]) {
+            wiringPiSPISetup(maps[r].spi & 1, 10000000);
+            done[maps[r].spi & 1] = 1;
+        }
+    }
 }
 
 void hal_pin_nss (u1_t val) {
-    digitalWrite(pins.nss, val);
+    digitalWrite(maps[cur].nss, val);
+    SPITRACE_NSS(val);
 }
 
 // perform SPI transaction with radio
 u1_t hal_spi (u1_t out) {
-    u1_t res = wiringPiSPIDataRW(0, &out, 1);
+    SPITRACE_BYTE(out);
+    u1_t res = wiringPiSPIDataRW(maps[cur].spi & 1, &out, 1);
     return out;
 }
 
@@ -104,17 +153,19 @@ static u4_t delta_time(u4_t time) {
       }
 }
 
+// Sleeping wakes up late by up to a scheduler tick, so sleep until
+// HAL_SPIN_US before time and busy-wait for the rest
+#define HAL_SPIN_US 1000
+
 void hal_waitUntil (u4_t time) {
-    u4_t now=hal_ticks();
-    u4_t delta = delta_time(time);
-    //fprintf(stderr, "waitUntil(%d) delta=%d\n", time, delta);
-    s4_t t=time-now;
-    if (delta==0) return;
-    if (t>0) { 
-      //fprintf(stderr, "delay(%d)\n", t*US_PER_OSTICK/1000);
-      delay(t*US_PER_OSTICK/1000);
-      return;
+    s4_t t = time - hal_ticks();
+    if (t <= 0) return;
+    s8_t sleep_us = (s8_t)t*US_PER_OSTICK - HAL_SPIN_US;
+    if (sleep_us > 0) {
+      struct timespec ts = { (time_t)(sleep_us/1000000), (long)(sleep_us%1000000)*1000 };
+      while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
     }
+    while ((s4_t)(time - hal_ticks()) > 0);
 }
 
 // check and rewind for target time
@@ -125,29 +176,20 @@ u1_t hal_checkTimer (u4_t time) {
 }
 
 static u8_t irqlevel = 0;
+// Held while IRQs are disabled: wiringPi runs ISRs on its own thread, which
+// must not select a radio or touch SPI in the middle of the main thread's
+static pthread_mutex_t irqlock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
-void IRQ0(void) {
-//  fprintf(stderr, "IRQ0 %d\n", irqlevel);
-  if (irqlevel==0) {
-    radio_irq_handler(0);
-    return;
-  }
-}
-
-void IRQ1(void) {
-  if (irqlevel==0){
-    radio_irq_handler(1);
-  }
-}
-
-void IRQ2(void) {
-  if (irqlevel==0){
-    radio_irq_handler(2);
-  }
+// Dispatch like the poll in hal_enableIRQs(), which also keeps an edge
+// from being handled by both threads
+static void hal_isr (void) {
+    hal_disableIRQs();
+    hal_enableIRQs();
 }
 
 void hal_disableIRQs () {
 //    cli();
+    pthread_mutex_lock(&irqlock);
     irqlevel++;
 //    fprintf(stderr, "disableIRQs(%d)\n", irqlevel);
 }
@@ -167,6 +209,7 @@ void hal_enableIRQs () {
         // we would otherwise get for running SPI transfers inside ISRs
         hal_io_check();
       }
+    pthread_mutex_unlock(&irqlock);
   }
 
   void hal_sleep () {
@@ -181,15 +224,18 @@ void hal_enableIRQs () {
 }
 
 void hal_init() {
+    maps[0] = pins;
     fd=wiringPiSetup();
     hal_io_init();
     // configure radio SPI
     hal_spi_init();
     // configure timer and interrupt handler
     hal_time_init();
-    wiringPiISR(pins.dio[0], INT_EDGE_RISING, IRQ0);
-    wiringPiISR(pins.dio[1], INT_EDGE_RISING, IRQ1);
-    wiringPiISR(pins.dio[2], INT_EDGE_RISING, IRQ2);
+    for (u1_t r = 0; r < nradios; r++) {
+        wiringPiISR(maps[r].dio[0], INT_EDGE_RISING, hal_isr);
+        wiringPiISR(maps[r].dio[1], INT_EDGE_RISING, hal_isr);
+        wiringPiISR(maps[r].dio[2], INT_EDGE_RISING, hal_isr);
+    }
 
   
 }
@@ -17,6 +17,21 @@
  */
 void hal_init (void);
 
+/*
+ * select the radio addressed by the following pin and SPI calls.
+ */
+void hal_selectRadio (u1_t radio);
+
+/*
+ * return selected radio (0..hal_radioCount()-1).
+ */
+u1_t hal_currentRadio (void);
+
+/*
+ * return number of radios.
+ */
+u1_t hal_radioCount (void);
+
 /*
  * drive radio NSS pin (0=low, 1=high).
  */
@@ -34,6 +34,7 @@
 #define AIRTIME_BCN_osticks    us2osticks(AIRTIME_BCN)
 #if defined(CFG_eu868)
 #define DNW2_SAFETY_ZONE       ms2osticks(3000)
+#define SWEEP_RETRY_osticks    ms2osticks(500)
 #endif
 #if defined(CFG_us915)
 #define DNW2_SAFETY_ZONE       ms2osticks(750)
@@ -45,6 +46,14 @@
 DEFINE_LMIC;
 DECL_ON_LMIC_EVENT;
 
+// Received downlinks - kept apart from LMIC so views survive LMIC_reset()
+static struct {
+    dnmsg_t msg[MAX_DNQ];
+    u1_t    head;     // oldest unreleased entry
+    u1_t    cnt;
+    u2_t    dropped;
+} DNQ;
+
 
 // Fwd decls.
 static void engineUpdate(void);
@@ -133,28 +142,34 @@ u2_t os_crc16 (xref2u1_t data, uint len) {
 // ================================================================================
 // BEG AES
 
-static void micB0 (u4_t devaddr, u4_t seqno, int dndir, int len) {
-    os_clearMem(AESaux,16);
-    AESaux[0]  = 0x49;
-    AESaux[5]  = dndir?1:0;
-    AESaux[15] = len;
-    os_wlsbf4(AESaux+ 6,devaddr);
-    os_wlsbf4(AESaux+10,seqno);
+// Start a data frame MIC - B0 block is absorbed as its own span
+static void micB0 (aescmac_t* ctx, xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, int len) {
+    u1_t b0[16];
+    os_clearMem(b0,16);
+    b0[0]  = 0x49;
+    b0[5]  = dndir?1:0;
+    b0[15] = len;
+    os_wlsbf4(b0+ 6,devaddr);
+    os_wlsbf4(b0+10,seqno);
+    os_cmacInit(ctx, key);
+    os_cmacUpdate(ctx, b0, 16);
 }
 
 
 static int aes_verifyMic (xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t pdu, int len) {
-    micB0(devaddr, seqno, dndir, len);
-    os_copyMem(AESkey,key,16);
-    return os_aes(AES_MIC, pdu, len) == os_rmsbf4(pdu+len);
+    aescmac_t ctx;
+    micB0(&ctx, key, devaddr, seqno, dndir, len);
+    os_cmacUpdate(&ctx, pdu, len);
+    return os_cmacFinal(&ctx) == os_rmsbf4(pdu+len);
 }
 
 
 static void aes_appendMic (xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t pdu, int len) {
-    micB0(devaddr, seqno, dndir, len);
-    os_copyMem(AESkey,key,16);
+    aescmac_t ctx;
+    micB0(&ctx, key, devaddr, seqno, dndir, len);
+    os_cmacUpdate(&ctx, pdu, len);
     // MSB because of internal structure of AES
-    os_wmsbf4(pdu+len, os_aes(AES_MIC, pdu, len));
+    os_wmsbf4(pdu+len, os_cmacFinal(&ctx));
 }
 
 
@@ -212,8 +227,8 @@ static void aes_sessKeys (u2_t devnonce, xref2cu1_t artnonce, xref2u1_t nwkkey,
 
 #if defined(CFG_eu868) // ========================================
 
-#define maxFrameLen(dr) ((dr)<=DR_SF9 ? maxFrameLens[(dr)] : 0xFF)
-const u1_t maxFrameLens [] = { 64,64,64,123 };
+#define maxFrameLen(dr) (maxFrameLens[(dr)])
+const u1_t maxFrameLens [DR_FSK+1] = { 64,64,64,128,235,235,235,235 };
 
 const u1_t _DR2RPS_CRC[] = {
     ILLEGAL_RPS,
@@ -277,42 +292,24 @@ int getSensitivity (rps_t rps) {
     return -141 + SENSITIVITY[getSf(rps)][getBw(rps)];
 }
 
-ostime_t calcAirTime (rps_t rps, u1_t plen) {
-    u1_t bw = getBw(rps);  // 0,1,2 = 125,250,500kHz
-    u1_t sf = getSf(rps);  // 0=FSK, 1..6 = SF7..12
-    if( sf == FSK ) {
-        return (plen+/*preamble*/5+/*syncword*/3+/*len*/1+/*crc*/2) * /*bits/byte*/8
-            * (s4_t)OSTICKS_PER_SEC / /*kbit/s*/50000;
-    }
-    u1_t sfx = 4*(sf+(7-SF7));
-    u1_t q = sfx - (sf >= SF11 ? 8 : 0);
-    int tmp = 8*plen - sfx + 28 + (getNocrc(rps)?0:16) - (getIh(rps)?20:0);
-    if( tmp > 0 ) {
-        tmp = (tmp + q - 1) / q;
-        tmp *= getCr(rps)+5;
-        tmp += 8;
-    } else {
-        tmp = 8;
-    }
-    tmp = (tmp<<2) + /*preamble*/49 /* 4 * (8 + 4.25) */;
-    // bw = 125000 = 15625 * 2^3
-    //      250000 = 15625 * 2^4
-    //      500000 = 15625 * 2^5
-    // sf = 7..12
-    //
-    // osticks =  tmp * OSTICKS_PER_SEC * 1<<sf / bw
-    //
-    // 3 => counter reduced divisor 125000/8 => 15625
-    // 2 => counter 2 shift on tmp
-    sfx = sf+(7-SF7) - (3+2) - bw;
-    int div = 15625;
-    if( sfx > 4 ) {
-        // prevent 32bit signed int overflow in last step
-        div >>= sfx-4;
-        sfx = 4;
+// Airtime of every payload length for CR 4/5 and explicit header,
+// one row per SF (incl. FSK) x BW x CRC on/off - see airTimeOf().
+enum { AIRTAB_ROWS = (SF12+1)*(BW500+1)*2 };
+
+struct airtab_t {
+    ostime_t t[AIRTAB_ROWS][256];
+    constexpr airtab_t () : t() {
+        for( int r=0; r<AIRTAB_ROWS; r++ )
+            for( int plen=0; plen<256; plen++ )
+                t[r][plen] = airTimeOf((rps_t)((r>>1) / (BW500+1) | (r>>1) % (BW500+1) << 3 | (r&1) << 7), (u1_t)plen);
     }
-    // Need 32bit arithmetic for this last step
-    return (((ostime_t)tmp << sfx) * OSTICKS_PER_SEC + div/2) / div;
+};
+static constexpr airtab_t AIRTAB;
+
+ostime_t calcAirTime (rps_t rps, u1_t plen) {
+    if( (rps & 0xFF60) == 0 && getSf(rps) <= SF12 && getBw(rps) <= BW500 )
+        return AIRTAB.t[(getSf(rps)*(BW500+1) + getBw(rps))*2 + getNocrc(rps)][plen];
+    return airTimeOf(rps, plen);
 }
 
 extern inline rps_t updr2rps (dr_t dr);
@@ -506,6 +503,117 @@ static void setDrTxpow (u1_t reason, u1_t dr, s1_t pow) {
 }
 
 
+// ================================================================================
+// Device-side link controller - see LMIC_setLinkCtl()
+
+// Demodulation floor [dB*SNR_SCALEUP] per SF
+static const s1_t SNR_FLOOR[] = {
+    [FSK]  = 0,
+    [SF7]  = -30,  // -7.5dB
+    [SF8]  = -40,
+    [SF9]  = -50,
+    [SF10] = -60,
+    [SF11] = -70,
+    [SF12] = -80,  // -20dB
+};
+
+// Record the uplink margin [dB] at the current DR/power, heard from the network
+static void lnkSample (int margin) {
+    if( LMIC.lnkTarget == 0 )
+        return;
+    LMIC.lnkMargin = margin < -127 ? -127 : margin > 127 ? 127 : margin;
+    LMIC.lnkSilent = LINK_CHECK_INIT;
+}
+
+// Margin from a downlink assuming a symmetric link and a full power uplink
+static void lnkSampleDn (void) {
+    rps_t uprps = updr2rps(LMIC.datarate);
+    if( getSf(LMIC.rps) == FSK || getSf(uprps) == FSK )
+        return;
+    int m = (LMIC.snr - SNR_FLOOR[getSf(uprps)]) / SNR_SCALEUP;
+    if( LMIC.snr > 0 ) {
+        // SNR saturates on strong signals - RSSI over sensitivity is more telling
+        int r = LMIC.rssi - RSSI_OFF - getSensitivity(uprps);
+        if( r > m )
+            m = r;
+    }
+    lnkSample(m - (LMIC.lnkPowMax - LMIC.adrTxPow));
+}
+
+// Trade one step (LNK_STEP_DB) of margin for robustness: full power first, then lower DR
+static void lnkStepDown (void) {
+    if( LMIC.adrTxPow < LMIC.lnkPowMax ) {
+        s1_t pow = LMIC.adrTxPow + LNK_STEP_DB;
+        setDrTxpow(DRCHG_LNKCTL, LMIC.datarate, pow > LMIC.lnkPowMax ? LMIC.lnkPowMax : pow);
+    } else {
+        setDrTxpow(DRCHG_LNKCTL, decDR((dr_t)LMIC.datarate), KEEP_TXPOW);
+    }
+}
+
+// Spend one step of margin: faster DR first, then lower power. Returns 0 if at the limit.
+static bit_t lnkStepUp (void) {
+    if( LMIC.datarate < LNK_MAX_DR && incDR((dr_t)LMIC.datarate) != LMIC.datarate ) {
+        setDrTxpow(DRCHG_LNKCTL, incDR((dr_t)LMIC.datarate), KEEP_TXPOW);
+        return 1;
+    }
+    if( LMIC.adrTxPow - LNK_STEP_DB >= LNK_MIN_TXPOW ) {
+        setDrTxpow(DRCHG_LNKCTL, LMIC.datarate, LMIC.adrTxPow - LNK_STEP_DB);
+        return 1;
+    }
+    return 0;
+}
+
+// The controller's power applies to data frames only, joins go out at full power
+static void lnkLimitTxpow (void) {
+    if( LMIC.lnkTarget != 0 && (LMIC.opmode & OP_JOINING) == 0 && LMIC.adrTxPow < LMIC.txpow )
+        LMIC.txpow = LMIC.adrTxPow;
+}
+
+// Called once per completed uplink transaction
+static void lnkUpdate (void) {
+    if( LMIC.lnkTarget == 0 )
+        return;
+    if( LMIC.lnkHold > 0 )
+        LMIC.lnkHold -= 1;
+    if( (LMIC.txrxFlags & (TXRX_ACK|TXRX_NACK)) != 0 ) {
+        LMIC.lnkAckHist = (LMIC.lnkAckHist << 1) | ((LMIC.txrxFlags & TXRX_ACK) != 0);
+        if( LMIC.lnkAckCnt < 16 )
+            LMIC.lnkAckCnt += 1;
+        u1_t acked = 0;
+        for( u2_t h=LMIC.lnkAckHist & (0xFFFF >> (16-LMIC.lnkAckCnt)); h; h &= h-1 )
+            acked++;
+        if( LMIC.lnkAckCnt >= 8 && acked * 255 < LMIC.lnkTarget * LMIC.lnkAckCnt ) {
+            // Missing the delivery target whatever the margin says - back off and stay there a while
+            lnkStepDown();
+            LMIC.lnkAckCnt = 0;
+            LMIC.lnkHold = LNK_HOLD;
+            LMIC.lnkMargin = LNK_NOMARGIN;
+            return;
+        }
+    }
+    if( LMIC.lnkMargin != LNK_NOMARGIN ) {
+        int m = LMIC.lnkMargin - LNK_MARGIN_DB;
+        LMIC.lnkMargin = LNK_NOMARGIN;
+        if( m < 0 ) {
+            for( ; m < 0; m += LNK_STEP_DB )
+                lnkStepDown();
+        } else if( LMIC.lnkHold == 0 ) {
+            for( ; m >= LNK_STEP_DB && lnkStepUp(); m -= LNK_STEP_DB );
+        }
+        return;
+    }
+    // Nothing heard - same pattern as adrAckReq: ask for a LinkCheck after a while,
+    // then give up one step every LINK_CHECK_DEAD-LINK_CHECK_CONT silent uplinks
+    LMIC.lnkSilent += 1;
+    if( LMIC.lnkSilent >= 0 )
+        LMIC.lchkReq = 1;
+    if( LMIC.lnkSilent > LINK_CHECK_DEAD ) {
+        lnkStepDown();
+        LMIC.lnkSilent = LINK_CHECK_CONT;
+    }
+}
+
+
 void LMIC_stopPingable (void) {
     LMIC.opmode &= ~(OP_PINGABLE|OP_PINGINI);
 }
@@ -528,6 +636,7 @@ void LMIC_setPingable (u1_t intvExp) {
 // BEG: EU868 related stuff
 //
 enum { NUM_DEFAULT_CHANNELS=6 };
+enum { NUM_JOIN_CHANNELS=3 };     // join frequencies at the start of iniChannelFreq
 static const u4_t iniChannelFreq[12] = {
     // Join frequencies and duty cycle limit (0.1%)
     EU868_F1|BAND_MILLI,
@@ -545,14 +654,24 @@ static const u4_t iniChannelFreq[12] = {
     EU868_F9|BAND_CENTI
 };
 
+// Unknown channels start out as good ones
+static void chnlStatReset (u1_t chnl) {
+    chnlstat_t* s = &LMIC.chnlStats[chnl];
+    s->ackRate = s->rx1Rate = 255;
+    s->noise = 0;
+    s->count = 0;
+}
+
 static void initDefaultChannels (bit_t join) {
     os_clearMem(&LMIC.channelFreq, sizeof(LMIC.channelFreq));
     os_clearMem(&LMIC.channelDrMap, sizeof(LMIC.channelDrMap));
     os_clearMem(&LMIC.bands, sizeof(LMIC.bands));
+    for( u1_t chnl=0; chnl<MAX_CHANNELS; chnl++ )
+        chnlStatReset(chnl);
 
     LMIC.channelMap = 0x1FF;
     u1_t su = join ? 0 : 3;
-    u1_t num = join ? 3 : 9;
+    u1_t num = join ? NUM_JOIN_CHANNELS : 9;
     for( u1_t fu=0; fu<num; fu++,su++ ) {
         LMIC.channelFreq[fu]  = iniChannelFreq[su];
         LMIC.channelDrMap[fu] = DR_RANGE_MAP(DR_SF12,DR_SF7);
@@ -604,6 +723,7 @@ bit_t LMIC_setupChannel (u1_t chidx, u4_t freq, u2_t drmap, s1_t band) {
     LMIC.channelFreq [chidx] = freq;
     LMIC.channelDrMap[chidx] = drmap==0 ? DR_RANGE_MAP(DR_SF12,DR_SF7) : drmap;
     LMIC.channelMap |= 1<<chidx;  // enabled right away
+    chnlStatReset(chidx);
     return 1;
 }
 
@@ -633,6 +753,50 @@ static u1_t mapChannels (u1_t chpage, u2_t chmap) {
 }
 
 
+// Minute number of t, advanced by the time passed since airlogStart. Unlike
+// t / AIRLOG_TICKS it carries on across the ostime wrap, 2^32 ticks being no
+// whole number of minutes. It wraps at AIRLOG_WRAP, a multiple of
+// AIRLOG_SLOTS, so the slot of a minute stays minute % AIRLOG_SLOTS.
+static u2_t airlogMinuteOf (ostime_t t) {
+    s4_t d = t - LMIC.airlogStart;
+    if( d < 0 && d > -(s4_t)(AIRLOG_SLOTS*AIRLOG_TICKS) )
+        return (LMIC.airlogNow + AIRLOG_WRAP - (u2_t)((-d-1) / AIRLOG_TICKS + 1)) % AIRLOG_WRAP;
+    u4_t n = (u4_t)d / (u4_t)AIRLOG_TICKS;
+    if( n >= AIRLOG_SLOTS )
+        os_clearMem(LMIC.airlog, sizeof(LMIC.airlog));  // all expired
+    LMIC.airlogNow    = (LMIC.airlogNow + n % AIRLOG_WRAP) % AIRLOG_WRAP;
+    LMIC.airlogStart += n * AIRLOG_TICKS;
+    return LMIC.airlogNow;
+}
+
+// Airtime per band over the last hour, one bucket per minute (AIRLOG_TICKS)
+static void airlogAdd (u1_t band, ostime_t txbeg, ostime_t airtime) {
+    u2_t minute = airlogMinuteOf(txbeg);
+    u1_t slot   = minute % AIRLOG_SLOTS;
+    if( LMIC.airlogMinute[slot] != minute ) {
+        LMIC.airlogMinute[slot] = minute;
+        for( u1_t bi=0; bi<MAX_BANDS; bi++ )
+            LMIC.airlog[bi][slot] = 0;
+    }
+    u4_t ms = LMIC.airlog[band][slot] + osticks2ms(airtime);
+    LMIC.airlog[band][slot] = ms > 0xFFFF ? 0xFFFF : ms;
+}
+
+static ostime_t airlogUsed (u1_t band, ostime_t now) {
+    u2_t minute = airlogMinuteOf(now);
+    s4_t ms = 0;
+    for( u1_t slot=0; slot<AIRLOG_SLOTS; slot++ ) {
+        if( (minute + AIRLOG_WRAP - LMIC.airlogMinute[slot]) % AIRLOG_WRAP < AIRLOG_SLOTS )
+            ms += LMIC.airlog[band][slot];
+    }
+    return ms2osticks(ms);
+}
+
+// Frequency of LMIC.txChnl
+static u4_t txFreq (void) {
+    return LMIC.channelFreq[LMIC.txChnl] & ~(u4_t)3;
+}
+
 static void updateTx (ostime_t txbeg) {
     u4_t freq = LMIC.channelFreq[LMIC.txChnl];
     // Update global/band specific duty cycle stats
@@ -641,10 +805,175 @@ static void updateTx (ostime_t txbeg) {
     xref2band_t band = &LMIC.bands[freq & 0x3];
     LMIC.freq  = freq & ~(u4_t)3;
     LMIC.txpow = band->txpow;
+    lnkLimitTxpow();
     band->avail = txbeg + airtime * band->txcap;
     printf("%lu: freq=%lu\n", os_getTime(), LMIC.freq);
     if( LMIC.globalDutyRate != 0 )
         LMIC.globalDutyAvail = txbeg + (airtime<<LMIC.globalDutyRate);
+    airlogAdd(freq & 0x3, txbeg, airtime);
+}
+
+// Moving average over roughly the last 8 samples, 255 = always
+static u1_t chnlAvg (u1_t avg, bit_t hit) {
+    return hit ? avg + ((255-avg+7) >> 3) : avg - ((avg+7) >> 3);
+}
+
+void LMIC_addChnlNoise (u1_t channel, s1_t dBm) {
+    if( channel >= MAX_CHANNELS || dBm >= 0 )
+        return;
+    chnlstat_t* s = &LMIC.chnlStats[channel];
+    s->noise = s->noise == 0 ? dBm : s->noise + (dBm - s->noise) / 4;
+}
+
+void LMIC_setChnlPolicy (u1_t policy) {
+    LMIC.chnlPolicy = policy;
+}
+
+// Sample one channel per job so MAC jobs can run in between
+static void runSweep (xref2osjob_t osjob) {
+    ostime_t now = os_getTime();
+    if( (LMIC.opmode & (OP_SCAN|OP_TXRXPEND|OP_SHUTDOWN)) != 0 ) {
+        os_setTimedCallback(&LMIC.sweepJob, now + SWEEP_RETRY_osticks, FUNC_ADDR(runSweep));
+        return;
+    }
+    noisesweep_t* s = &LMIC.noiseLog[LMIC.noiseHead];
+    u1_t chnl = LMIC.sweepChnl;
+    if( chnl == 0 )
+        os_clearMem(s, sizeof(*s));
+    while( chnl < MAX_CHANNELS && LMIC.channelFreq[chnl] == 0 )
+        chnl++;
+    u4_t freq = chnl < MAX_CHANNELS ? LMIC.channelFreq[chnl] & ~(u4_t)3 : LMIC.dn2Freq;
+    // Class C RX is paused for the sample - not while a frame is coming in
+    if( LMIC.rxcOn && radio_rxBusy() ) {
+        LMIC.sweepChnl = chnl;
+        os_setTimedCallback(&LMIC.sweepJob, now + SWEEP_RETRY_osticks, FUNC_ADDR(runSweep));
+        return;
+    }
+    if( LMIC.rxcOn )
+        os_radio(RADIO_RST);
+    s1_t dBm = radio_sampleRssi(freq);
+    if( LMIC.rxcOn )
+        os_radio(RADIO_RXON);
+    if( dBm == 0 ) {
+        // Radio busy with a beacon or ping slot
+        LMIC.sweepChnl = chnl;
+        os_setTimedCallback(&LMIC.sweepJob, now + SWEEP_RETRY_osticks, FUNC_ADDR(runSweep));
+        return;
+    }
+    s->dBm[chnl] = dBm;
+    if( chnl < MAX_CHANNELS ) {
+        LMIC_addChnlNoise(chnl, dBm);
+        LMIC.sweepChnl = chnl+1;
+        os_setCallback(&LMIC.sweepJob, FUNC_ADDR(runSweep));
+        return;
+    }
+    s->time = now;
+    LMIC.noiseHead = (LMIC.noiseHead+1) % NOISE_SWEEPS;
+    if( LMIC.noiseCnt < NOISE_SWEEPS )
+        LMIC.noiseCnt++;
+    LMIC.sweepChnl = 0;
+    os_setTimedCallback(&LMIC.sweepJob, now + LMIC.sweepIntv, FUNC_ADDR(runSweep));
+}
+
+void LMIC_setNoiseSweep (ostime_t intv) {
+    LMIC.sweepIntv = intv;
+    LMIC.sweepChnl = 0;
+    if( intv == 0 )
+        os_clearCallback(&LMIC.sweepJob);
+    else
+        os_setCallback(&LMIC.sweepJob, FUNC_ADDR(runSweep));
+}
+
+const noisesweep_t* LMIC_peekNoise (u1_t idx) {
+    if( idx >= LMIC.noiseCnt )
+        return NULL;
+    return &LMIC.noiseLog[(LMIC.noiseHead + NOISE_SWEEPS-1 - idx) % NOISE_SWEEPS];
+}
+
+// Channel count n, then per sweep oldest first: age [s] (2 bytes LSB first,
+// saturated) and n bytes of -dBm (0 = channel not defined). Sweeps that don't
+// fit are dropped from the old end.
+int LMIC_exportNoise (xref2u1_t buf, int len) {
+    enum { N = MAX_CHANNELS+1, REC = 2+N };
+    if( len < 1 )
+        return 0;
+    int cnt = (len-1) / REC;
+    if( cnt > LMIC.noiseCnt )
+        cnt = LMIC.noiseCnt;
+    ostime_t now = os_getTime();
+    buf[0] = N;
+    int pos = 1;
+    while( cnt-- > 0 ) {
+        const noisesweep_t* s = LMIC_peekNoise(cnt);
+        ostime_t age = (now - s->time) / OSTICKS_PER_SEC;
+        os_wlsbf2(buf+pos, age > 0xFFFF ? 0xFFFF : age);
+        for( u1_t i=0; i<N; i++ )
+            buf[pos+2+i] = -s->dBm[i];
+        pos += REC;
+    }
+    return pos;
+}
+
+// Account the outcome of the uplink on LMIC.txChnl (rx - got a valid downlink)
+static void chnlUpdate (bit_t rx) {
+    chnlstat_t* s = &LMIC.chnlStats[LMIC.txChnl];
+    bit_t rx1 = rx && (LMIC.txrxFlags & TXRX_DNW1) != 0;
+    if( LMIC.txCnt != 0 )
+        s->ackRate = chnlAvg(s->ackRate, rx && (LMIC.txrxFlags & TXRX_ACK) != 0);
+    // Without a confirmed frame silence does not tell whether RX1 failed
+    if( rx || LMIC.txCnt != 0 )
+        s->rx1Rate = chnlAvg(s->rx1Rate, rx1);
+    // RX1 is on the uplink frequency - packet RSSI less SNR estimates the noise there
+    if( rx1 && getSf(LMIC.rps) != FSK )
+        LMIC_addChnlNoise(LMIC.txChnl, LMIC.rssi - RSSI_OFF - LMIC.snr / SNR_SCALEUP);
+    if( s->count < 255 )
+        s->count++;
+}
+
+static bit_t chnlUsable (u1_t chnl, u1_t band) {
+    return (LMIC.channelMap & (1<<chnl)) != 0  &&  // channel enabled
+        (LMIC.channelDrMap[chnl] & (1<<(LMIC.datarate&0xF))) != 0  &&
+        band == (LMIC.channelFreq[chnl] & 0x3);    // in selected band
+}
+
+// CHNL_QUALITY: pick a random channel of the band weighted by its worse rate,
+// less 8 per dB of noise above the quietest channel. Every channel keeps a base
+// weight and the last one is skipped if there are others, so traffic still
+// spreads over all channels of the band.
+enum { CHNL_MINWEIGHT = 16 };
+
+static u1_t pickChnl (u1_t band) {
+    u1_t cands[MAX_CHANNELS];
+    u1_t n = 0;
+    s1_t quietest = 0;
+    for( u1_t chnl=0; chnl<MAX_CHANNELS; chnl++ ) {
+        if( !chnlUsable(chnl, band) )
+            continue;
+        cands[n++] = chnl;
+        s1_t noise = LMIC.chnlStats[chnl].noise;
+        if( noise != 0 && (quietest == 0 || noise < quietest) )
+            quietest = noise;
+    }
+    if( n == 0 )
+        return MAX_CHANNELS;
+    u2_t weights[MAX_CHANNELS];
+    u2_t total = 0;
+    for( u1_t ci=0; ci<n; ci++ ) {
+        chnlstat_t* s = &LMIC.chnlStats[cands[ci]];
+        int w = 0;
+        if( n == 1 || cands[ci] != LMIC.bands[band].lastchnl ) {
+            w = s->ackRate < s->rx1Rate ? s->ackRate : s->rx1Rate;
+            if( s->noise != 0 )
+                w -= 8 * (s->noise - quietest);
+            w = CHNL_MINWEIGHT + (w > 0 ? w : 0);
+        }
+        total += weights[ci] = w;
+    }
+    u2_t r = (((u2_t)os_getRndU1() << 8) | os_getRndU1()) % total;
+    u1_t ci = 0;
+    while( r >= weights[ci] )
+        r -= weights[ci++];
+    return cands[ci];
 }
 
 static ostime_t nextTx (ostime_t now) {
@@ -656,17 +985,23 @@ static ostime_t nextTx (ostime_t now) {
             if( (bmap & (1<<bi)) && mintime - LMIC.bands[bi].avail > 0 )
                 mintime = LMIC.bands[band = bi].avail;
         }
-        // Find next channel in given band
-        u1_t chnl = LMIC.bands[band].lastchnl;
-        for( u1_t ci=0; ci<MAX_CHANNELS; ci++ ) {
-            if( (chnl = (chnl+1)) >= MAX_CHANNELS )
-                chnl -=  MAX_CHANNELS;
-            if( (LMIC.channelMap & (1<<chnl)) != 0  &&  // channel enabled
-                (LMIC.channelDrMap[chnl] & (1<<(LMIC.datarate&0xF))) != 0  &&
-                band == (LMIC.channelFreq[chnl] & 0x3) ) { // in selected band
+        if( LMIC.chnlPolicy == CHNL_QUALITY ) {
+            u1_t chnl = pickChnl(band);
+            if( chnl < MAX_CHANNELS ) {
                 LMIC.txChnl = LMIC.bands[band].lastchnl = chnl;
                 return mintime;
             }
+        } else {
+            // Find next channel in given band
+            u1_t chnl = LMIC.bands[band].lastchnl;
+            for( u1_t ci=0; ci<MAX_CHANNELS; ci++ ) {
+                if( (chnl = (chnl+1)) >= MAX_CHANNELS )
+                    chnl -=  MAX_CHANNELS;
+                if( chnlUsable(chnl, band) ) {
+                    LMIC.txChnl = LMIC.bands[band].lastchnl = chnl;
+                    return mintime;
+                }
+            }
         }
         if( (bmap &= ~(1<<band)) == 0 ) {
             // No feasible channel  found!
@@ -684,29 +1019,45 @@ static void setBcnRxParams (void) {
 
 #define setRx1Params() /*LMIC.freq/rps remain unchanged*/
 
+// Standard join sweep: random default channel, DR_SF7 down to DR_SF12
+static void initJoinSweep (void) {
+    LMIC.txChnl = os_getRndU1() % NUM_JOIN_CHANNELS;
+    LMIC.txCnt = 0;
+    setDrJoin(DRCHG_SET, DR_SF7);
+}
+
 static void initJoinLoop (void) {
-    LMIC.txChnl = os_getRndU1() % 6;
     LMIC.adrTxPow = 14;
-    setDrJoin(DRCHG_SET, DR_SF7);
+    initJoinSweep();
     initDefaultChannels(1);
     ASSERT((LMIC.opmode & OP_NEXTCHNL)==0);
     LMIC.txend = LMIC.bands[BAND_MILLI].avail + rndDelay(8);
+    if( (LMIC.joinHintLeft = LMIC.joinHintOn ? JOIN_HINT_TRIES : 0) != 0 ) {
+        LMIC.txChnl = LMIC.joinHintChnl;
+        setDrJoin(DRCHG_SET, LMIC.joinHintDr);
+    }
 }
 
 
 static ostime_t nextJoinState (void) {
     u1_t failed = 0;
 
-    // Try 869.x and then 864.x with same DR
-    // If both fail try next lower datarate
-    if( ++LMIC.txChnl == 6 )
-        LMIC.txChnl = 0;
-    if( (++LMIC.txCnt & 1) == 0 ) {
-        // Lower DR every 2nd try (having tried 868.x and 864.x with the same DR)
-        if( LMIC.datarate == DR_SF12 )
-            failed = 1; // we have tried all DR - signal EV_JOIN_FAILED
-        else
-            setDrJoin(DRCHG_NOJACC, decDR((dr_t)LMIC.datarate));
+    if( LMIC.joinHintLeft != 0 ) {
+        // Retry the last good channel/DR, then fall back to the sweep
+        if( --LMIC.joinHintLeft == 0 )
+            initJoinSweep();
+    } else {
+        // Try the next join channel with the same DR
+        // If that fails too try next lower datarate
+        if( ++LMIC.txChnl == NUM_JOIN_CHANNELS )
+            LMIC.txChnl = 0;
+        if( (++LMIC.txCnt & 1) == 0 ) {
+            // Lower DR every 2nd try (having tried two channels with the same DR)
+            if( LMIC.datarate == DR_SF12 )
+                failed = 1; // we have tried all DR - signal EV_JOIN_FAILED
+            else
+                setDrJoin(DRCHG_NOJACC, decDR((dr_t)LMIC.datarate));
+        }
     }
     // Clear NEXTCHNL because join state engine controls channel hopping
     LMIC.opmode &= ~OP_NEXTCHNL;
@@ -779,22 +1130,29 @@ static u1_t mapChannels (u1_t chpage, u2_t chmap) {
     return 1;
 }
 
-static void updateTx (ostime_t txbeg) {
+// Frequency of LMIC.txChnl
+static u4_t txFreq (void) {
     u1_t chnl = LMIC.txChnl;
     if( chnl < 64 ) {
-        //LMIC.freq = US915_125kHz_UPFBASE + chnl*US915_125kHz_UPFSTEP;
-        LMIC.freq = US915_125kHz_UPFBASE;
+        //return US915_125kHz_UPFBASE + chnl*US915_125kHz_UPFSTEP;
+        return US915_125kHz_UPFBASE;
+    }
+    if( chnl < 64+8 )
+        return US915_500kHz_UPFBASE + (chnl-64)*US915_500kHz_UPFSTEP;
+    ASSERT(chnl < 64+8+MAX_XCHANNELS);
+    return LMIC.xchFreq[chnl-72];
+}
+
+static void updateTx (ostime_t txbeg) {
+    LMIC.freq = txFreq();
+    if( LMIC.txChnl < 64 ) {
         LMIC.txpow = 30;
+        lnkLimitTxpow();
     	printf("%lu: freq=%lu\n", os_getTime(), LMIC.freq);
         return;
     }
     LMIC.txpow = 26;
-    if( chnl < 64+8 ) {
-        LMIC.freq = US915_500kHz_UPFBASE + (chnl-64)*US915_500kHz_UPFSTEP;
-    } else {
-        ASSERT(chnl < 64+8+MAX_XCHANNELS);
-        LMIC.freq = LMIC.xchFreq[chnl-72];
-    }
+    lnkLimitTxpow();
 
     printf("%lu: freq=%lu\n", os_getTime(), LMIC.freq);
     // Update global duty cycle stats
@@ -835,6 +1193,8 @@ static void setBcnRxParams (void) {
     LMIC.rps  = setIh(setNocrc(dndr2rps((dr_t)DR_BCN),1),LEN_BCN);
 }
 
+#define chnlUpdate(rx) /* no channel statistics */
+
 #define setRx1Params() {                                                \
     LMIC.freq = US915_500kHz_DNFBASE + (LMIC.txChnl & 0x7) * US915_500kHz_DNFSTEP; \
     if( /* TX datarate */LMIC.dndr < DR_SF8C )                          \
@@ -844,13 +1204,23 @@ static void setBcnRxParams (void) {
     LMIC.rps = dndr2rps(LMIC.dndr);                                     \
 }
 
-static void initJoinLoop (void) {
+// Standard join sweep: all 125kHz channels SF7..SF10 interleaved with SF8C
+static void initJoinSweep (void) {
     LMIC.chRnd = 0;
     LMIC.txChnl = 0;
+    LMIC.txCnt = 0;
+    setDrJoin(DRCHG_SET, DR_SF7);
+}
+
+static void initJoinLoop (void) {
     LMIC.adrTxPow = 20;
     ASSERT((LMIC.opmode & OP_NEXTCHNL)==0);
     LMIC.txend = os_getTime();
-    setDrJoin(DRCHG_SET, DR_SF7);
+    initJoinSweep();
+    if( (LMIC.joinHintLeft = LMIC.joinHintOn ? JOIN_HINT_TRIES : 0) != 0 ) {
+        LMIC.txChnl = LMIC.joinHintChnl;
+        setDrJoin(DRCHG_SET, LMIC.joinHintDr);
+    }
 }
 
 static ostime_t nextJoinState (void) {
@@ -859,7 +1229,13 @@ static ostime_t nextJoinState (void) {
     //   SF8C        on a random channel 64..71
     //
     u1_t failed = 0;
-    if( LMIC.datarate != DR_SF8C ) {
+    if( LMIC.joinHintLeft != 0 ) {
+        // Retry the sub-band/DR of the last join, then fall back to the sweep
+        if( --LMIC.joinHintLeft == 0 )
+            initJoinSweep();
+        else if( LMIC.txChnl < 64 )
+            LMIC.txChnl = (LMIC.joinHintChnl & ~7) | (os_getRndU1() & 7);
+    } else if( LMIC.datarate != DR_SF8C ) {
         LMIC.txChnl = 64+(LMIC.txChnl&7);
         setDrJoin(DRCHG_SET, DR_SF8C);
     } else {
@@ -916,9 +1292,8 @@ static void runReset (xref2osjob_t osjob) {
 static void stateJustJoined (void) {
     LMIC.seqnoDn     = LMIC.seqnoUp = 0;
     LMIC.rejoinCnt   = 0;
-    LMIC.dnConf      = LMIC.adrChanged = LMIC.ladrAns = LMIC.devsAns = 0;
-    LMIC.moreData    = LMIC.dn2Ans = LMIC.snchAns = LMIC.dutyCapAns = 0;
-    LMIC.pingSetAns  = 0;
+    LMIC.dnConf      = LMIC.adrChanged = LMIC.macAnsLen = 0;
+    LMIC.moreData    = 0;
     LMIC.upRepeat    = 0;
     LMIC.adrAckReq   = LINK_CHECK_INIT;
     LMIC.dn2Dr       = DR_DNW2;
@@ -970,6 +1345,262 @@ static int decodeBeacon (void) {
 }
 
 
+// Copy a decoded frame into the downlink ring - never overwrites unreleased entries
+static void pushDnData (u4_t seqno) {
+    hal_disableIRQs();
+    if( DNQ.cnt == MAX_DNQ ) {
+        DNQ.dropped++;
+    } else {
+        dnmsg_t* m = &DNQ.msg[(DNQ.head + DNQ.cnt) % MAX_DNQ];
+        m->rxtime    = LMIC.rxtime;
+        m->seqno     = seqno;
+        m->rssi      = LMIC.rssi;
+        m->snr       = LMIC.snr;
+        m->txrxFlags = LMIC.txrxFlags;
+        m->port      = LMIC.frame[LMIC.dataBeg-1];
+        m->dataLen   = LMIC.dataLen;
+        os_copyMem(m->data, LMIC.frame+LMIC.dataBeg, LMIC.dataLen);
+        DNQ.cnt++;
+    }
+    hal_enableIRQs();
+}
+
+
+// ================================================================================
+// MAC commands
+//
+// Downlink commands are dispatched through MCMDS. A handler gets the request
+// (command byte first) and fills in the payload of the answer, which is then
+// queued in LMIC.macAns. A later answer to the same command replaces the
+// queued one. packMacOpts() puts as many answers as fit into the FOpts of the
+// next uplink and keeps the rest for the frames after it.
+
+typedef void (mcmdfn_t)(xref2u1_t req, xref2u1_t ans);
+
+struct mcmd_t {
+    u1_t      cmd;
+    u1_t      len;      // request length incl. command byte
+    u1_t      anslen;   // answer length incl. command byte, 0=no answer
+    mcmdfn_t* fn;
+};
+
+static void mcmdLinkCheckAns (xref2u1_t req, xref2u1_t ans) {
+    LMIC.lchkMargin = req[1];
+    LMIC.lchkGws    = req[2];
+    // Measured on our uplink - better than the downlink guess in decodeFrame
+    if( LMIC.lchkMargin != 255 )  // 255 = unknown
+        lnkSample(LMIC.lchkMargin);
+}
+
+static void mcmdLinkAdrReq (xref2u1_t req, xref2u1_t ans) {
+    u1_t p1     = req[1];                          // txpow + DR
+    u2_t chmap  = os_rlsbf2(&req[2]);              // list of enabled channels
+    u1_t chpage = req[4] & MCMD_LADR_CHPAGE_MASK;  // channel page
+    u1_t uprpt  = req[4] & MCMD_LADR_REPEAT_MASK;  // up repeat count
+
+    u1_t acks = MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK;
+    if( !mapChannels(chpage, chmap) )
+        acks &= ~MCMD_LADR_ANS_CHACK;
+    dr_t dr = (dr_t)(p1>>MCMD_LADR_DR_SHIFT);
+    if( !validDR(dr) ) {
+        acks &= ~MCMD_LADR_ANS_DRACK;
+        EV(specCond, ERR, (e_.reason = EV::specCond_t::BAD_MAC_CMD,
+                           e_.eui    = MAIN::CDEV->getEui(),
+                           e_.info   = Base::lsbf4(&LMIC.frame[LMIC.dataLen-4]),
+                           e_.info2  = Base::msbf4(&req[1])));
+    }
+    if( acks == (MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK) ) {
+        // Nothing went wrong - use settings
+        LMIC.upRepeat = uprpt;
+        setDrTxpow(DRCHG_NWKCMD, dr, pow2dBm(p1));
+    }
+    LMIC.adrChanged = 1;  // Trigger an ACK to NWK
+    ans[1] = acks;
+}
+
+static void mcmdDutyCapReq (xref2u1_t req, xref2u1_t ans) {
+    u1_t cap = req[1];
+    // A value cap=0xFF means device is OFF unless enabled again manually.
+    if( cap==0xFF )
+        LMIC.opmode |= OP_SHUTDOWN;  // stop any sending
+    LMIC.globalDutyRate  = cap & 0xF;
+    LMIC.globalDutyAvail = os_getTime();
+    DO_DEVDB(cap,dutyCap);
+}
+
+static void mcmdRx2SetupReq (xref2u1_t req, xref2u1_t ans) {
+    dr_t dr = (dr_t)(req[1] & 0x0F);
+    u4_t freq = convFreq(&req[2]);
+    u1_t acks = 0;
+    if( validDR(dr) )
+        acks |= MCMD_DN2P_ANS_DRACK;
+    if( freq != 0 )
+        acks |= MCMD_DN2P_ANS_CHACK;
+    if( acks == (MCMD_DN2P_ANS_DRACK|MCMD_DN2P_ANS_CHACK) ) {
+        LMIC.dn2Dr = dr;
+        LMIC.dn2Freq = freq;
+        DO_DEVDB(LMIC.dn2Dr,dn2Dr);
+        DO_DEVDB(LMIC.dn2Freq,dn2Freq);
+    }
+    ans[1] = acks;
+}
+
+static void mcmdDevStatusReq (xref2u1_t req, xref2u1_t ans) {
+    ans[1] = LMIC.margin;
+    ans[2] = os_getBattLevel();
+}
+
+static void mcmdNewChannelReq (xref2u1_t req, xref2u1_t ans) {
+    u1_t chidx = req[1];             // channel
+    u4_t freq  = convFreq(&req[2]);  // freq
+    u1_t drs   = req[5];             // datarate span
+    ans[1] = 0;
+    if( freq != 0 && LMIC_setupChannel(chidx, freq, DR_RANGE_MAP(drs&0xF,drs>>4), -1) )
+        ans[1] = MCMD_SNCH_ANS_DRACK|MCMD_SNCH_ANS_FQACK;
+}
+
+static void mcmdPingSet (xref2u1_t req, xref2u1_t ans) {
+    u4_t freq = convFreq(&req[1]);
+    ans[1] = 0;
+    if( freq != 0 ) {
+        ans[1] = MCMD_PING_ANS_FQACK;
+        LMIC.ping.freq = freq;
+        DO_DEVDB(LMIC.ping.intvExp, pingIntvExp);
+        DO_DEVDB(LMIC.ping.freq, pingFreq);
+        DO_DEVDB(LMIC.ping.dr, pingDr);
+    }
+}
+
+static void mcmdBeaconInfoAns (xref2u1_t req, xref2u1_t ans) {
+    // Ignore if tracking already enabled
+    if( (LMIC.opmode & OP_TRACK) != 0 )
+        return;
+    LMIC.bcnChnl = req[3];
+    // Enable tracking - bcninfoTries
+    LMIC.opmode |= OP_TRACK;
+    // Cleared later in txComplete handling - triggers EV_BEACON_FOUND
+    ASSERT(LMIC.bcninfoTries!=0);
+    // Setup RX parameters
+    LMIC.bcninfo.txtime = (LMIC.rxtime
+                           + ms2osticks(os_rlsbf2(&req[1]) * MCMD_BCNI_TUNIT)
+                           + ms2osticksCeil(MCMD_BCNI_TUNIT/2)
+                           - BCN_INTV_osticks);
+    LMIC.bcninfo.flags = 0;  // txtime above cannot be used as reference (BCN_PARTIAL|BCN_FULL cleared)
+    calcBcnRxWindowFromMillis(MCMD_BCNI_TUNIT,1);  // error of +/-N ms 
+
+    EV(lostFrame, INFO, (e_.reason  = EV::lostFrame_t::MCMD_BCNI_ANS,
+                         e_.eui     = MAIN::CDEV->getEui(),
+                         e_.lostmic = Base::lsbf4(&LMIC.frame[LMIC.dataLen-4]),
+                         e_.info    = (LMIC.missedBcns |
+                                       (osticks2us(LMIC.bcninfo.txtime + BCN_INTV_osticks
+                                                   - LMIC.bcnRxtime) << 8)),
+                         e_.time    = MAIN::CDEV->ostime2ustime(LMIC.bcninfo.txtime + BCN_INTV_osticks)));
+}
+
+static const struct mcmd_t MCMDS[] = {
+    { MCMD_LCHK_ANS, 3, 0, mcmdLinkCheckAns  },
+    { MCMD_LADR_REQ, 5, 2, mcmdLinkAdrReq    },
+    { MCMD_DCAP_REQ, 2, 1, mcmdDutyCapReq    },
+    { MCMD_DN2P_SET, 5, 2, mcmdRx2SetupReq   },
+    { MCMD_DEVS_REQ, 1, 3, mcmdDevStatusReq  },
+    { MCMD_SNCH_REQ, 6, 2, mcmdNewChannelReq },
+    { MCMD_PING_SET, 4, 2, mcmdPingSet       },
+    { MCMD_BCNI_ANS, 4, 0, mcmdBeaconInfoAns },
+};
+enum { MCMD_MAXANS = 3 };  // longest answer in MCMDS
+
+static const struct mcmd_t* findMcmd (u1_t cmd) {
+    for( u1_t i=0; i<sizeof(MCMDS)/sizeof(MCMDS[0]); i++ ) {
+        if( MCMDS[i].cmd == cmd )
+            return &MCMDS[i];
+    }
+    return NULL;
+}
+
+// Queue an answer, dropping a pending answer to the same command
+static void macAnsPut (xref2u1_t ans, u1_t len) {
+    u1_t i = 0;
+    while( i < LMIC.macAnsLen ) {
+        u1_t n = findMcmd(LMIC.macAns[i])->anslen;
+        if( LMIC.macAns[i] == ans[0] ) {
+            memmove(LMIC.macAns+i, LMIC.macAns+i+n, LMIC.macAnsLen-i-n);
+            LMIC.macAnsLen -= n;
+            break;
+        }
+        i += n;
+    }
+    ASSERT(LMIC.macAnsLen + len <= MAX_MACANS);
+    os_copyMem(LMIC.macAns+LMIC.macAnsLen, ans, len);
+    LMIC.macAnsLen += len;
+}
+
+// Run the MAC commands in opts, returns the number of bytes consumed
+// (less than olen if an unknown or truncated command stopped parsing)
+static int parseMacCmds (xref2u1_t opts, int olen) {
+    int oidx = 0;
+    while( oidx < olen ) {
+        const struct mcmd_t* mc = findMcmd(opts[oidx]);
+        if( mc == NULL || oidx + mc->len > olen ) {
+            EV(specCond, ERR, (e_.reason = EV::specCond_t::BAD_MAC_CMD,
+                               e_.eui    = MAIN::CDEV->getEui(),
+                               e_.info   = Base::lsbf4(&LMIC.frame[LMIC.dataLen-4]),
+                               e_.info2  = Base::msbf4(&opts[oidx])));
+            break;
+        }
+        u1_t ans[MCMD_MAXANS];
+        ans[0] = mc->cmd;
+        mc->fn(&opts[oidx], ans);
+        if( mc->anslen != 0 )
+            macAnsPut(ans, mc->anslen);
+        oidx += mc->len;
+    }
+    return oidx;
+}
+
+// Write the MAC options of the next uplink to opts (NULL - only measure) and
+// return their length. Queued answers that do not fit into the FOpts field
+// stay queued if consume is set.
+static u1_t packMacOpts (xref2u1_t opts, bit_t consume) {
+    u1_t end = 0;
+    if( (LMIC.opmode & (OP_TRACK|OP_PINGABLE)) == (OP_TRACK|OP_PINGABLE) ) {
+        // Indicate pingability in every UP frame
+        if( opts != NULL ) {
+            opts[0] = MCMD_PING_IND;
+            opts[1] = LMIC.ping.dr | (LMIC.ping.intvExp<<4);
+        }
+        end += 2;
+    }
+    u1_t keep = 0;
+    for( u1_t i=0; i<LMIC.macAnsLen; ) {
+        u1_t n = findMcmd(LMIC.macAns[i])->anslen;
+        if( end + n <= FCT_OPTLEN ) {
+            if( opts != NULL )
+                os_copyMem(opts+end, LMIC.macAns+i, n);
+            end += n;
+        } else if( consume ) {
+            memmove(LMIC.macAns+keep, LMIC.macAns+i, n);
+            keep += n;
+        }
+        i += n;
+    }
+    if( consume )
+        LMIC.macAnsLen = keep;
+    if( LMIC.bcninfoTries > 0 && end < FCT_OPTLEN ) {
+        if( opts != NULL )
+            opts[end] = MCMD_BCNI_REQ;
+        end += 1;
+    }
+    if( LMIC.lchkReq && end < FCT_OPTLEN ) {
+        if( opts != NULL )
+            opts[end] = MCMD_LCHK_REQ;
+        end += 1;
+        if( consume )
+            LMIC.lchkReq = 0;
+    }
+    return end;
+}
+
+
 static bit_t decodeFrame (void) {
     xref2u1_t d = LMIC.frame;
     u1_t hdr    = d[0];
@@ -1070,136 +1701,9 @@ static bit_t decodeFrame (void) {
     // Process OPTS
     int m = LMIC.rssi - RSSI_OFF - getSensitivity(LMIC.rps);
     LMIC.margin = m < 0 ? 0 : m > 254 ? 254 : m;
+    lnkSampleDn();
 
-    xref2u1_t opts = &d[OFF_DAT_OPTS];
-    int oidx = 0;
-    while( oidx < olen ) {
-        switch( opts[oidx] ) {
-        case MCMD_LCHK_ANS: {
-            //int gwmargin = opts[oidx+1];
-            //int ngws = opts[oidx+2];
-            oidx += 3;
-            continue;
-        }
-        case MCMD_LADR_REQ: {
-            u1_t p1     = opts[oidx+1];            // txpow + DR
-            u2_t chmap  = os_rlsbf2(&opts[oidx+2]);// list of enabled channels
-            u1_t chpage = opts[oidx+4] & MCMD_LADR_CHPAGE_MASK;     // channel page
-            u1_t uprpt  = opts[oidx+4] & MCMD_LADR_REPEAT_MASK;     // up repeat count
-            oidx += 5;
-
-            LMIC.ladrAns = 0x80 |     // Include an answer into next frame up
-                MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK;
-            if( !mapChannels(chpage, chmap) )
-                LMIC.ladrAns &= ~MCMD_LADR_ANS_CHACK;
-            dr_t dr = (dr_t)(p1>>MCMD_LADR_DR_SHIFT);
-            if( !validDR(dr) ) {
-                LMIC.ladrAns &= ~MCMD_LADR_ANS_DRACK;
-                EV(specCond, ERR, (e_.reason = EV::specCond_t::BAD_MAC_CMD,
-                                   e_.eui    = MAIN::CDEV->getEui(),
-                                   e_.info   = Base::lsbf4(&d[pend]),
-                                   e_.info2  = Base::msbf4(&opts[oidx-4])));
-            }
-            if( (LMIC.ladrAns & 0x7F) == (MCMD_LADR_ANS_POWACK | MCMD_LADR_ANS_CHACK | MCMD_LADR_ANS_DRACK) ) {
-                // Nothing went wrong - use settings
-                LMIC.upRepeat = uprpt;
-                setDrTxpow(DRCHG_NWKCMD, dr, pow2dBm(p1));
-            }
-            LMIC.adrChanged = 1;  // Trigger an ACK to NWK
-            continue;
-        }
-        case MCMD_DEVS_REQ: {
-            LMIC.devsAns = 1;
-            oidx += 1;
-            continue;
-        }
-        case MCMD_DN2P_SET: {
-            dr_t dr = (dr_t)(opts[oidx+1] & 0x0F);
-            u4_t freq = convFreq(&opts[oidx+2]);
-            oidx += 5;
-            LMIC.dn2Ans = 0x80;   // answer pending
-            if( validDR(dr) )
-                LMIC.dn2Ans |= MCMD_DN2P_ANS_DRACK;
-            if( freq != 0 )
-                LMIC.dn2Ans |= MCMD_DN2P_ANS_CHACK;
-            if( LMIC.dn2Ans == (0x80|MCMD_DN2P_ANS_DRACK|MCMD_DN2P_ANS_CHACK) ) {
-                LMIC.dn2Dr = dr;
-                LMIC.dn2Freq = freq;
-                DO_DEVDB(LMIC.dn2Dr,dn2Dr);
-                DO_DEVDB(LMIC.dn2Freq,dn2Freq);
-            }
-            continue;
-        }
-        case MCMD_DCAP_REQ: {
-            u1_t cap = opts[oidx+1];
-            oidx += 2;
-            // A value cap=0xFF means device is OFF unless enabled again manually.
-            if( cap==0xFF )
-                LMIC.opmode |= OP_SHUTDOWN;  // stop any sending
-            LMIC.globalDutyRate  = cap & 0xF;
-            LMIC.globalDutyAvail = os_getTime();
-            DO_DEVDB(cap,dutyCap);
-            LMIC.dutyCapAns = 1;
-            continue;
-        }
-        case MCMD_SNCH_REQ: {
-            u1_t chidx = opts[oidx+1];  // channel
-            u4_t freq  = convFreq(&opts[oidx+2]); // freq
-            u1_t drs   = opts[oidx+5];  // datarate span
-            LMIC.snchAns = 0x80;
-            if( freq != 0 && LMIC_setupChannel(chidx, freq, DR_RANGE_MAP(drs&0xF,drs>>4), -1) )
-                LMIC.snchAns |= MCMD_SNCH_ANS_DRACK|MCMD_SNCH_ANS_FQACK;
-            oidx += 6;
-            continue;
-        }
-        case MCMD_PING_SET: {
-            u4_t freq = convFreq(&opts[oidx+1]);
-            oidx += 4;
-            u1_t flags = 0x80;
-            if( freq != 0 ) {
-                flags |= MCMD_PING_ANS_FQACK;
-                LMIC.ping.freq = freq;
-                DO_DEVDB(LMIC.ping.intvExp, pingIntvExp);
-                DO_DEVDB(LMIC.ping.freq, pingFreq);
-                DO_DEVDB(LMIC.ping.dr, pingDr);
-            }
-            LMIC.pingSetAns = flags;
-            continue;
-        }
-        case MCMD_BCNI_ANS: {
-            // Ignore if tracking already enabled
-            if( (LMIC.opmode & OP_TRACK) == 0 ) {
-                LMIC.bcnChnl = opts[oidx+3];
-                // Enable tracking - bcninfoTries
-                LMIC.opmode |= OP_TRACK;
-                // Cleared later in txComplete handling - triggers EV_BEACON_FOUND
-                ASSERT(LMIC.bcninfoTries!=0);
-                // Setup RX parameters
-                LMIC.bcninfo.txtime = (LMIC.rxtime
-                                       + ms2osticks(os_rlsbf2(&opts[oidx+1]) * MCMD_BCNI_TUNIT)
-                                       + ms2osticksCeil(MCMD_BCNI_TUNIT/2)
-                                       - BCN_INTV_osticks);
-                LMIC.bcninfo.flags = 0;  // txtime above cannot be used as reference (BCN_PARTIAL|BCN_FULL cleared)
-                calcBcnRxWindowFromMillis(MCMD_BCNI_TUNIT,1);  // error of +/-N ms 
-
-                EV(lostFrame, INFO, (e_.reason  = EV::lostFrame_t::MCMD_BCNI_ANS,
-                                     e_.eui     = MAIN::CDEV->getEui(),
-                                     e_.lostmic = Base::lsbf4(&d[pend]),
-                                     e_.info    = (LMIC.missedBcns |
-                                                   (osticks2us(LMIC.bcninfo.txtime + BCN_INTV_osticks
-                                                               - LMIC.bcnRxtime) << 8)),
-                                     e_.time    = MAIN::CDEV->ostime2ustime(LMIC.bcninfo.txtime + BCN_INTV_osticks)));
-            }
-            oidx += 4;
-            continue;
-        }
-        }
-        EV(specCond, ERR, (e_.reason = EV::specCond_t::BAD_MAC_CMD,
-                           e_.eui    = MAIN::CDEV->getEui(),
-                           e_.info   = Base::lsbf4(&d[pend]),
-                           e_.info2  = Base::msbf4(&opts[oidx])));
-        break;
-    }
+    int oidx = parseMacCmds(&d[OFF_DAT_OPTS], olen);
     if( oidx != olen ) {
         EV(specCond, ERR, (e_.reason = EV::specCond_t::CORRUPTED_FRAME,
                            e_.eui    = MAIN::CDEV->getEui(),
@@ -1211,6 +1715,9 @@ static bit_t decodeFrame (void) {
         // Decrypt payload - if any
         if( port >= 0  &&  pend-poff > 0 )
             aes_cipher(port <= 0 ? LMIC.nwkKey : LMIC.artKey, LMIC.devaddr, seqno, /*dn*/1, d+poff, pend-poff);
+        // Port 0 carries MAC commands instead of FOpts
+        if( port == 0 && olen == 0 )
+            parseMacCmds(d+poff, pend-poff);
 
         EV(dfinfo, DEBUG, (e_.deveui  = MAIN::CDEV->getEui(),
                            e_.devaddr = LMIC.devaddr,
@@ -1253,6 +1760,8 @@ static bit_t decodeFrame (void) {
         LMIC.txrxFlags |= TXRX_PORT;
         LMIC.dataBeg = poff;
         LMIC.dataLen = pend-poff;
+        if( !replayConf && port > 0 )
+            pushDnData(seqno);
     }
     return 1;
 }
@@ -1411,6 +1920,11 @@ static bit_t processJoinAccept (void) {
                                       : EV::joininfo_t::ACCEPT)));
     
     ASSERT((LMIC.opmode & (OP_JOINING|OP_REJOIN))!=0);
+    if( (LMIC.opmode & OP_JOINING) != 0 ) {
+        LMIC.joinStat.latency = os_getTime() - LMIC.joinStat.start;
+        LMIC.joinStat.hinted  = LMIC.joinHintLeft != 0;
+        LMIC_setJoinHint(LMIC.txChnl, LMIC.datarate);
+    }
     if( (LMIC.opmode & OP_REJOIN) != 0 ) {
         // Lower DR every try below current UP DR
         LMIC.datarate = lowerDR(LMIC.datarate, LMIC.rejoinCnt);
@@ -1479,9 +1993,49 @@ static void setupRx2DnData (xref2osjob_t osjob) {
 }
 
 
+// Class C needs a session and a LoRa RX2 data rate
+static bit_t classCUsable (void) {
+    if( (LMIC.opmode & (OP_CLASSC|OP_TRACK|OP_JOINING)) != OP_CLASSC || LMIC.devaddr == 0 )
+        return 0;
+#if defined(CFG_eu868)
+    if( LMIC.dn2Dr == DR_FSK )
+        return 0;
+#endif
+    return 1;
+}
+
+static void processRx2ClassC (xref2osjob_t osjob) {
+    // If we arrive via job timer make sure to put radio to rest.
+    os_radio(RADIO_RST);
+    os_clearCallback(&LMIC.osjob);
+    processDnData();
+}
+
+// Class C: listen on RX2 right after RX1 until a frame starting in the RX2
+// window would have been received completely
+static u1_t maxDnLen (dr_t dr) {
+    return maxFrameLen(dr) < MAX_LEN_FRAME ? maxFrameLen(dr) : MAX_LEN_FRAME;
+}
+
+static void setupRx2ClassC (void) {
+    LMIC.txrxFlags = TXRX_DNW2;
+    LMIC.rps = dndr2rps(LMIC.dn2Dr);
+    LMIC.freq = LMIC.dn2Freq;
+    LMIC.dataLen = 0;
+    os_setTimedCallback(&LMIC.osjob,
+                        LMIC.txend + DELAY_DNW2_osticks + calcAirTime(LMIC.rps, maxDnLen(LMIC.dn2Dr)),
+                        FUNC_ADDR(processRx2ClassC));
+    os_radio(RADIO_RXON);
+}
+
+
 static void processRx1DnData (xref2osjob_t osjob) {
-    if( LMIC.dataLen == 0 || !processDnData() )
-        schedRx2(DELAY_DNW2_osticks, FUNC_ADDR(setupRx2DnData));
+    if( LMIC.dataLen == 0 || !processDnData() ) {
+        if( classCUsable() )
+            setupRx2ClassC();
+        else
+            schedRx2(DELAY_DNW2_osticks, FUNC_ADDR(setupRx2DnData));
+    }
 }
 
 
@@ -1497,72 +2051,58 @@ static void updataDone (xref2osjob_t osjob) {
 // ======================================== 
 
 
+// Length of the MAC options buildDataFrame() is going to piggyback
+static u1_t pendingOptsLen (void) {
+    return packMacOpts(NULL, 0);
+}
+
+
+// Max FRMPayload length at current DR next to olen bytes of MAC options
+static u1_t maxTxPayload (dr_t dr, u1_t olen) {
+    int flen = maxFrameLen(dr);
+    if( flen > MAX_LEN_FRAME )
+        flen = MAX_LEN_FRAME;
+    if( getSf(updr2rps(dr)) == FSK && flen > MAX_FSK_FRAME )
+        flen = MAX_FSK_FRAME;
+    flen -= OFF_DAT_OPTS + olen + /*port*/1 + /*MIC*/4;
+    return flen < 0 ? 0 : flen;
+}
+
+
 static void buildDataFrame (void) {
     bit_t txdata = ((LMIC.opmode & (OP_TXDATA|OP_POLL)) != OP_POLL);
     u1_t dlen = txdata ? LMIC.pendTxLen : 0;
+    LMIC.pendTxHeld = TXHELD_NONE;
+
+    if( txdata && LMIC.pendTxBeg != 0 ) {
+        // Payload was staged in place - slide it if MAC options changed size meanwhile
+        u1_t beg = OFF_DAT_OPTS + pendingOptsLen() + 1;
+        if( beg != LMIC.pendTxBeg ) {
+            if( beg+dlen+4 > MAX_LEN_FRAME ) {
+                txdata = 0;
+                LMIC.pendTxHeld = TXHELD_TOOLARGE;
+            } else
+                memmove(LMIC.frame+beg, LMIC.frame+LMIC.pendTxBeg, dlen);
+            LMIC.pendTxBeg = beg;
+        }
+    }
 
     // Piggyback MAC options
-    // Prioritize by importance
-    int  end = OFF_DAT_OPTS;
-    if( (LMIC.opmode & (OP_TRACK|OP_PINGABLE)) == (OP_TRACK|OP_PINGABLE) ) {
-        // Indicate pingability in every UP frame
-        LMIC.frame[end] = MCMD_PING_IND;
-        LMIC.frame[end+1] = LMIC.ping.dr | (LMIC.ping.intvExp<<4);
-        end += 2;
-    }
-    if( LMIC.dutyCapAns ) {
-        LMIC.frame[end] = MCMD_DCAP_ANS;
-        end += 1;
-        LMIC.dutyCapAns = 0;
-    }
-    if( LMIC.dn2Ans ) {
-        LMIC.frame[end+0] = MCMD_DN2P_ANS;
-        LMIC.frame[end+1] = LMIC.dn2Ans & ~MCMD_DN2P_ANS_RFU;
-        end += 2;
-        LMIC.dn2Ans = 0;
-    }
-    if( LMIC.devsAns ) {  // answer to device status
-        LMIC.frame[end+0] = MCMD_DEVS_ANS;
-        LMIC.frame[end+1] = LMIC.margin;
-        LMIC.frame[end+2] = os_getBattLevel();
-        end += 3;
-        LMIC.devsAns = 0;
-    }
-    if( LMIC.ladrAns ) {  // answer to ADR change
-        LMIC.frame[end+0] = MCMD_LADR_ANS;
-        LMIC.frame[end+1] = LMIC.ladrAns & ~MCMD_LADR_ANS_RFU;
-        end += 2;
-        LMIC.ladrAns = 0;
-    }
-    if( LMIC.bcninfoTries > 0 ) {
-        LMIC.frame[end] = MCMD_BCNI_REQ;
-        end += 1;
-    }
+    int  end = OFF_DAT_OPTS + packMacOpts(LMIC.frame+OFF_DAT_OPTS, 1);
     if( LMIC.adrChanged ) {
         if( LMIC.adrAckReq < 0 )
             LMIC.adrAckReq = 0;
         LMIC.adrChanged = 0;
     }
-    if( LMIC.pingSetAns != 0 ) {
-        LMIC.frame[end+0] = MCMD_PING_ANS;
-        LMIC.frame[end+1] = LMIC.pingSetAns & ~MCMD_PING_ANS_RFU;
-        end += 2;
-        LMIC.pingSetAns = 0;
-    }
-    if( LMIC.snchAns ) {
-        LMIC.frame[end+0] = MCMD_SNCH_ANS;
-        LMIC.frame[end+1] = LMIC.snchAns & ~MCMD_SNCH_ANS_RFU;
-        end += 2;
-        LMIC.snchAns = 0;
-    }
-    ASSERT(end <= OFF_DAT_OPTS+16);
 
-    u1_t flen = end + (txdata ? 5+dlen : 4);
-    if( flen > MAX_LEN_FRAME ) {
-        // Options and payload too big - delay payload
+    if( txdata && dlen > maxTxPayload((dr_t)LMIC.datarate, end-OFF_DAT_OPTS) ) {
+        // Options and payload too big for this DR - delay payload if it fits alone,
+        // the frame overwrites one staged in place
         txdata = 0;
-        flen = end+4;
+        LMIC.pendTxHeld = dlen <= maxTxPayload((dr_t)LMIC.datarate, 0) && LMIC.pendTxBeg == 0
+            ? TXHELD_OPTS : TXHELD_TOOLARGE;
     }
+    u1_t flen = end + (txdata ? 5+dlen : 4);
     LMIC.frame[OFF_DAT_HDR] = HDR_FTYPE_DAUP | HDR_MAJOR_V1;
     LMIC.frame[OFF_DAT_FCT] = (LMIC.dnConf | LMIC.adrEnabled
                               | (LMIC.adrAckReq >= 0 ? FCT_ADRARQ : 0)
@@ -1592,7 +2132,9 @@ static void buildDataFrame (void) {
             if( LMIC.txCnt == 0 ) LMIC.txCnt = 1;
         }
         LMIC.frame[end] = LMIC.pendTxPort;
-        os_copyMem(LMIC.frame+end+1, LMIC.pendTxData, dlen);
+        if( LMIC.pendTxBeg == 0 )
+            os_copyMem(LMIC.frame+end+1, LMIC.pendTxData, dlen);
+        ASSERT(LMIC.pendTxBeg == 0 || LMIC.pendTxBeg == end+1);
         if (LMIC.pendTxPort != 223) {  // port 223 unencrypted for testing (TT)
           aes_cipher(LMIC.pendTxPort==0 ? LMIC.nwkKey : LMIC.artKey,
                      LMIC.devaddr, LMIC.seqnoUp-1,
@@ -1600,6 +2142,8 @@ static void buildDataFrame (void) {
         }
 
     }
+    // In place payload is consumed (encrypted) now
+    LMIC.pendTxBeg = 0;
     aes_appendMic(LMIC.nwkKey, LMIC.devaddr, LMIC.seqnoUp-1, /*up*/0, LMIC.frame, flen-4);
 
     EV(dfinfo, DEBUG, (e_.deveui  = MAIN::CDEV->getEui(),
@@ -1726,6 +2270,8 @@ bit_t LMIC_startJoining (void) {
         LMIC.opmode &= ~(OP_SCAN|OP_REJOIN|OP_LINKDEAD|OP_NEXTCHNL);
         // Setup state
         LMIC.rejoinCnt = LMIC.txCnt = LMIC.pendTxConf = 0;
+        os_clearMem(&LMIC.joinStat, sizeof(LMIC.joinStat));
+        LMIC.joinStat.start = os_getTime();
         initJoinLoop();
         LMIC.opmode |= OP_JOINING;
         // reportEvent will call engineUpdate which then starts sending JOIN REQUESTS
@@ -1735,6 +2281,18 @@ bit_t LMIC_startJoining (void) {
     return 0; // already joined
 }
 
+// Channel and DR for the first JoinRequests of the next join - remembered
+// after each successful join, set it after LMIC_reset() to keep it over a restart.
+void LMIC_setJoinHint (u1_t chnl, dr_t dr) {
+#if defined(CFG_eu868)
+    LMIC.joinHintOn = chnl < NUM_JOIN_CHANNELS && dr <= DR_SF7;
+#elif defined(CFG_us915)
+    LMIC.joinHintOn = chnl < 64 ? dr <= DR_SF7 : chnl < 72 && dr == DR_SF8C;
+#endif
+    LMIC.joinHintChnl = chnl;
+    LMIC.joinHintDr   = dr;
+}
+
 
 // ================================================================================
 //
@@ -1755,11 +2313,134 @@ static void processPingRx (xref2osjob_t osjob) {
 }
 
 
+// Callback from HAL during class C RX or when the timer for the next MAC step expires.
+static void processRxClassC (xref2osjob_t osjob) {
+    os_radio(RADIO_RST);
+    os_clearCallback(&LMIC.osjob);
+    LMIC.rxcOn = 0;
+    if( LMIC.dataLen != 0 ) {
+        LMIC.txrxFlags = TXRX_CLASSC;
+        if( decodeFrame() ) {
+            reportEvent(EV_RXCOMPLETE);
+            return;
+        }
+    }
+    engineUpdate();
+}
+
+// Class C: receive on RX2 while the MAC has nothing else to do. The radio
+// and the timer for the next MAC step at `next` (0=none) share LMIC.osjob.
+static bit_t startRxClassC (ostime_t next) {
+    if( !classCUsable() )
+        return 0;
+    LMIC.rps = dndr2rps(LMIC.dn2Dr);
+    LMIC.freq = LMIC.dn2Freq;
+    LMIC.dataLen = 0;
+    if( next != 0 ) {
+        os_setTimedCallback(&LMIC.osjob, next, FUNC_ADDR(processRxClassC));
+    } else {
+        os_clearCallback(&LMIC.osjob);
+        LMIC.osjob.func = FUNC_ADDR(processRxClassC);
+    }
+    LMIC.rxcOn = 1;
+    os_radio(RADIO_RXON);
+    return 1;
+}
+
+
+// ================================================================================
+// Uplink queue
+
+
+static u1_t txqCount (void) {
+    u1_t n = 0;
+    for( u1_t i=0; i<MAX_TXQ; i++ )
+        n += LMIC.txq[i].used;
+    return n;
+}
+
+
+// Earliest deadline first - no deadline sorts last, then higher priority, then FIFO
+static bit_t txqBefore (const txmsg_t* a, const txmsg_t* b) {
+    if( (a->deadline != 0) != (b->deadline != 0) )
+        return a->deadline != 0;
+    if( a->deadline != b->deadline )
+        return a->deadline - b->deadline < 0;
+    if( a->prio != b->prio )
+        return a->prio > b->prio;
+    return (s2_t)(a->seq - b->seq) < 0;
+}
+
+
+static void txqDone (u1_t slot, u1_t status) {
+    txmsg_t* m = &LMIC.txq[slot];
+    m->used = 0;
+    if( LMIC.txqCur == slot+1 )
+        LMIC.txqCur = 0;
+    if( m->cb != NULL ) {
+        LMIC.txqInCb = 1;
+        m->cb(m->ctx, status);
+        LMIC.txqInCb = 0;
+    }
+}
+
+
+// Expire queued frames which would not start by their deadline if sent at txbeg.
+// Returns number of frames left.
+static u1_t txqExpire (ostime_t txbeg) {
+    for( u1_t i=0; i<MAX_TXQ; i++ ) {
+        txmsg_t* m = &LMIC.txq[i];
+        if( m->used && m->deadline != 0 && LMIC.txqCur != i+1 && m->deadline - txbeg < 0 )
+            txqDone(i, TXQ_EXPIRED);
+    }
+    return txqCount();
+}
+
+
+// Move the most urgent queued frame into pendTxData
+static void txqLoad (void) {
+    u1_t best = MAX_TXQ;
+    for( u1_t i=0; i<MAX_TXQ; i++ ) {
+        if( LMIC.txq[i].used && (best == MAX_TXQ || txqBefore(&LMIC.txq[i], &LMIC.txq[best])) )
+            best = i;
+    }
+    ASSERT(best < MAX_TXQ);
+    txmsg_t* m = &LMIC.txq[best];
+    os_copyMem(LMIC.pendTxData, m->data, m->len);
+    LMIC.pendTxPort = m->port;
+    LMIC.pendTxConf = m->conf;
+    LMIC.pendTxLen  = m->len;
+    LMIC.pendTxBeg  = 0;
+    LMIC.txqCur     = best+1;
+    LMIC.txCnt      = 0;
+}
+
+
+// TX/RX transaction finished - report the queued frame and arm the next one
+static void txqComplete (void) {
+    LMIC.txqArmed = 0;
+    if( LMIC.txqCur != 0 ) {
+        if( LMIC.pendTxHeld == TXHELD_OPTS )
+            LMIC.txqCur = 0;    // still queued, reloaded for the next frame
+        else
+            txqDone(LMIC.txqCur-1,
+                    LMIC.pendTxHeld == TXHELD_TOOLARGE ? TXQ_TOOLARGE :
+                    (LMIC.txrxFlags & TXRX_ACK)  ? TXQ_ACK :
+                    (LMIC.txrxFlags & TXRX_NACK) ? TXQ_NACK : TXQ_SENT);
+    }
+    if( (LMIC.opmode & OP_TXDATA) == 0 && txqCount() != 0 ) {
+        LMIC.opmode |= OP_TXDATA;
+        LMIC.txqArmed = 1;
+    }
+}
+
+
 static bit_t processDnData (void) {
     ASSERT((LMIC.opmode & OP_TXRXPEND)!=0);
 
     if( LMIC.dataLen == 0 ) {
       norx:
+        chnlUpdate(0);
         if( LMIC.txCnt != 0 ) {
             if( LMIC.txCnt < TXCONF_ATTEMPTS ) {
                 LMIC.txCnt += 1;
@@ -1780,6 +2461,11 @@ static bit_t processDnData (void) {
         LMIC.dataBeg = LMIC.dataLen = 0;
       txcomplete:
         LMIC.opmode &= ~(OP_TXDATA|OP_TXRXPEND);
+        // Payload crowded out by MAC options goes with the next frame
+        if( LMIC.pendTxHeld == TXHELD_OPTS && LMIC.txqCur == 0 )
+            LMIC.opmode |= OP_TXDATA;
+        lnkUpdate();
+        txqComplete();
         if( (LMIC.txrxFlags & (TXRX_DNW1|TXRX_DNW2|TXRX_PING)) != 0  &&  (LMIC.opmode & OP_LINKDEAD) != 0 ) {
             LMIC.opmode &= ~OP_LINKDEAD;
             reportEvent(EV_LINK_ALIVE);
@@ -1815,6 +2501,7 @@ static bit_t processDnData (void) {
             return 0;
         goto norx;
     }
+    chnlUpdate(1);
     goto txcomplete;
 }
 
@@ -1892,12 +2579,112 @@ static void startRxPing (xref2osjob_t osjob) {
 }
 
 
+// Send the frame in LMIC.frame, it is due at txbeg
+static void startTx (ostime_t txbeg) {
+    if( (LMIC.opmode & OP_JOINING) != 0 ) {
+        LMIC.joinStat.attempts += 1;
+        LMIC.joinStat.airtime  += calcAirTime(LMIC.rps, LMIC.dataLen);
+    }
+    LMIC.opmode = (LMIC.opmode & ~(OP_POLL|OP_RNDTX)) | OP_TXRXPEND | OP_NEXTCHNL;
+    updateTx(txbeg);
+    os_radio(RADIO_TX);
+}
+
+// ================================================================================
+// Listen before talk - see LMIC_setLbt()
+
+// CAD is LoRa only - FSK frames go out unchecked
+static bit_t lbtUsable (void) {
+    return LMIC.lbtOn && getSf(LMIC.rps) != FSK;
+}
+
+// Duration of a CAD: about two symbols
+static ostime_t cadTime (rps_t rps) {
+    return 2 * us2osticks((1024 << (getSf(rps) - SF7)) >> getBw(rps));
+}
+
+static void processCad (xref2osjob_t osjob);
+
+static void startCad (void) {
+    LMIC.freq = txFreq();
+    LMIC.osjob.func = FUNC_ADDR(processCad);
+    os_radio(RADIO_CAD);
+}
+
+static void retryCad (xref2osjob_t osjob) {
+    startCad();
+}
+
+// Move the held frame to another channel free right now - the channel
+// rotation only advances if it does
+static bit_t lbtHop (ostime_t now) {
+    u1_t chnl = LMIC.txChnl;
+#if defined(CFG_eu868)
+    u1_t last[MAX_BANDS];
+    for( u1_t bi=0; bi<MAX_BANDS; bi++ )
+        last[bi] = LMIC.bands[bi].lastchnl;
+#elif defined(CFG_us915)
+    u1_t rnd = LMIC.chRnd;
+#endif
+    if( nextTx(now) - now <= 0 && LMIC.txChnl != chnl )
+        return 1;
+    LMIC.txChnl = chnl;
+#if defined(CFG_eu868)
+    for( u1_t bi=0; bi<MAX_BANDS; bi++ )
+        LMIC.bands[bi].lastchnl = last[bi];
+#elif defined(CFG_us915)
+    LMIC.chRnd = rnd;
+#endif
+    return 0;
+}
+
+static void processCad (xref2osjob_t osjob) {
+    // Only a frame held for its CAD is gated, any other CAD leaves the MAC alone
+    if( LMIC.lbtLeft == 0 || (LMIC.opmode & OP_TXRXPEND) == 0 )
+        return;
+    ostime_t now = os_getTime();
+    if( LMIC.cadBusy ) {
+        LMIC.lbtStat.busy += 1;
+        if( --LMIC.lbtLeft != 0 ) {
+            // Hop if another channel can take the frame right away...
+            if( lbtHop(now) ) {
+                LMIC.lbtStat.hops += 1;
+                startCad();
+                return;
+            }
+            // ...else back off on this one for up to one frame time
+            ostime_t retry = now + cadTime(LMIC.rps) + (calcAirTime(LMIC.rps, LMIC.dataLen) * os_getRndU1() >> 8);
+            if( (LMIC.opmode & OP_TRACK) == 0 || retry + TXRX_GUARD_osticks - LMIC.bcnRxtime < 0 ) {
+                LMIC.lbtStat.backoffs += 1;
+                os_setTimedCallback(&LMIC.osjob, retry, FUNC_ADDR(retryCad));
+                return;
+            }
+            // no time left before the beacon
+        }
+        LMIC.lbtStat.forced += 1;
+    } else {
+        LMIC.lbtStat.clear += 1;
+    }
+    LMIC.lbtStat.delay += now - LMIC.lbtStart;
+    LMIC.lbtLeft = 0;
+    LMIC.osjob.func = (LMIC.opmode & (OP_JOINING|OP_REJOIN)) != 0 ? FUNC_ADDR(jreqDone) : FUNC_ADDR(updataDone);
+    startTx(now);
+}
+
+
+
 // Decide what to do next for the MAC layer of a device
 static void engineUpdate (void) {
     // Check for ongoing state: scan or TX/RX transaction
     if( (LMIC.opmode & (OP_SCAN|OP_TXRXPEND|OP_SHUTDOWN)) != 0 ) 
         return;
 
+    if( LMIC.rxcOn ) {
+        // Stop class C RX - restarted below if there is nothing else to do
+        os_radio(RADIO_RST);
+        LMIC.rxcOn = 0;
+    }
+
     if( LMIC.devaddr == 0 && (LMIC.opmode & OP_JOINING) == 0 ) {
         LMIC_startJoining();
         return;
@@ -1927,6 +2714,19 @@ static void engineUpdate (void) {
         // Delayed TX or waiting for duty cycle?
         if( (LMIC.globalDutyRate != 0 || (LMIC.opmode & OP_RNDTX) != 0)  &&  (txbeg - LMIC.globalDutyAvail) < 0 )
             txbeg = LMIC.globalDutyAvail;
+        if( !jacc && LMIC.txqArmed && txqExpire(txbeg) == 0 ) {
+            // Every queued frame would miss its deadline - nothing left to send
+            LMIC.opmode &= ~OP_TXDATA;
+            LMIC.txqArmed = 0;
+            if( (LMIC.opmode & OP_POLL) == 0 ) {
+                txbeg = 0;
+                if( (LMIC.opmode & OP_TRACK) == 0 ) {
+                    startRxClassC(0);
+                    return;
+                }
+                goto checkrx;
+            }
+        }
         // If we're tracking a beacon...
         // then make sure TX-RX transaction is complete before beacon
         if( (LMIC.opmode & OP_TRACK) != 0 &&
@@ -1974,14 +2774,22 @@ static void engineUpdate (void) {
                     // App code might do some stuff after send unaware of RESET.
                     goto reset;
                 }
+                if( LMIC.txqArmed && LMIC.txqCur == 0 )
+                    txqLoad();  // pick EDF frame now that we know it goes out
                 buildDataFrame();
                 LMIC.osjob.func = FUNC_ADDR(updataDone);
             }
             LMIC.rps    = setCr(updr2rps(txdr), (cr_t)LMIC.errcr);
             LMIC.dndr   = txdr;  // carry TX datarate (can be != LMIC.datarate) over to txDone/setupRx1
-            LMIC.opmode = (LMIC.opmode & ~(OP_POLL|OP_RNDTX)) | OP_TXRXPEND | OP_NEXTCHNL;
-            updateTx(txbeg);
-            os_radio(RADIO_TX);
+            if( lbtUsable() ) {
+                // Frame is built - hold the MAC until the channel is found free
+                LMIC.opmode  |= OP_TXRXPEND;
+                LMIC.lbtLeft  = LBT_TRIES;
+                LMIC.lbtStart = txbeg;
+                startCad();
+                return;
+            }
+            startTx(txbeg);
             return;
         }
         // Cannot yet TX
@@ -1992,8 +2800,10 @@ static void engineUpdate (void) {
             txbeg += 1;  // TX delayed by one tick (insignificant amount of time)
     } else {
         // No TX pending - no scheduled RX
-        if( (LMIC.opmode & OP_TRACK) == 0 )
+        if( (LMIC.opmode & OP_TRACK) == 0 ) {
+            startRxClassC(0);
             return;
+        }
     }
 
     // Are we pingable?
@@ -2034,7 +2844,8 @@ static void engineUpdate (void) {
                        e_.eui    = MAIN::CDEV->getEui(),
                        e_.info   = osticks2ms(txbeg-now),
                        e_.info2  = LMIC.seqnoUp-1));
-    os_setTimedCallback(&LMIC.osjob, txbeg-TX_RAMPUP, FUNC_ADDR(runEngineUpdate));
+    if( !startRxClassC(txbeg-TX_RAMPUP) )
+        os_setTimedCallback(&LMIC.osjob, txbeg-TX_RAMPUP, FUNC_ADDR(runEngineUpdate));
 }
 
 
@@ -2043,14 +2854,54 @@ void LMIC_setAdrMode (bit_t enabled) {
 }
 
 
+// Let the device pick DR and TX power itself instead of network ADR (which is
+// turned off). target is the share of confirmed uplinks that must be acked,
+// 0..255 (e.g. 230 = 90%), 0 stops the controller. The DR/power set with
+// LMIC_setDrTxpow() is the starting point and the power ceiling.
+void LMIC_setLinkCtl (u1_t target) {
+    LMIC.lnkTarget  = target;
+    LMIC.lnkMargin  = LNK_NOMARGIN;
+    LMIC.lnkAckCnt  = 0;
+    LMIC.lnkSilent  = LINK_CHECK_INIT;
+    LMIC.lnkHold    = 0;
+    LMIC.lnkPowMax  = LMIC.adrTxPow;
+    if( target != 0 )
+        LMIC.adrEnabled = 0;
+}
+
+// Ask the network for a LinkCheckAns with the next uplink (see LMIC.lchkMargin)
+void LMIC_requestLinkCheck (void) {
+    LMIC.lchkReq = 1;
+}
+
+
 //  Should we have/need an ext. API like this?
 void LMIC_setDrTxpow (dr_t dr, s1_t txpow) {
     setDrTxpow(DRCHG_SET, dr, txpow);
 }
 
 
+// Class C: keep receiving on the RX2 frequency/DR whenever no TX-RX
+// transaction or join is going on. Ignored while tracking beacons.
+void LMIC_setClassC (bit_t enabled) {
+    if( enabled )
+        LMIC.opmode |= OP_CLASSC;
+    else
+        LMIC.opmode &= ~OP_CLASSC;
+    engineUpdate();
+}
+
+
+void LMIC_setLbt (bit_t enabled) {
+    LMIC.lbtOn = enabled;
+}
+
+
 void LMIC_shutdown (void) {
     os_clearCallback(&LMIC.osjob);
+#if defined(CFG_eu868)
+    os_clearCallback(&LMIC.sweepJob);
+#endif
     os_radio(RADIO_RST);
     LMIC.opmode |= OP_SHUTDOWN;
 }
@@ -2062,6 +2913,9 @@ void LMIC_reset (void) {
                        e_.info   = EV_RESET));
     os_radio(RADIO_RST);
     os_clearCallback(&LMIC.osjob);
+#if defined(CFG_eu868)
+    os_clearCallback(&LMIC.sweepJob);
+#endif
 
     os_clearMem((xref2u1_t)&LMIC,SIZEOFEXPR(LMIC));
     LMIC.devaddr      =  0;
@@ -2076,6 +2930,9 @@ void LMIC_reset (void) {
     LMIC.ping.intvExp =  0xFF;
 #if defined(CFG_us915)
     initDefaultChannels();
+#endif
+#if defined(CFG_eu868)
+    LMIC.airlogStart  =  os_getTime();
 #endif
     DO_DEVDB(LMIC.devaddr,      devaddr);
     DO_DEVDB(LMIC.devNonce,     devNonce);
@@ -2094,7 +2951,16 @@ void LMIC_init (void) {
 
 void LMIC_clrTxData (void) {
     LMIC.opmode &= ~(OP_TXDATA|OP_TXRXPEND|OP_POLL);
-    LMIC.pendTxLen = 0;
+    LMIC.pendTxLen = LMIC.pendTxBeg = 0;
+    // Cancel queued frames - callbacks may queue new ones which are kept
+    u1_t cancel = 0;
+    for( u1_t i=0; i<MAX_TXQ; i++ )
+        cancel |= LMIC.txq[i].used << i;
+    LMIC.txqArmed = 0;
+    for( u1_t i=0; i<MAX_TXQ; i++ ) {
+        if( cancel & (1<<i) )
+            txqDone(i, TXQ_CANCELED);
+    }
     if( (LMIC.opmode & (OP_JOINING|OP_SCAN)) != 0 ) // do not interfere with JOINING
         return;
     os_clearCallback(&LMIC.osjob);
@@ -2104,6 +2970,10 @@ void LMIC_clrTxData (void) {
 
 
 void LMIC_setTxData (void) {
+    // Application data takes over pendTxData - queue waits until this frame is done
+    if( LMIC.txqCur != 0 )
+        txqDone(LMIC.txqCur-1, TXQ_CANCELED);
+    LMIC.txqArmed = 0;
     LMIC.opmode |= OP_TXDATA;
     if( (LMIC.opmode & OP_JOINING) == 0 )
         LMIC.txCnt = 0;             // cancel any ongoing TX/RX retries
@@ -2120,11 +2990,169 @@ int LMIC_setTxData2 (u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed) {
     LMIC.pendTxConf = confirmed;
     LMIC.pendTxPort = port;
     LMIC.pendTxLen  = dlen;
+    LMIC.pendTxBeg  = 0;
     LMIC_setTxData();
     return 0;
 }
 
 
+//! \brief Hand out the FRMPayload region of the next data frame for writing.
+//! The payload is written once by the application and encrypted in place by
+//! buildDataFrame(). LMIC.frame is also the RX/join buffer, so if the MAC might
+//! receive or send a join request before the frame goes out - class C and ping
+//! slot receivers may get a frame any time - or a confirmed frame might have to
+//! be retransmitted, the span points into pendTxData instead.
+//! \param maxlen receives the payload capacity given the pending MAC options and DR.
+//! \return writable span, complete with LMIC_commitTxData().
+xref2u1_t LMIC_beginTxData (u1_t port, u1_t confirmed, u1_t* maxlen) {
+    u1_t olen = pendingOptsLen();
+    u1_t max  = maxTxPayload((dr_t)LMIC.datarate, olen);
+    LMIC.pendTxConf = confirmed;
+    LMIC.pendTxPort = port;
+    LMIC.pendTxLen  = 0;
+    if( confirmed || LMIC.devaddr == 0 ||
+        (LMIC.opmode & (OP_TXRXPEND|OP_JOINING|OP_REJOIN|OP_SCAN|OP_TRACK|OP_CLASSC|OP_PINGINI)) != 0 ) {
+        LMIC.pendTxBeg = 0;
+        if( max > SIZEOFEXPR(LMIC.pendTxData) )
+            max = SIZEOFEXPR(LMIC.pendTxData);
+        *maxlen = max;
+        return LMIC.pendTxData;
+    }
+    LMIC.pendTxBeg = OFF_DAT_OPTS + olen + 1;
+    *maxlen = max;
+    return LMIC.frame + LMIC.pendTxBeg;
+}
+
+
+int LMIC_commitTxData (u1_t dlen) {
+    if( LMIC.pendTxBeg != 0 ? LMIC.pendTxBeg+dlen+4 > MAX_LEN_FRAME
+                            : dlen > SIZEOFEXPR(LMIC.pendTxData) )
+        return -2;
+    LMIC.pendTxLen = dlen;
+    LMIC_setTxData();
+    return 0;
+}
+
+
+//! \brief Queue an uplink frame.
+//! Queued frames are sent one per TX/RX transaction, earliest deadline first, when
+//! the duty cycle allows. Frames which cannot start before their deadline are dropped.
+//! \param prio breaks ties between equal deadlines, higher goes first.
+//! \param deadline latest TX start time, 0 for none.
+//! \param cb called once with a TXQ_* status when the frame is done (may be NULL).
+//! \return slot number or -1 if the queue is full, -2 if dlen is too big for
+//! the current data rate. A frame that no longer fits at TX time completes with TXQ_TOOLARGE.
+s1_t LMIC_queueTx (u1_t port, xref2cu1_t data, u1_t dlen, u1_t confirmed,
+                   u1_t prio, ostime_t deadline, txdonecb_t* cb, void* ctx) {
+    if( dlen > MAX_LEN_PAYLOAD || dlen > maxTxPayload((dr_t)LMIC.datarate, 0) )
+        return -2;
+    u1_t slot = 0;
+    while( LMIC.txq[slot].used )
+        if( ++slot == MAX_TXQ )
+            return -1;
+    txmsg_t* m = &LMIC.txq[slot];
+    os_copyMem(m->data, data, dlen);
+    m->deadline = deadline;
+    m->cb       = cb;
+    m->ctx      = ctx;
+    m->seq      = LMIC.txqSeq++;
+    m->port     = port;
+    m->conf     = confirmed;
+    m->prio     = prio;
+    m->len      = dlen;
+    m->used     = 1;
+    if( (LMIC.opmode & OP_TXDATA) == 0 ) {
+        LMIC.opmode |= OP_TXDATA;
+        LMIC.txqArmed = 1;
+        if( !LMIC.txqInCb )
+            engineUpdate();
+    }
+    return slot;
+}
+
+
+u1_t LMIC_txQueueLen (void) {
+    return txqCount();
+}
+
+
+//! \brief Airtime and duty cycle headroom for a prospective uplink.
+//! Read-only - nothing is scheduled or reserved.
+//! \param dlen application payload size, pending MAC options are added.
+void LMIC_queryTxBudget (u1_t dlen, dr_t dr, txbudget_t* budget) {
+    ostime_t now  = os_getTime();
+    u1_t     olen = pendingOptsLen();
+    int      flen = OFF_DAT_OPTS + olen + /*port*/1 + dlen + /*MIC*/4;
+    budget->airtime = calcAirTime(updr2rps(dr), flen < MAX_LEN_FRAME ? flen : MAX_LEN_FRAME);
+    budget->maxlen  = maxTxPayload(dr, olen);
+    budget->earliest = now;
+    if( LMIC.globalDutyRate != 0 && LMIC.globalDutyAvail - now > 0 )
+        budget->earliest = LMIC.globalDutyAvail;
+#if defined(CFG_eu868)
+    u1_t usable = 0;
+    for( u1_t chnl=0; chnl<MAX_CHANNELS; chnl++ ) {
+        if( (LMIC.channelMap & (1<<chnl)) != 0  &&
+            (LMIC.channelDrMap[chnl] & (1<<(dr&0xF))) != 0 )
+            usable |= 1 << (LMIC.channelFreq[chnl] & 0x3);
+    }
+    ostime_t earliest = 0;
+    for( u1_t bi=0; bi<MAX_BANDS; bi++ ) {
+        band_t* band = &LMIC.bands[bi];
+        ostime_t avail = band->avail;
+        if( avail - budget->earliest < 0 )
+            avail = budget->earliest;
+        ostime_t left = (band->txcap ? sec2osticks(3600) / band->txcap : sec2osticks(3600))
+            - airlogUsed(bi, now);
+        budget->bandAvail[bi]  = avail;
+        budget->bandBudget[bi] = left > 0 ? left : 0;
+        if( (usable & (1<<bi)) != 0  &&  (earliest == 0 || avail - earliest < 0) )
+            earliest = avail;
+    }
+    budget->bandUsable = usable;
+    if( earliest != 0 )
+        budget->earliest = earliest;
+#endif
+}
+
+
+// Gather payload segments straight into the next frame
+int LMIC_setTxDataV (u1_t port, const txseg_t* segs, u1_t nsegs, u1_t confirmed) {
+    u1_t maxlen, dlen = 0;
+    xref2u1_t payload = LMIC_beginTxData(port, confirmed, &maxlen);
+    for( u1_t i=0; i<nsegs; i++ ) {
+        if( segs[i].len > maxlen-dlen ) {
+            LMIC.pendTxBeg = 0;
+            return -2;
+        }
+        os_copyMem(payload+dlen, segs[i].data, segs[i].len);
+        dlen += segs[i].len;
+    }
+    return LMIC_commitTxData(dlen);
+}
+
+
+//! \brief Stable read-only view of a received downlink.
+//! Entries stay valid - and are not overwritten by later RX - until released.
+//! \param idx 0 for the oldest unreleased downlink.
+const dnmsg_t* LMIC_peekDnData (u1_t idx) {
+    return idx < DNQ.cnt ? &DNQ.msg[(DNQ.head + idx) % MAX_DNQ] : (const dnmsg_t*)0;
+}
+
+
+void LMIC_releaseDnData (const dnmsg_t* msg) {
+    hal_disableIRQs();
+    ASSERT(DNQ.cnt != 0 && msg == &DNQ.msg[DNQ.head]);
+    DNQ.head = (DNQ.head + 1) % MAX_DNQ;
+    DNQ.cnt--;
+    hal_enableIRQs();
+}
+
+
+u2_t LMIC_dnDataDropped (void) {
+    return DNQ.dropped;
+}
+
+
 // Send a payload-less message to signal device is alive
 void LMIC_sendAlive (void) {
     LMIC.opmode |= OP_POLL;
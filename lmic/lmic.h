@@ -25,16 +25,30 @@
 #define LMIC_VERSION_MINOR 5
 #define LMIC_VERSION_BUILD 1431528305
 
-enum { MAX_FRAME_LEN      =  64 };   //!< Library cap on max frame length
+enum { MAX_FRAME_LEN      = MAX_LEN_FRAME };  //!< Library cap on max frame length
+enum { MAX_FSK_FRAME      =  63 };   // FSK frames are loaded into the 64 byte FIFO at once, length byte included
 enum { TXCONF_ATTEMPTS    =   8 };   //!< Transmit attempts for confirmed frames
 enum { MAX_MISSED_BCNS    =  20 };   // threshold for triggering rejoin requests
 enum { MAX_RXSYMS         = 100 };   // stop tracking beacon beyond this
+enum { MAX_DNQ            =   4 };   //!< Downlink frames held until released by the application
+enum { MAX_MACANS         =  16 };   // bytes of MAC answers held for the next uplinks
 
 enum { LINK_CHECK_CONT    =  12 ,    // continue with this after reported dead link
        LINK_CHECK_DEAD    =  24 ,    // after this UP frames and no response from NWK assume link is dead
        LINK_CHECK_INIT    = -12 ,    // UP frame count until we inc datarate
        LINK_CHECK_OFF     =-128 };   // link check disabled
 
+// Device-side link controller (LMIC_setLinkCtl)
+enum { LNK_MARGIN_DB      =  10 ,    // dB of uplink margin to keep
+       LNK_STEP_DB        =   3 ,    // dB gained/spent per DR or TX power step
+       LNK_HOLD           =  16 ,    // uplinks without speeding up after missing the ACK target
+       LNK_MIN_TXPOW      =   2 ,    // dBm
+       LNK_MAX_DR         = DR_SF7 , // fastest DR the controller picks
+       LNK_NOMARGIN       =-128 };   // no fresh margin sample
+
+enum { JOIN_HINT_TRIES    =   2 };   // JoinRequests on the last good channel/DR before the standard sweep
+enum { LBT_TRIES          =   4 };   // CAD passes before an uplink goes out regardless
+
 enum { TIME_RESYNC        = 6*128 }; // secs
 enum { TXRX_GUARD_ms      =  6000 };  // msecs - don't start TX-RX transaction before beacon
 enum { JOIN_GUARD_ms      =  9000 };  // msecs - don't start Join Req/Acc transaction before beacon
@@ -45,6 +59,11 @@ enum { RETRY_PERIOD_secs  =     3 };  // secs - random period for retrying a con
 
 enum { MAX_CHANNELS = 16 };      //!< Max supported channels
 enum { MAX_BANDS    =  4 };
+enum { AIRLOG_SLOTS = 60 };      //!< Minutes of airtime history kept per band
+#define AIRLOG_TICKS sec2osticks(60)  //!< Time covered by one airlog slot
+enum { AIRLOG_WRAP  = AIRLOG_SLOTS*1092 };  //!< Airlog minute numbers count modulo this (fits u2_t)
+enum { NOISE_SWEEPS = 16 };      //!< Noise sweeps kept in LMIC.noiseLog
+enum { NOISE_RX2    = MAX_CHANNELS };  //!< Index of the RX2 frequency in noisesweep_t.dBm
 
 enum { LIMIT_CHANNELS = (1<<4) };   // EU868 will never have more channels
 //! \internal
@@ -56,6 +75,22 @@ struct band_t {
 };
 TYPEDEF_xref2band_t; //!< \internal
 
+//! Link quality seen on a channel, see LMIC_setChnlPolicy().
+struct chnlstat_t {
+    u1_t     ackRate;   //!< Confirmed uplinks acked (moving average, 255=all)
+    u1_t     rx1Rate;   //!< Uplinks answered in RX1 (moving average, 255=all)
+    s1_t     noise;     //!< Noise floor [dBm], 0 if not measured yet
+    u1_t     count;     //!< Uplinks accounted (saturates at 255)
+};
+typedef struct chnlstat_t chnlstat_t;
+
+//! RSSI of one pass over the channels and RX2, see LMIC_setNoiseSweep().
+struct noisesweep_t {
+    ostime_t time;                  //!< Time the sweep completed
+    s1_t     dBm[MAX_CHANNELS+1];   //!< Per channel, then RX2 - 0 = channel not defined
+};
+typedef struct noisesweep_t noisesweep_t;
+
 #elif defined(CFG_us915)  // US915 spectrum =================================================
 
 enum { MAX_XCHANNELS = 2 };      // extra channels in RAM, channels 0-71 are immutable 
@@ -64,7 +99,7 @@ enum { MAX_TXPOW_125kHz = 30 };
 #endif // ==========================================================================
 
 // Keep in sync with evdefs.hpp::drChange
-enum { DRCHG_SET, DRCHG_NOJACC, DRCHG_NOACK, DRCHG_NOADRACK, DRCHG_NWKCMD };
+enum { DRCHG_SET, DRCHG_NOJACC, DRCHG_NOACK, DRCHG_NOADRACK, DRCHG_NWKCMD, DRCHG_LNKCTL };
 enum { KEEP_TXPOW = -128 };
 
 
@@ -101,7 +136,7 @@ struct bcninfo_t {
 };
 
 // purpose of receive window - lmic_t.rxState
-enum { RADIO_RST=0, RADIO_TX=1, RADIO_RX=2, RADIO_RXON=3 };
+enum { RADIO_RST=0, RADIO_TX=1, RADIO_RX=2, RADIO_RXON=3, RADIO_CAD=4 };
 // Netid values /  lmic_t.netid
 enum { NETID_NONE=(int)~0U, NETID_MASK=(int)0xFFFFFF };
 // MAC operation modes (lmic_t.opmode).
@@ -120,6 +155,7 @@ enum { OP_NONE     = 0x0000,
        OP_NEXTCHNL = 0x0800, // find a new channel
        OP_LINKDEAD = 0x1000, // link was reported as dead
        OP_TESTMODE = 0x2000, // developer test mode
+       OP_CLASSC   = 0x4000, // class C - continuous RX on RX2 while idle
 };
 // TX-RX transaction flags - report back to user
 enum { TXRX_ACK    = 0x80,   // confirmed UP frame was acked
@@ -128,7 +164,8 @@ enum { TXRX_ACK    = 0x80,   // confirmed UP frame was acked
        TXRX_PORT   = 0x10,   // set if a frame with a port was RXed, LMIC.frame[LMIC.dataBeg-1] => port
        TXRX_DNW1   = 0x01,   // received in 1st DN slot
        TXRX_DNW2   = 0x02,   // received in 2dn DN slot
-       TXRX_PING   = 0x04 }; // received in a scheduled RX slot
+       TXRX_PING   = 0x04,   // received in a scheduled RX slot
+       TXRX_CLASSC = 0x08 }; // received in class C continuous RX outside a TX-RX transaction
 // Event types for event callback
 enum _ev_t { EV_SCAN_TIMEOUT=1, EV_BEACON_FOUND,
              EV_BEACON_MISSED, EV_BEACON_TRACKED, EV_JOINING,
@@ -137,6 +174,58 @@ enum _ev_t { EV_SCAN_TIMEOUT=1, EV_BEACON_FOUND,
              EV_RXCOMPLETE, EV_LINK_DEAD, EV_LINK_ALIVE };
 typedef enum _ev_t ev_t;
 
+// Why the last frame went out without the pending payload
+enum { TXHELD_NONE,     // it did not
+       TXHELD_OPTS,     // MAC options took the room - the payload goes with the next frame
+       TXHELD_TOOLARGE  // too large for the data rate, or staged in place and lost - dropped
+};
+
+enum { MAX_TXQ = 8 };   // uplink queue slots
+// Uplink queue completion status - passed to txdonecb_t
+enum { TXQ_SENT,        // unconfirmed frame sent
+       TXQ_ACK,         // confirmed frame acked
+       TXQ_NACK,        // confirmed frame not acked after all retries
+       TXQ_EXPIRED,     // deadline passed (or would pass waiting for duty cycle) before it was sent
+       TXQ_CANCELED,    // removed by LMIC_clrTxData or superseded by LMIC_setTxData
+       TXQ_TOOLARGE };  // payload does not fit the data rate in effect at TX time
+typedef void (txdonecb_t)(void* ctx, u1_t status);
+
+//! Queued uplink, see LMIC_queueTx().
+struct txmsg_t {
+    ostime_t    deadline;   // latest TX start, 0 = no deadline
+    txdonecb_t* cb;
+    void*       ctx;
+    u2_t        seq;        // insertion order among equal deadline/prio
+    u1_t        used;
+    u1_t        port;
+    u1_t        conf;
+    u1_t        prio;       // higher first among equal deadlines
+    u1_t        len;
+    u1_t        data[MAX_LEN_PAYLOAD];
+};
+typedef struct txmsg_t txmsg_t;
+
+//! Cost of the join in progress or, after EV_JOINED, of the last join.
+struct joinstat_t {
+    ostime_t    start;      //!< Time the join was started
+    ostime_t    latency;    //!< Time from start to JoinAccept, 0 = not joined yet
+    ostime_t    airtime;    //!< Airtime of all JoinRequests sent
+    u2_t        attempts;   //!< JoinRequests sent
+    u1_t        hinted;     //!< Accepted on the channel/DR of LMIC_setJoinHint()
+};
+typedef struct joinstat_t joinstat_t;
+
+//! Listen-before-talk decisions since LMIC_reset(), see LMIC_setLbt().
+struct lbtstat_t {
+    u4_t        clear;      //!< CAD found the channel free - sent
+    u4_t        busy;       //!< CAD detected activity
+    u4_t        hops;       //!< Busy, retried right away on another channel
+    u4_t        backoffs;   //!< Busy, retried on the same channel after a random delay
+    u4_t        forced;     //!< Still busy after LBT_TRIES passes - sent anyway
+    ostime_t    delay;      //!< Total time uplinks were held back by CAD and backoffs
+};
+typedef struct lbtstat_t lbtstat_t;
+
 
 struct lmic_t {
     // Radio settings TX/RX (also accessed by HAL)
@@ -149,6 +238,7 @@ struct lmic_t {
     u1_t        rxsyms;
     u1_t        dndr;
     s1_t        txpow;     // dBm
+    u1_t        cadBusy;   // result of RADIO_CAD
 
     osjob_t     osjob;
 
@@ -158,6 +248,18 @@ struct lmic_t {
     u4_t        channelFreq[MAX_CHANNELS];
     u2_t        channelDrMap[MAX_CHANNELS];
     u2_t        channelMap;
+    u2_t        airlog[MAX_BANDS][AIRLOG_SLOTS];  // airtime [ms] per band and minute
+    u2_t        airlogMinute[AIRLOG_SLOTS];       // minute number of each airlog slot
+    u2_t        airlogNow;    // minute number counted on from airlogStart
+    ostime_t    airlogStart;  // start of minute airlogNow
+    chnlstat_t  chnlStats[MAX_CHANNELS];
+    u1_t        chnlPolicy;   // CHNL_ROUNDROBIN or CHNL_QUALITY
+    osjob_t     sweepJob;
+    ostime_t    sweepIntv;    // time between noise sweeps, 0=off
+    u1_t        sweepChnl;    // next channel of the sweep in progress
+    u1_t        noiseHead;    // noiseLog slot of the sweep in progress
+    u1_t        noiseCnt;     // completed sweeps in noiseLog
+    noisesweep_t noiseLog[NOISE_SWEEPS];
 #elif defined(CFG_us915)
     u4_t        xchFreq[MAX_XCHANNELS];    // extra channel frequencies (if device is behind a repeater)
     u2_t        xchDrMap[MAX_XCHANNELS];   // extra channel datarate ranges  ---XXX: ditto
@@ -175,6 +277,11 @@ struct lmic_t {
     u1_t        datarate;     // current data rate
     u1_t        errcr;        // error coding rate (used for TX only)
     u1_t        rejoinCnt;    // adjustment for rejoin datarate
+    u1_t        joinHintOn;   // try joinHintChnl/joinHintDr first
+    u1_t        joinHintChnl; // channel of the last successful join (US: its sub-band counts)
+    u1_t        joinHintDr;   // data rate of the last successful join
+    u1_t        joinHintLeft; // hinted JoinRequests left in the current join
+    joinstat_t  joinStat;
     s2_t        drift;        // last measured drift
     s2_t        lastDriftDiff;
     s2_t        maxDriftDiff;
@@ -182,8 +289,17 @@ struct lmic_t {
     u1_t        pendTxPort;
     u1_t        pendTxConf;   // confirmed data
     u1_t        pendTxLen;    // +0x80 = confirmed
+    u1_t        pendTxBeg;    // 0=payload in pendTxData, else staged in place at frame[pendTxBeg]
+    u1_t        pendTxHeld;   // payload left out of the last frame: TXHELD_*
     u1_t        pendTxData[MAX_LEN_PAYLOAD];
 
+    // Uplink queue - loaded into pendTxData when the MAC is ready to send
+    txmsg_t     txq[MAX_TXQ];
+    u2_t        txqSeq;       // insertion counter
+    u1_t        txqCur;       // 1+slot currently in pendTxData, 0=none
+    u1_t        txqArmed;     // OP_TXDATA was raised on behalf of the queue
+    u1_t        txqInCb;      // completion callback running - defer engine updates
+
     u2_t        devNonce;     // last generated nonce
     u1_t        nwkKey[16];   // network session key
     u1_t        artKey[16];   // application router session key
@@ -196,21 +312,34 @@ struct lmic_t {
     u1_t        adrChanged;
 
     u1_t        margin;
-    bit_t       ladrAns;      // link adr adapt answer pending
-    bit_t       devsAns;      // device status answer pending
+    u1_t        lchkReq;      // send LinkCheckReq with next UP frame
+    u1_t        lchkMargin;   // last LinkCheckAns: margin [dB] at the gateway, 255=unknown
+    u1_t        lchkGws;      // last LinkCheckAns: number of gateways
+    u1_t        lnkTarget;    // link controller ACK ratio target (0=off)
+    s1_t        lnkMargin;    // uplink margin [dB] heard in this transaction, LNK_NOMARGIN=none
+    u2_t        lnkAckHist;   // ACK history of the last confirmed uplinks (bit 0 = latest)
+    u1_t        lnkAckCnt;    // valid bits in lnkAckHist
+    s1_t        lnkSilent;    // like adrAckReq - uplinks without a margin sample
+    u1_t        lnkHold;      // uplinks left before the controller may speed up again
+    s1_t        lnkPowMax;    // TX power ceiling of the controller
     u1_t        adrEnabled;
     u1_t        moreData;     // NWK has more data pending
-    bit_t       dutyCapAns;   // have to ACK duty cycle settings
-    u1_t        snchAns;      // answer set new channel
+    u1_t        macAns[MAX_MACANS];  // pending MAC answers (command byte + payload each)
+    u1_t        macAnsLen;
     // 2nd RX window (after up stream)
     u1_t        dn2Dr;
     u4_t        dn2Freq;
-    u1_t        dn2Ans;       // 0=no answer pend, 0x80+ACKs
+    u1_t        rxcOn;        // class C continuous RX running
+
+    // Listen before talk
+    u1_t        lbtOn;        // CAD before each LoRa uplink
+    u1_t        lbtLeft;      // CAD passes left for the frame being sent
+    ostime_t    lbtStart;     // time the frame was due
+    lbtstat_t   lbtStat;
 
     // Class B state
     u1_t        missedBcns;   // unable to track last N beacons
     u1_t        bcninfoTries; // how often to try (scan mode only)
-    u1_t        pingSetAns;   // answer set cmd and ACK bits
     rxsched_t   ping;         // pingable setup
 
     // Public part of MAC state
@@ -225,6 +354,39 @@ struct lmic_t {
     ostime_t    bcnRxtime;
     bcninfo_t   bcninfo;      // Last received beacon info
 };
+//! Payload segment gathered by LMIC_setTxDataV().
+struct txseg_t {
+    xref2cu1_t  data;
+    u1_t        len;
+};
+typedef struct txseg_t txseg_t;
+
+//! Cost of a prospective uplink, see LMIC_queryTxBudget().
+struct txbudget_t {
+    ostime_t airtime;                   //!< Airtime of the frame
+    ostime_t earliest;                  //!< Earliest TX start on any channel supporting the DR
+    u1_t     maxlen;                    //!< Max payload at this DR with the pending MAC options
+#if defined(CFG_eu868)
+    u1_t     bandUsable;                //!< Bands with an enabled channel supporting the DR (bit map)
+    ostime_t bandAvail[MAX_BANDS];      //!< Earliest TX start per band (duty cycle)
+    ostime_t bandBudget[MAX_BANDS];     //!< Airtime left in the sliding hour per band
+#endif
+};
+typedef struct txbudget_t txbudget_t;
+
+//! Received and decrypted downlink, see LMIC_peekDnData().
+struct dnmsg_t {
+    ostime_t rxtime;    //!< Time the frame was received
+    u4_t     seqno;     //!< Downlink frame counter (FCnt)
+    s1_t     rssi;      //!< RSSI as in LMIC.rssi
+    s1_t     snr;       //!< SNR as in LMIC.snr
+    u1_t     txrxFlags; //!< RX window (TXRX_DNW1/TXRX_DNW2/TXRX_PING/TXRX_CLASSC) and ACK flags
+    u1_t     port;
+    u1_t     dataLen;
+    u1_t     data[MAX_LEN_PAYLOAD];
+};
+typedef struct dnmsg_t dnmsg_t;
+
 //! \var struct lmic_t LMIC
 //! The state of LMIC MAC layer is encapsulated in this variable.
 DECLARE_LMIC; //!< \internal
@@ -234,13 +396,24 @@ DECLARE_LMIC; //!< \internal
 #if defined(CFG_eu868)
 enum { BAND_MILLI=0, BAND_CENTI=1, BAND_DECI=2, BAND_AUX=3 };
 bit_t LMIC_setupBand (u1_t bandidx, s1_t txpow, u2_t txcap);
+//! Channel selection within the band picked by duty cycle.
+enum { CHNL_ROUNDROBIN=0,  //!< cycle through the channels (default)
+       CHNL_QUALITY };     //!< random, weighted by LMIC.chnlStats
+void  LMIC_setChnlPolicy (u1_t policy);
+void  LMIC_addChnlNoise  (u1_t channel, s1_t dBm);  // feed a noise floor sample into LMIC.chnlStats
+void  LMIC_setNoiseSweep (ostime_t intv);          // sample RSSI of all channels and RX2 when idle (0=off)
+const noisesweep_t* LMIC_peekNoise (u1_t idx);     // idx-th newest completed sweep or NULL
+int   LMIC_exportNoise   (xref2u1_t buf, int len); // noise log as a compact time series, returns bytes used
 #endif
 bit_t LMIC_setupChannel (u1_t channel, u4_t freq, u2_t drmap, s1_t band);
 void  LMIC_disableChannel (u1_t channel);
 
 void  LMIC_setDrTxpow   (dr_t dr, s1_t txpow);  // set default/start DR/txpow
 void  LMIC_setAdrMode   (bit_t enabled);        // set ADR mode (if mobile turn off)
+void  LMIC_setLinkCtl   (u1_t target);          // device-side DR/power control for ACK ratio target/255 (0=off)
+void  LMIC_requestLinkCheck (void);             // piggyback LinkCheckReq on next uplink
 bit_t LMIC_startJoining (void);
+void  LMIC_setJoinHint  (u1_t chnl, dr_t dr);    // channel/DR to try first when joining
 
 void  LMIC_shutdown     (void);
 void  LMIC_init         (void);
@@ -248,13 +421,27 @@ void  LMIC_reset        (void);
 void  LMIC_clrTxData    (void);
 void  LMIC_setTxData    (void);
 int   LMIC_setTxData2   (u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed);
+int   LMIC_setTxDataV   (u1_t port, const txseg_t* segs, u1_t nsegs, u1_t confirmed);
+xref2u1_t LMIC_beginTxData  (u1_t port, u1_t confirmed, u1_t* maxlen); // writable FRMPayload span of next frame
+int       LMIC_commitTxData (u1_t dlen);                                // send dlen bytes written to that span
 void  LMIC_sendAlive    (void);
 
+s1_t  LMIC_queueTx      (u1_t port, xref2cu1_t data, u1_t dlen, u1_t confirmed,
+                         u1_t prio, ostime_t deadline, txdonecb_t* cb, void* ctx);
+u1_t  LMIC_txQueueLen   (void);                 // queued uplinks incl. the one in flight
+void  LMIC_queryTxBudget (u1_t dlen, dr_t dr, txbudget_t* budget);
+
+const dnmsg_t* LMIC_peekDnData (u1_t idx);            // idx-th oldest unreleased downlink or NULL
+void  LMIC_releaseDnData (const dnmsg_t* msg);       // release oldest downlink (the one at idx 0)
+u2_t  LMIC_dnDataDropped (void);                     // downlinks lost because the ring was full
+
 bit_t LMIC_enableTracking  (u1_t tryBcnInfo);
 void  LMIC_disableTracking (void);
 
 void  LMIC_stopPingable  (void);
 void  LMIC_setPingable   (u1_t intvExp);
+void  LMIC_setClassC     (bit_t enabled);      // continuous RX on RX2 between transactions
+void  LMIC_setLbt        (bit_t enabled);      // CAD before uplinks, back off or hop if the channel is busy
 void  LMIC_tryRejoin     (void);
 
 void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey);
@@ -19,10 +19,15 @@ struct lmic_pinmap {
     u1_t rxtx;
     u1_t rst;
     u1_t dio[NUM_DIO];
+    u1_t spi;   // spidev channel, 0=CE0 1=CE1 - its CE line must not select another radio
 };
 
-// Declared here, to be defined an initialized by the application
+// Declared here, to be defined an initialized by the application (radio 0)
 extern lmic_pinmap pins;
 
+// Register one more radio before os_init(), returns its number or -1 if
+// there are MAX_RADIOS already
+int hal_addRadio (const lmic_pinmap* map);
+
 #endif // _localhal_hal_h_
 
@@ -33,7 +33,7 @@ enum { DR_PAGE_US915 = 0x10 };
 
 // Global maximum frame length
 enum { STD_PREAMBLE_LEN  =  8 };
-enum { MAX_LEN_FRAME     = 64 };
+enum { MAX_LEN_FRAME     = 255 };  // SX127x FIFO, regional limits per DR apply
 enum { LEN_DEVNONCE      =  2 };
 enum { LEN_ARTNONCE      =  3 };
 enum { LEN_NETID         =  3 };
@@ -381,6 +381,39 @@ inline dr_t  lowerDR  (dr_t dr, u1_t n) { while(n--){dr=decDR(dr);} return dr; }
 s1_t pow2dBm (u1_t mcmd_ladr_p1);
 // Calculate airtime
 ostime_t calcAirTime (rps_t rps, u1_t plen);
+// Airtime formula behind calcAirTime() - also usable in constant expressions.
+// calcAirTime() answers the common cases (CR 4/5, explicit header) from a table
+// built with this at compile time and falls back to it for everything else.
+constexpr ostime_t airTimeOf (rps_t rps, u1_t plen) {
+    int bw = (rps >> 3) & 0x3;  // 0,1,2 = 125,250,500kHz
+    int sf = rps & 0x7;         // 0=FSK, 1..6 = SF7..12
+    if( sf == FSK ) {
+        return (plen+/*preamble*/5+/*syncword*/3+/*len*/1+/*crc*/2) * /*bits/byte*/8
+            * (s4_t)OSTICKS_PER_SEC / /*kbit/s*/50000;
+    }
+    int sfx = 4*(sf+(7-SF7));
+    int q = sfx - (sf >= SF11 ? 8 : 0);
+    int tmp = 8*plen - sfx + 28 + ((rps & 0x80)?0:16) - ((rps & 0xFF00)?20:0);
+    if( tmp > 0 ) {
+        tmp = (tmp + q - 1) / q;
+        tmp *= ((rps >> 5) & 0x3)+5;
+        tmp += 8;
+    } else {
+        tmp = 8;
+    }
+    tmp = (tmp<<2) + /*preamble*/49 /* 4 * (8 + 4.25) */;
+    // osticks = tmp * OSTICKS_PER_SEC * 1<<sf / bw  with  bw = 15625 * 2^(3+bw)
+    // 2 => counter 2 shift on tmp
+    sfx = sf+(7-SF7) - (3+2) - bw;
+    int div = 15625;
+    if( sfx > 4 ) {
+        // prevent 32bit signed int overflow in last step
+        div >>= sfx-4;
+        sfx = 4;
+    }
+    // Need 32bit arithmetic for this last step
+    return (((ostime_t)tmp << sfx) * OSTICKS_PER_SEC + div/2) / div;
+}
 // Sensitivity at given SF/BW
 int getSensitivity (rps_t rps);
 
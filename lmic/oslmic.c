@@ -82,24 +82,40 @@ void os_setTimedCallback (osjob_t* job, ostime_t time, osjobcb_t cb) {
     hal_enableIRQs();
 }
 
+// execute at most one job from timer or run queue, return whether one ran
+bit_t os_runloopOnce () {
+    osjob_t* j = NULL;
+    hal_disableIRQs();
+    // check for runnable jobs
+    if(OS.runnablejobs) {
+        j = OS.runnablejobs;
+        OS.runnablejobs = j->next;
+    } else if(OS.scheduledjobs && hal_checkTimer(OS.scheduledjobs->deadline)) { // check for expired timed jobs
+        j = OS.scheduledjobs;
+        OS.scheduledjobs = j->next;
+    } else { // nothing pending
+        hal_sleep(); // wake by irq (timer already restarted)
+    }
+    hal_enableIRQs();
+    if(j) { // run job callback
+        j->func(j);
+    }
+    return j != NULL;
+}
+
+u4_t os_crc32 (xref2cu1_t buf, uint len) {
+    u4_t crc = 0xFFFFFFFF;
+    while( len-- ) {
+        crc ^= *buf++;
+        for( u1_t i=0; i<8; i++ )
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
 // execute jobs from timer and from run queue
 void os_runloop () {
     while(1) {
-        osjob_t* j = NULL;
-        hal_disableIRQs();
-        // check for runnable jobs
-        if(OS.runnablejobs) {
-            j = OS.runnablejobs;
-            OS.runnablejobs = j->next;
-        } else if(OS.scheduledjobs && hal_checkTimer(OS.scheduledjobs->deadline)) { // check for expired timed jobs
-            j = OS.scheduledjobs;
-            OS.scheduledjobs = j->next;
-        } else { // nothing pending
-            hal_sleep(); // wake by irq (timer already restarted)
-        }
-       hal_enableIRQs();
-        if(j) { // run job callback
-            j->func(j);
-        }
+        os_runloopOnce();
     }
 }
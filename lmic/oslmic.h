@@ -79,8 +79,11 @@ u1_t radio_rand1 (void);
 
 void radio_init (void);
 void radio_irq_handler (u1_t dio);
+s1_t radio_sampleRssi (u4_t freq);
+bit_t radio_rxBusy (void);
 void os_init (void);
 void os_runloop (void);
+bit_t os_runloopOnce (void);
 
 //================================================================================
 
@@ -212,6 +215,22 @@ extern xref2u1_t AESaux;
 u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len);
 #endif
 
+// Incremental AES-CMAC - message may be supplied in any number of spans.
+// os_cmacFinal returns the first MIC word like os_aes(AES_MIC,..).
+// Only one key schedule is cached, do not interleave contexts with different keys.
+struct aescmac_t {
+    u4_t x[4];      // CBC state
+    u1_t buf[16];   // last (possibly partial) block
+    u1_t blen;
+};
+typedef struct aescmac_t aescmac_t;
+void os_cmacInit   (aescmac_t* ctx, xref2cu1_t key);
+void os_cmacUpdate (aescmac_t* ctx, xref2cu1_t data, uint len);
+u4_t os_cmacFinal  (aescmac_t* ctx);
+
+// CRC-32 (IEEE 802.3) - integrity check of persisted state
+u4_t os_crc32 (xref2cu1_t buf, uint len);
+
 
 
 #endif // _oslmic_h_
@@ -9,8 +9,9 @@
  *    IBM Zurich Research Lab - initial API, implementation and documentation
  *******************************************************************************/
 
-#include <wiringPi.h>
 #include "lmic.h"
+#include "spitrace.h"
+#include "radio.h"
 
 // ---------------------------------------- 
 // Registers Mapping
@@ -105,6 +106,7 @@
 #define LORARegSyncWord                            0x39
 #define FSKRegTimer2Coef                           0x3A
 #define FSKRegImageCal                             0x3B
+#define LORARegInvertIQ2                           0x3B
 #define FSKRegTemp                                 0x3C
 #define FSKRegLowBat                               0x3D
 #define FSKRegIrqFlags1                            0x3E
@@ -178,6 +180,19 @@
 #define RXLORA_RXMODE_RSSI_REG_MODEM_CONFIG2 0x74
 #endif
 
+// noise sampling: 125kHz channel filter, RSSI [dBm] = RegRssiValue + offset
+#ifdef CFG_sx1276_radio
+#define NOISE_REG_MODEM_CONFIG1 (SX1276_MC1_BW_125|SX1276_MC1_CR_4_5)
+#define NOISE_RSSI_OFFSET       (-157)   // HF port
+#elif CFG_sx1272_radio
+#define NOISE_REG_MODEM_CONFIG1 (SX1272_MC1_BW_125|SX1272_MC1_CR_4_5)
+#define NOISE_RSSI_OFFSET       (-139)
+#endif
+#define NOISE_SETTLE  us2osticksCeil(1000)  // RX startup and first RSSI update
+#define NOISE_READS   4
+
+#define MODEMSTAT_RX_BUSY  0x0B                 // signal detected, synchronized, header valid
+
 
 
 // ---------------------------------------- 
@@ -225,17 +240,27 @@
 // DIO function mappings                D0D1D2D3
 #define MAP_DIO0_LORA_RXDONE   0x00  // 00------
 #define MAP_DIO0_LORA_TXDONE   0x40  // 01------
+#define MAP_DIO0_LORA_CADDONE  0x80  // 10------
 #define MAP_DIO1_LORA_RXTOUT   0x00  // --00----
 #define MAP_DIO1_LORA_NOP      0x30  // --11----
 #define MAP_DIO2_LORA_NOP      0xC0  // ----11--
 
 #define MAP_DIO0_FSK_READY     0x00  // 00------ (packet sent / payload ready)
+#define MAP_DIO1_FSK_FIFOLEVEL 0x00  // --00----
+#define MAP_DIO1_FSK_FIFOEMPTY 0x10  // --01----
 #define MAP_DIO1_FSK_NOP       0x30  // --11----
 #define MAP_DIO2_FSK_TXNOP     0x04  // ----01--
 #define MAP_DIO2_FSK_TIMEOUT   0x08  // ----10--
 
 
 // FSK IMAGECAL defines
+// RegInvertIQ: bit 6 set inverts RX, bit 0 cleared inverts TX
+#define INVERTIQ_RX_ON          0x40
+#define INVERTIQ_TX_OFF         0x01
+// RegInvertIQ2 must follow the inversion
+#define INVERTIQ2_ON            0x19
+#define INVERTIQ2_OFF           0x1D
+
 #define RF_IMAGECAL_AUTOIMAGECAL_MASK               0x7F
 #define RF_IMAGECAL_AUTOIMAGECAL_ON                 0x80
 #define RF_IMAGECAL_AUTOIMAGECAL_OFF                0x00  // Default
@@ -246,6 +271,8 @@
 #define RF_IMAGECAL_IMAGECAL_RUNNING                0x20
 #define RF_IMAGECAL_IMAGECAL_DONE                   0x00  // Default
 
+#define RF_IMAGECAL_TEMPMONITOR_OFF                 0x01
+
 
 // RADIO STATE
 // (initialized by radio_init(), used by radio_rand1())
@@ -315,20 +342,20 @@ static void opmodeFSK() {
 }
 
 // configure LoRa modem (cfg1, cfg2)
-static void configLoraModem () {
-    sf_t sf = getSf(LMIC.rps);
+static void configLoraModem (rps_t rps) {
+    sf_t sf = getSf(rps);
 
 #ifdef CFG_sx1276_radio
         u1_t mc1 = 0, mc2 = 0, mc3 = 0;
 
-        switch (getBw(LMIC.rps)) {
+        switch (getBw(rps)) {
         case BW125: mc1 |= SX1276_MC1_BW_125; break;
         case BW250: mc1 |= SX1276_MC1_BW_250; break;
         case BW500: mc1 |= SX1276_MC1_BW_500; break;
         default:
             ASSERT(0);
         }
-        switch( getCr(LMIC.rps) ) {
+        switch( getCr(rps) ) {
         case CR_4_5: mc1 |= SX1276_MC1_CR_4_5; break;
         case CR_4_6: mc1 |= SX1276_MC1_CR_4_6; break;
         case CR_4_7: mc1 |= SX1276_MC1_CR_4_7; break;
@@ -337,45 +364,45 @@ static void configLoraModem () {
             ASSERT(0);
         }
 
-        if (getIh(LMIC.rps)) {
+        if (getIh(rps)) {
             mc1 |= SX1276_MC1_IMPLICIT_HEADER_MODE_ON;
-            writeReg(LORARegPayloadLength, getIh(LMIC.rps)); // required length
+            writeReg(LORARegPayloadLength, getIh(rps)); // required length
         }
         // set ModemConfig1
         writeReg(LORARegModemConfig1, mc1);
 
         mc2 = (SX1272_MC2_SF7 + ((sf-1)<<4));
-        if (getNocrc(LMIC.rps) == 0) {
+        if (getNocrc(rps) == 0) {
             mc2 |= SX1276_MC2_RX_PAYLOAD_CRCON;
         }
         writeReg(LORARegModemConfig2, mc2);
         
         mc3 = SX1276_MC3_AGCAUTO;
-        if ((sf == SF11 || sf == SF12) && getBw(LMIC.rps) == BW125) {
+        if ((sf == SF11 || sf == SF12) && getBw(rps) == BW125) {
             mc3 |= SX1276_MC3_LOW_DATA_RATE_OPTIMIZE;
         }
         writeReg(LORARegModemConfig3, mc3);
 #elif CFG_sx1272_radio
-        u1_t mc1 = (getBw(LMIC.rps)<<6);
+        u1_t mc1 = (getBw(rps)<<6);
 
-        switch( getCr(LMIC.rps) ) {
+        switch( getCr(rps) ) {
         case CR_4_5: mc1 |= SX1272_MC1_CR_4_5; break;
         case CR_4_6: mc1 |= SX1272_MC1_CR_4_6; break;
         case CR_4_7: mc1 |= SX1272_MC1_CR_4_7; break;
         case CR_4_8: mc1 |= SX1272_MC1_CR_4_8; break;
         }
         
-        if ((sf == SF11 || sf == SF12) && getBw(LMIC.rps) == BW125) {
+        if ((sf == SF11 || sf == SF12) && getBw(rps) == BW125) {
             mc1 |= SX1272_MC1_LOW_DATA_RATE_OPTIMIZE;
         }
         
-        if (getNocrc(LMIC.rps) == 0) {
+        if (getNocrc(rps) == 0) {
             mc1 |= SX1272_MC1_RX_PAYLOAD_CRCON;
         }
         
-        if (getIh(LMIC.rps)) {
+        if (getIh(rps)) {
             mc1 |= SX1272_MC1_IMPLICIT_HEADER_MODE_ON;
-            writeReg(LORARegPayloadLength, getIh(LMIC.rps)); // required length
+            writeReg(LORARegPayloadLength, getIh(rps)); // required length
         }
         // set ModemConfig1
         writeReg(LORARegModemConfig1, mc1);
@@ -387,20 +414,75 @@ static void configLoraModem () {
 #endif /* CFG_sx1272_radio */
 }
 
-static void configChannel () {
+// Crystal drift, per radio: frames received by the MAC measure the error
+// left after correction (FEI), the estimate moves by 1/XTAL_GAIN of it
+static xtalstat_t xtals[MAX_RADIOS];
+#define XTAL xtals[hal_currentRadio()]
+
+static void writeFrf (u4_t freq) {
     // set frequency: FQ = (FRF * 32 Mhz) / (2 ^ 19)
-    u8_t frf = ((u8_t)LMIC.freq << 19) / 32000000;
+    u8_t frf = ((u8_t)freq << 19) / 32000000;
     writeReg(RegFrfMsb, (u1_t)(frf>>16));
     writeReg(RegFrfMid, (u1_t)(frf>> 8));
     writeReg(RegFrfLsb, (u1_t)(frf>> 0));
 }
 
+static void configFreq (u4_t freq) {
+    // a fast crystal shifts the synthesizer up by as much, tune lower
+    XTAL.corr = (s4_t)(-(s8_t)freq * XTAL.ppb / 1000000000);
+    writeFrf(freq + XTAL.corr);
+}
+
+static void configChannel () {
+    configFreq(LMIC.freq);
+}
+
+// Learn from the frame just received with rps on freq
+static void xtalUpdate (u4_t freq, rps_t rps) {
+    u1_t fei[3];
+    readBuf(LORARegFeiMsb, fei, 3);
+    s4_t fe = (fei[0] & 0x0F) << 16 | fei[1] << 8 | fei[2]; // 20 bit two's complement
+    if( fe & 0x80000 )
+        fe -= 0x100000;
+    // inverted I/Q mirrors the spectrum, and with it the sign of the error
+    if( readReg(LORARegInvertIQ) & INVERTIQ_RX_ON )
+        fe = -fe;
+    // Ferr = FreqError * 2^24 / Fxtal * BW / 500 kHz, > 0: signal above our tuning
+    XTAL.fei = (s4_t)((s8_t)fe * (1<<24) * (125 << getBw(rps)) / (32000000LL * 500));
+    // signal above us means we are tuned low - crystal slow
+    s4_t ppb = (s4_t)((s8_t)XTAL.fei * 1000000000 / freq);
+    if( ppb > XTAL_MAX_PPB || ppb < -XTAL_MAX_PPB ) {
+        XTAL.rejected++;
+        return;
+    }
+    XTAL.ppb -= XTAL.updates ? ppb / XTAL_GAIN : ppb;
+    if( XTAL.ppb > XTAL_MAX_PPB )
+        XTAL.ppb = XTAL_MAX_PPB;
+    else if( XTAL.ppb < -XTAL_MAX_PPB )
+        XTAL.ppb = -XTAL_MAX_PPB;
+    XTAL.updates++;
+}
+
+const xtalstat_t* radio_xtalStat (u1_t radio) {
+    return &xtals[radio];
+}
+
+void radio_setXtal (u1_t radio, s4_t ppb) {
+    xtals[radio].ppb = ppb;
+    xtals[radio].updates = ppb != 0;
+}
+
 
+// I/Q polarity of the LoRa modem for the next RX and TX
+static void configIq (bit_t rxInv, bit_t txInv) {
+    u1_t iq = readReg(LORARegInvertIQ) & ~(INVERTIQ_RX_ON|INVERTIQ_TX_OFF);
+    writeReg(LORARegInvertIQ, iq | (rxInv ? INVERTIQ_RX_ON : 0) | (txInv ? 0 : INVERTIQ_TX_OFF));
+    writeReg(LORARegInvertIQ2, rxInv || txInv ? INVERTIQ2_ON : INVERTIQ2_OFF);
+}
 
-static void configPower () {
+static void configPower (s1_t pw) {
 #ifdef CFG_sx1276_radio
     // no boost used for now
-    s1_t pw = (s1_t)LMIC.txpow;
     if(pw >= 17) {
         pw = 15;
     } else if(pw < 2) {
@@ -412,7 +494,6 @@ static void configPower () {
 
 #elif CFG_sx1272_radio
     // set PA config (2-17 dBm using PA_BOOST)
-    s1_t pw = (s1_t)LMIC.txpow;
     if(pw > 17) {
         pw = 17;
     } else if(pw < 2) {
@@ -448,7 +529,7 @@ static void txfsk () {
     // configure frequency
     configChannel();
     // configure output power
-    configPower();
+    configPower(LMIC.txpow);
 
     // set the IRQ mapping DIO0=PacketSent DIO1=NOP DIO2=NOP
     writeReg(RegDioMapping1, MAP_DIO0_FSK_READY|MAP_DIO1_FSK_NOP|MAP_DIO2_FSK_TXNOP);
@@ -476,14 +557,16 @@ static void txlora () {
     // enter standby mode (required for FIFO loading))
     opmode(OPMODE_STANDBY);
     // configure LoRa modem (cfg1, cfg2)
-    configLoraModem();
+    configLoraModem(LMIC.rps);
     // configure frequency
     configChannel();
     // configure output power
     writeReg(RegPaRamp, (readReg(RegPaRamp) & 0xF0) | 0x08); // set PA ramp-up time 50 uSec
-    configPower();
+    configPower(LMIC.txpow);
     // set sync word
     writeReg(LORARegSyncWord, LORA_MAC_PREAMBLE);
+    // uplinks use normal I/Q, whatever the last raw or RX setup left behind
+    configIq(0, 0);
     
     // set the IRQ mapping DIO0=TxDone DIO1=NOP DIO2=NOP
     writeReg(RegDioMapping1, MAP_DIO0_LORA_TXDONE|MAP_DIO1_LORA_NOP|MAP_DIO2_LORA_NOP);
@@ -510,11 +593,13 @@ static void txlora () {
 // start transmitter (buf=LMIC.frame, len=LMIC.dataLen)
 static void starttx () {
     //ASSERT( (readReg(RegOpMode) & OPMODE_MASK) == OPMODE_SLEEP );
+    SPITRACE_BEGIN(SPIOP_STARTTX);
     if(getSf(LMIC.rps) == FSK) { // FSK modem
         txfsk();
     } else { // LoRa modem
         txlora();
     }
+    SPITRACE_END();
     // the radio will go back to STANDBY mode as soon as the TX is finished
     // the corresponding IRQ will inform us about completion.
 }
@@ -540,16 +625,18 @@ static void rxlora (u1_t rxmode) {
         writeReg(LORARegModemConfig2, RXLORA_RXMODE_RSSI_REG_MODEM_CONFIG2);
     } else { // single or continuous rx mode
         // configure LoRa modem (cfg1, cfg2)
-        configLoraModem();
+        configLoraModem(LMIC.rps);
         // configure frequency
         configChannel();
     }
     // set LNA gain
     writeReg(RegLna, LNA_RX_GAIN); 
     // set max payload size
-    writeReg(LORARegPayloadMaxLength, 64);
+    writeReg(LORARegPayloadMaxLength, MAX_LEN_FRAME);
+    // whole FIFO for RX
+    writeReg(LORARegFifoRxBaseAddr, 0x00);
     // use inverted I/Q signal (prevent mote-to-mote communication)
-    writeReg(LORARegInvertIQ, readReg(LORARegInvertIQ)|(1<<6));
+    configIq(1, 0);
     // set symbol timeout (for single rx)
     writeReg(LORARegSymbTimeoutLsb, LMIC.rxsyms);
     // set sync word
@@ -627,18 +714,129 @@ static void rxfsk (u1_t rxmode) {
 
 static void startrx (u1_t rxmode) {
     //ASSERT( (readReg(RegOpMode) & OPMODE_MASK) == OPMODE_SLEEP );
+    SPITRACE_BEGIN(SPIOP_STARTRX);
     if(getSf(LMIC.rps) == FSK) { // FSK modem
         rxfsk(rxmode);
     } else { // LoRa modem
         rxlora(rxmode);
     }
+    SPITRACE_END();
     // the radio will go back to STANDBY mode as soon as the RX is finished
     // or timed out, and the corresponding IRQ will inform us about completion.
 }
 
-// get random seed from wideband noise rssi
-void radio_init () {
-    hal_disableIRQs();
+// start channel activity detection (freq=LMIC.freq, rps=LMIC.rps, result=LMIC.cadBusy)
+static void cadlora () {
+    opmodeLora();
+    ASSERT((readReg(RegOpMode) & OPMODE_LORA) != 0);
+    opmode(OPMODE_STANDBY);
+    configLoraModem(LMIC.rps);
+    configChannel();
+    writeReg(RegLna, LNA_RX_GAIN);
+    // look for uplink chirps of other devices
+    configIq(0, 0);
+
+    // set the IRQ mapping DIO0=CadDone DIO1=NOP DIO2=NOP
+    writeReg(RegDioMapping1, MAP_DIO0_LORA_CADDONE|MAP_DIO1_LORA_NOP|MAP_DIO2_LORA_NOP);
+    // clear all radio IRQ flags
+    writeReg(LORARegIrqFlags, 0xFF);
+    // CadDetected is evaluated together with CadDone
+    writeReg(LORARegIrqFlagsMask, ~(IRQ_LORA_CDDONE_MASK|IRQ_LORA_CDDETD_MASK));
+
+    hal_pin_rxtx(0);
+    // the radio returns to STANDBY after a couple of symbols
+    opmode(OPMODE_CAD);
+}
+
+static void startcad () {
+    SPITRACE_BEGIN(SPIOP_STARTCAD);
+    ASSERT(getSf(LMIC.rps) != FSK);
+    cadlora();
+    SPITRACE_END();
+}
+
+static u1_t macRadio;     // radio driven by the MAC (os_radio)
+
+void radio_bindMac (u1_t radio) {
+    ASSERT(radio < hal_radioCount());
+    macRadio = radio;
+}
+
+// ================================================================================
+// Temperature and image calibration
+
+#ifdef CFG_sx1276_radio
+
+#if defined(CFG_eu868)
+#define CAL_FREQ   868000000                // HF band calibrated at
+#elif defined(CFG_us915)
+#define CAL_FREQ   915000000
+#endif
+#define CAL_GUARD  ms2osticks(50)           // MAC job due this soon, radio busy
+#define CAL_RETRY  sec2osticks(1)           // next look when busy
+
+static struct {
+    osjob_t   job;
+    calstat_t stat;
+} cals[MAX_RADIOS];
+#define CAL cals[hal_currentRadio()]
+
+// Sensor reading in FSK standby, -1 per LSB with an offset - only differences count
+static s1_t readTemp () {
+    u1_t ic = readReg(FSKRegImageCal);
+    writeReg(FSKRegImageCal, ic & ~RF_IMAGECAL_TEMPMONITOR_OFF);
+    opmode(OPMODE_FSRX);
+    hal_waitUntil(os_getTime() + us2osticksCeil(150)); // wait >140us
+    opmode(OPMODE_STANDBY);
+    writeReg(FSKRegImageCal, ic);
+    CAL.stat.reads++;
+    return -(s1_t)readReg(FSKRegTemp);
+}
+
+// Rx chain calibration for the HF band, in FSK standby
+static void imageCal () {
+    u1_t pa = readReg(RegPaConfig);
+    writeReg(RegPaConfig, 0);
+    writeFrf(CAL_FREQ);
+    writeReg(FSKRegImageCal, (readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_MASK)|RF_IMAGECAL_IMAGECAL_START);
+    while((readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_RUNNING) == RF_IMAGECAL_IMAGECAL_RUNNING) { ; }
+    writeReg(RegPaConfig, pa);
+}
+
+// Read the temperature, calibrate if it moved by CAL_TEMP_DELTA or if
+// forced. Takes the radio from any mode and leaves it asleep (LoRa).
+static void calRun (bit_t force) {
+    ostime_t t0 = os_getTime();
+    opmode(OPMODE_SLEEP);
+    opmodeFSK();
+    opmode(OPMODE_STANDBY);
+    s1_t t = readTemp();
+    CAL.stat.temp = t;
+    if( force || t - CAL.stat.calTemp >= CAL_TEMP_DELTA || CAL.stat.calTemp - t >= CAL_TEMP_DELTA ) {
+        imageCal();
+        CAL.stat.calTemp = t;
+        CAL.stat.cals++;
+        CAL.stat.last = os_getTime();
+    }
+    opmode(OPMODE_SLEEP);
+    opmodeLora();
+    CAL.stat.busy += os_getTime() - t0;
+}
+
+static void calCheck (xref2osjob_t j);
+
+#endif // CFG_sx1276_radio
+
+const calstat_t* radio_calStat (u1_t radio) {
+#ifdef CFG_sx1276_radio
+    return &cals[radio].stat;
+#else
+    return NULL;
+#endif
+}
+
+// reset and check one radio, leave it asleep
+static void resetRadio () {
 
     // manually reset radio
 #ifdef CFG_sx1276_radio
@@ -667,6 +865,26 @@ void radio_init () {
 #error Missing CFG_sx1272_radio/CFG_sx1276_radio
 #endif
     opmode(OPMODE_SLEEP);
+
+#ifdef CFG_sx1276_radio
+    // chain calibration at the current temperature
+    calRun(1);
+#endif
+
+    opmode(OPMODE_SLEEP);
+}
+
+// get random seed from wideband noise rssi
+void radio_init () {
+    hal_disableIRQs();
+    for( u1_t r=0; r<hal_radioCount(); r++ ) {
+        hal_selectRadio(r);
+        resetRadio();
+#ifdef CFG_sx1276_radio
+        os_setTimedCallback(&cals[r].job, os_getTime() + sec2osticks(CAL_INTV), FUNC_ADDR(calCheck));
+#endif
+    }
+    hal_selectRadio(0);
     // seed 15-byte randomness via noise rssi
     rxlora(RXMODE_RSSI);
     while( (readReg(RegOpMode) & OPMODE_MASK) != OPMODE_RX ); // continuous rx
@@ -678,26 +896,6 @@ void radio_init () {
         }
     }
     randbuf[0] = 16; // set initial index
-  
-#ifdef CFG_sx1276mb1_board
-    // chain calibration
-    writeReg(RegPaConfig, 0);
-    
-    // Launch Rx chain calibration for LF band
-    writeReg(FSKRegImageCal, (readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_MASK)|RF_IMAGECAL_IMAGECAL_START);
-    while((readReg(FSKRegImageCal)&RF_IMAGECAL_IMAGECAL_RUNNING) == RF_IMAGECAL_IMAGECAL_RUNNING){ ; }
-
-    // Sets a Frequency in HF band
-    u4_t frf = 868000000;
-    writeReg(RegFrfMsb, (u1_t)(frf>>16));
-    writeReg(RegFrfMid, (u1_t)(frf>> 8));
-    writeReg(RegFrfLsb, (u1_t)(frf>> 0));
-
-    // Launch Rx chain calibration for HF band 
-    writeReg(FSKRegImageCal, (readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_MASK)|RF_IMAGECAL_IMAGECAL_START);
-    while((readReg(FSKRegImageCal) & RF_IMAGECAL_IMAGECAL_RUNNING) == RF_IMAGECAL_IMAGECAL_RUNNING) { ; }
-#endif /* CFG_sx1276mb1_board */
-
     opmode(OPMODE_SLEEP);
 
     hal_enableIRQs();
@@ -719,11 +917,316 @@ u1_t radio_rand1 () {
 
 u1_t radio_rssi () {
     hal_disableIRQs();
+    hal_selectRadio(macRadio);
     u1_t r = readReg(LORARegRssiValue);
     hal_enableIRQs();
     return r;
 }
 
+// is the MAC radio's LoRa receiver picking up a frame right now?
+bit_t radio_rxBusy (void) {
+    hal_disableIRQs();
+    hal_selectRadio(macRadio);
+    u1_t mode = readReg(RegOpMode);
+    bit_t busy = (mode & OPMODE_LORA) != 0 && (mode & OPMODE_MASK) == OPMODE_RX
+        && (readReg(LORARegModemStat) & MODEMSTAT_RX_BUSY) != 0;
+    hal_enableIRQs();
+    return busy;
+}
+
+// sample the noise on freq (blocks about a millisecond, radio goes back to sleep)
+// returns dBm, or 0 if the radio is not asleep, i.e. busy with a TX/RX
+s1_t radio_sampleRssi (u4_t freq) {
+    hal_disableIRQs();
+    hal_selectRadio(macRadio);
+    if( (readReg(RegOpMode) & OPMODE_MASK) != OPMODE_SLEEP ) {
+        hal_enableIRQs();
+        return 0;
+    }
+    opmodeLora();
+    opmode(OPMODE_STANDBY);
+    writeReg(LORARegModemConfig1, NOISE_REG_MODEM_CONFIG1);
+    configFreq(freq);
+    writeReg(RegLna, LNA_RX_GAIN);
+    writeReg(LORARegIrqFlagsMask, 0xFF);
+    hal_pin_rxtx(0);
+    opmode(OPMODE_RX);
+    hal_waitUntil(os_getTime() + NOISE_SETTLE);
+    s2_t sum = 0;
+    for( u1_t i=0; i<NOISE_READS; i++ )
+        sum += readReg(LORARegRssiValue);
+    opmode(OPMODE_SLEEP);
+    hal_enableIRQs();
+    s2_t dBm = sum / NOISE_READS + NOISE_RSSI_OFFSET;
+    return dBm < -127 ? -127 : dBm > -1 ? -1 : dBm;
+}
+
+// ================================================================================
+// FSK bulk transfer, see radio.h
+
+#define BULK_PREAMBLE  8   // bytes
+#define BULK_SYNC_LEN  3
+#define BULK_HDR_LEN   2   // payload length
+#define BULK_CRC_LEN   4   // CRC-32 of the payload
+#define BULK_FIFO      64
+#define BULK_TX_MARGIN ms2osticks(100)
+#define BULK_RX_MARGIN ms2osticks(50)
+#define BULK_DRAIN     us2osticksCeil(2*8*1000000/BULK_BITRATE) // two byte times
+#define BULK_TX_THRESH (BULK_CHUNK-1) // TX: FifoLevel clears at this many bytes, room for a chunk
+
+enum { BULK_IDLE, BULK_TX, BULK_RXHDR, BULK_RX };
+
+static struct bulk_t {
+    u1_t      state;
+    u1_t      chunk;    // RX: bytes per FifoLevel interrupt
+    u2_t      len;      // payload length
+    u2_t      max;      // RX buffer size
+    u2_t      pos;      // bytes of the frame moved through the FIFO
+    u1_t*     buf;
+    u1_t      hdr[BULK_HDR_LEN];
+    u1_t      crc[BULK_CRC_LEN];
+    int       result;
+    osjob_t*  job;
+    osjobcb_t cb;
+    osjob_t   timer;
+    osjob_t   refill;   // TX: FIFO down to BULK_TX_THRESH
+} bulks[MAX_RADIOS];
+#define BULK bulks[hal_currentRadio()]
+
+static u2_t bulkFrameLen () {
+    return BULK_HDR_LEN + BULK.len + BULK_CRC_LEN;
+}
+
+// air time of len bytes
+static ostime_t bulkBytes (u2_t len) {
+    return (u4_t)len * 8 * OSTICKS_PER_SEC / BULK_BITRATE;
+}
+
+// air time of len bytes plus preamble and sync word
+static ostime_t bulkAirtime (u2_t len) {
+    return bulkBytes(BULK_PREAMBLE + BULK_SYNC_LEN + len);
+}
+
+// byte i of the frame: header, payload or CRC
+static u1_t* bulkAt (u2_t i) {
+    if( i < BULK_HDR_LEN )
+        return &BULK.hdr[i];
+    i -= BULK_HDR_LEN;
+    return i < BULK.len ? &BULK.buf[i] : &BULK.crc[i - BULK.len];
+}
+
+// write the next n bytes of the frame to the FIFO (single SPI burst)
+static void bulkFill (u1_t n) {
+    hal_pin_nss(0);
+    hal_spi(RegFifo | 0x80);
+    for( ; n > 0; n-- )
+        hal_spi(*bulkAt(BULK.pos++));
+    hal_pin_nss(1);
+}
+
+// read the next n bytes of the frame from the FIFO (single SPI burst)
+static void bulkDrain (u1_t n) {
+    hal_pin_nss(0);
+    hal_spi(RegFifo & 0x7F);
+    for( ; n > 0; n-- )
+        *bulkAt(BULK.pos++) = hal_spi(0x00);
+    hal_pin_nss(1);
+}
+
+static void bulkDone (int result) {
+    opmode(OPMODE_SLEEP);
+    writeReg(FSKRegFifoThresh, 0x8F); // reset value, txfsk relies on TxStartCondition=FifoNotEmpty
+    os_clearCallback(&BULK.timer);
+    os_clearCallback(&BULK.refill);
+    BULK.state = BULK_IDLE;
+    BULK.result = result;
+    os_setCallback(BULK.job, BULK.cb);
+}
+
+static void bulkTimeout (xref2osjob_t j) {
+    hal_disableIRQs();
+    u1_t r = 0;
+    while( &bulks[r].timer != j )
+        r++;
+    hal_selectRadio(r);
+    if( BULK.state != BULK_IDLE )
+        bulkDone(BULK_TIMEOUT);
+    hal_enableIRQs();
+}
+
+static void bulkRefill (xref2osjob_t j);
+
+// Large packet TX: refill a chunk once FifoLevel has cleared, i.e. the FIFO is
+// down to the threshold, leaving BULK_TX_THRESH bytes of slack. The HAL only
+// reports rising DIO edges, so the flag is checked when the chunk just
+// written should have gone out.
+static void bulkTxFill () {
+    u1_t flags2 = readReg(FSKRegIrqFlags2);
+    if( flags2 & IRQ_FSK2_FIFOEMPTY_MASK ) {
+        bulkDone(BULK_UNDERRUN);
+        return;
+    }
+    if( flags2 & IRQ_FSK2_FIFOLEVEL_MASK ) {
+        // still above the threshold - running a little slower than our clock
+        os_setTimedCallback(&BULK.refill, os_getTime() + bulkBytes(1), bulkRefill);
+        return;
+    }
+    u2_t left = bulkFrameLen() - BULK.pos;
+    u1_t n = left < BULK_CHUNK ? left : (u2_t)BULK_CHUNK;
+    bulkFill(n);
+    if( n < left )
+        os_setTimedCallback(&BULK.refill, os_getTime() + bulkBytes(n), bulkRefill);
+}
+
+static void bulkRefill (xref2osjob_t j) {
+    hal_disableIRQs();
+    u1_t r = 0;
+    while( &bulks[r].refill != j )
+        r++;
+    hal_selectRadio(r);
+    if( BULK.state == BULK_TX )
+        bulkTxFill();
+    hal_enableIRQs();
+}
+
+static void bulkStart (osjob_t* job, osjobcb_t cb, u1_t state, u1_t* buf, u2_t len) {
+    os_clearCallback(job);
+    BULK.state  = state;
+    BULK.buf    = buf;
+    BULK.len    = len;
+    BULK.pos    = 0;
+    BULK.job    = job;
+    BULK.cb     = cb;
+    BULK.result = BULK_TIMEOUT;
+}
+
+// FSK modem in unlimited length packet mode (from sleep mode)
+static void bulkConfig (u4_t freq) {
+    opmodeFSK();
+    ASSERT((readReg(RegOpMode) & OPMODE_LORA) == 0);
+    opmode(OPMODE_STANDBY);
+    writeReg(FSKRegBitrateMsb, 0x02); // 50kbps
+    writeReg(FSKRegBitrateLsb, 0x80);
+    writeReg(FSKRegFdevMsb, 0x01); // +/- 25kHz
+    writeReg(FSKRegFdevLsb, 0x99);
+    writeReg(FSKRegPreambleMsb, 0x00);
+    writeReg(FSKRegPreambleLsb, BULK_PREAMBLE);
+    writeReg(FSKRegSyncConfig, 0x10|(BULK_SYNC_LEN-1)); // no auto restart, preamble 0xAA, sync on
+    writeReg(FSKRegSyncValue1, 0x4C); // "LMB" - LoRaWAN FSK frames use C1 94 C1
+    writeReg(FSKRegSyncValue2, 0x4D);
+    writeReg(FSKRegSyncValue3, 0x42);
+    writeReg(FSKRegPacketConfig1, 0x40); // fixed length, whitening, no crc (ours is in the frame)
+    writeReg(FSKRegPacketConfig2, 0x40); // packet mode
+    writeReg(FSKRegPayloadLength, 0);    // fixed length 0: unlimited
+    writeReg(FSKRegIrqFlags2, IRQ_FSK2_FIFOOVERRUN_MASK); // clears FIFO
+    configFreq(freq);
+}
+
+void radio_bulkTx (u1_t radio, osjob_t* job, osjobcb_t cb, u4_t freq, s1_t txpow, xref2cu1_t buf, u2_t len) {
+    ASSERT(len <= BULK_MAX_LEN);
+    hal_disableIRQs();
+    hal_selectRadio(radio);
+    bulkStart(job, cb, BULK_TX, (u1_t*)buf, len);
+    os_wlsbf2(BULK.hdr, len);
+    os_wlsbf4(BULK.crc, os_crc32(buf, len));
+    bulkConfig(freq);
+    configPower(txpow);
+    writeReg(FSKRegFifoThresh, 0x80|BULK_TX_THRESH); // start TX when the FIFO is not empty
+    u2_t flen = bulkFrameLen();
+    u1_t n = flen < BULK_FIFO ? flen : BULK_FIFO;
+    bulkFill(n);
+    // set the IRQ mapping DIO0=NOP (no PacketSent in unlimited mode) DIO1=FifoEmpty (end or underrun) DIO2=NOP
+    writeReg(RegDioMapping1, MAP_DIO0_FSK_READY|MAP_DIO1_FSK_FIFOEMPTY|MAP_DIO2_FSK_TXNOP);
+    hal_pin_rxtx(1);
+    opmode(OPMODE_TX);
+    os_setTimedCallback(&BULK.timer, os_getTime() + 2*bulkAirtime(flen) + BULK_TX_MARGIN, bulkTimeout);
+    if( n < flen )
+        os_setTimedCallback(&BULK.refill, os_getTime() + bulkAirtime(n - BULK_TX_THRESH), bulkRefill);
+    hal_enableIRQs();
+}
+
+void radio_bulkRx (u1_t radio, osjob_t* job, osjobcb_t cb, u4_t freq, xref2u1_t buf, u2_t maxlen, ostime_t timeout) {
+    hal_disableIRQs();
+    hal_selectRadio(radio);
+    bulkStart(job, cb, BULK_RXHDR, buf, 0);
+    BULK.max = maxlen;
+    bulkConfig(freq);
+    writeReg(RegLna, LNA_RX_GAIN);
+    writeReg(FSKRegRxConfig, 0x1E); // AFC auto, AGC, trigger on preamble
+    writeReg(FSKRegRxBw, 0x0B); // 50kHz SSB
+    writeReg(FSKRegAfcBw, 0x12); // 83.3kHz SSB
+    writeReg(FSKRegPreambleDetect, 0xAA); // enable, 2 bytes, 10 chip errors
+    writeReg(FSKRegRxTimeout2, 0x00); // timeout is ours
+    // first interrupt once the header is in
+    BULK.chunk = BULK_HDR_LEN;
+    writeReg(FSKRegFifoThresh, BULK.chunk-1);
+    // set the IRQ mapping DIO0=NOP (no PayloadReady in unlimited mode) DIO1=FifoLevel DIO2=NOP
+    writeReg(RegDioMapping1, MAP_DIO0_FSK_READY|MAP_DIO1_FSK_FIFOLEVEL|MAP_DIO2_FSK_TIMEOUT);
+    hal_pin_rxtx(0);
+    opmode(OPMODE_RX);
+    os_setTimedCallback(&BULK.timer, timeout, bulkTimeout);
+    hal_enableIRQs();
+}
+
+// all DIOs end up here during a transfer, the FIFO flags tell what to do
+static void bulkIrq () {
+    if( BULK.state == BULK_TX ) {
+        if( (readReg(FSKRegIrqFlags2) & IRQ_FSK2_FIFOEMPTY_MASK) == 0 )
+            return;
+        if( BULK.pos < bulkFrameLen() ) {
+            // the refill came too late
+            bulkDone(BULK_UNDERRUN);
+            return;
+        }
+        // last byte is leaving the shift register
+        hal_waitUntil(os_getTime() + BULK_DRAIN);
+        bulkDone(BULK_OK);
+        return;
+    }
+    u1_t flags2;
+    while( ((flags2 = readReg(FSKRegIrqFlags2)) & IRQ_FSK2_FIFOLEVEL_MASK) != 0 ) {
+        if( flags2 & IRQ_FSK2_FIFOOVERRUN_MASK ) {
+            bulkDone(BULK_OVERRUN);
+            return;
+        }
+        bulkDrain(BULK.chunk);
+        if( BULK.state == BULK_RXHDR ) {
+            BULK.len = os_rlsbf2(BULK.hdr);
+            if( BULK.len > BULK.max ) {
+                bulkDone(BULK_TOOLONG);
+                return;
+            }
+            BULK.state = BULK_RX;
+            os_setTimedCallback(&BULK.timer, os_getTime() + bulkAirtime(bulkFrameLen()) + BULK_RX_MARGIN, bulkTimeout);
+        }
+        u2_t left = bulkFrameLen() - BULK.pos;
+        if( left == 0 ) {
+            bulkDone(os_crc32(BULK.buf, BULK.len) == os_rlsbf4(BULK.crc) ? (int)BULK.len : (int)BULK_CRCERR);
+            return;
+        }
+        BULK.chunk = left < BULK_CHUNK ? left : (u2_t)BULK_CHUNK;
+        writeReg(FSKRegFifoThresh, BULK.chunk-1);
+    }
+}
+
+int radio_bulkResult (u1_t radio) {
+    return bulks[radio].result;
+}
+
+void radio_bulkAbort (u1_t radio) {
+    hal_disableIRQs();
+    hal_selectRadio(radio);
+    if( BULK.state != BULK_IDLE ) {
+        opmode(OPMODE_SLEEP);
+        writeReg(FSKRegFifoThresh, 0x8F);
+        os_clearCallback(&BULK.timer);
+        os_clearCallback(&BULK.refill);
+        BULK.state = BULK_IDLE;
+        BULK.result = BULK_ABORTED;
+    }
+    hal_enableIRQs();
+}
+
 static const u2_t LORA_RXDONE_FIXUP[] = {
     [FSK]  =     us2osticks(0), // (   0 ticks)
     [SF7]  =     us2osticks(0), // (   0 ticks)
@@ -734,10 +1237,251 @@ static const u2_t LORA_RXDONE_FIXUP[] = {
     [SF12] = us2osticks(31189), // (1022 ticks)
 };
 
-// called by hal ext IRQ handler
-// (radio goes to stanby mode after tx/rx operations)
-void radio_irq_handler (u1_t dio) {
+// ================================================================================
+// Raw LoRa, see radio.h
+
+enum { RAW_IDLE, RAW_TX, RAW_RX };
+
+#define RAW_PRESTAGE       us2osticksCeil(2000) // leave RX, configure and load the FIFO
+
+static struct {
+    u1_t       state;
+    u1_t       rxOn;        // receiver wanted, resumed after TX
+    u1_t       head, tail;  // ring indices (mod 256)
+    rawcfg_t   rxcfg;
+    osjob_t*   txjob;
+    osjobcb_t  txcb;
+    osjob_t*   rxjob;
+    osjobcb_t  rxcb;
+    rawstat_t  stat;
+    rawframe_t ring[RAW_RING];
+} raws[MAX_RADIOS];
+#define RAW raws[hal_currentRadio()]
+
+// LoRa modem in standby with cfg (from sleep mode)
+static void rawConfig (const rawcfg_t* cfg) {
+    opmodeLora();
+    ASSERT((readReg(RegOpMode) & OPMODE_LORA) != 0);
+    opmode(OPMODE_STANDBY);
+    configLoraModem(cfg->rps);
+    configFreq(cfg->freq);
+    writeReg(LORARegSyncWord, cfg->sync);
+    configIq(cfg->iq == RAW_IQ_INVERTED, cfg->iq == RAW_IQ_INVERTED);
+    writeReg(LORARegIrqFlags, 0xFF);
+}
+
+static void rawStartRx () {
+    rawConfig(&RAW.rxcfg);
+    writeReg(RegLna, LNA_RX_GAIN);
+    writeReg(LORARegPayloadMaxLength, MAX_LEN_FRAME);
+    writeReg(LORARegFifoRxBaseAddr, 0x00);
+    // set the IRQ mapping DIO0=RxDone DIO1=NOP DIO2=NOP
+    writeReg(RegDioMapping1, MAP_DIO0_LORA_RXDONE|MAP_DIO1_LORA_NOP|MAP_DIO2_LORA_NOP);
+    writeReg(LORARegIrqFlagsMask, ~(IRQ_LORA_RXDONE_MASK|IRQ_LORA_CRCERR_MASK));
+    hal_pin_rxtx(0);
+    opmode(OPMODE_RX);
+    RAW.state = RAW_RX;
+}
+
+// transmit now, or exactly at time at if timed
+static bit_t rawTx (u1_t radio, osjob_t* job, osjobcb_t cb, const rawcfg_t* cfg, xref2cu1_t buf, u1_t len, bit_t timed, ostime_t at) {
+    ASSERT(getSf(cfg->rps) != FSK && (getIh(cfg->rps) == 0 || getIh(cfg->rps) == len));
+    hal_disableIRQs();
+    hal_selectRadio(radio);
+    ASSERT(BULK.state == BULK_IDLE);
+    if( timed && (s4_t)(os_getTime() - at) > 0 ) {
+        hal_enableIRQs();
+        return 0;
+    }
+    if( RAW.state == RAW_RX && (readReg(LORARegModemStat) & MODEMSTAT_RX_BUSY) )
+        RAW.stat.rxAborted++;
+    RAW.txjob = job;
+    RAW.txcb  = cb;
+    opmode(OPMODE_SLEEP); // pauses the receiver
+    rawConfig(cfg);
+    writeReg(RegPaRamp, (readReg(RegPaRamp) & 0xF0) | 0x08); // set PA ramp-up time 50 uSec
+    configPower(cfg->txpow);
+    // set the IRQ mapping DIO0=TxDone DIO1=NOP DIO2=NOP
+    writeReg(RegDioMapping1, MAP_DIO0_LORA_TXDONE|MAP_DIO1_LORA_NOP|MAP_DIO2_LORA_NOP);
+    writeReg(LORARegIrqFlagsMask, ~IRQ_LORA_TXDONE_MASK);
+    writeReg(LORARegFifoTxBaseAddr, 0x00);
+    writeReg(LORARegFifoAddrPtr, 0x00);
+    writeReg(LORARegPayloadLength, len);
+    writeBuf(RegFifo, (xref2u1_t)buf, len);
+    hal_pin_rxtx(1);
+    if( timed )
+        hal_waitUntil(at); // busy wait until exact tx time
+    opmode(OPMODE_TX);
+    RAW.state = RAW_TX;
+    hal_enableIRQs();
+    return 1;
+}
+
+void radio_rawTx (u1_t radio, osjob_t* job, osjobcb_t cb, const rawcfg_t* cfg, xref2cu1_t buf, u1_t len) {
+    rawTx(radio, job, cb, cfg, buf, len, 0, 0);
+}
+
+bit_t radio_rawTxAt (u1_t radio, osjob_t* job, osjobcb_t cb, const rawcfg_t* cfg, xref2cu1_t buf, u1_t len, ostime_t at) {
+    // the receiver keeps running until the radio has to be set up
+    hal_waitUntil(at - RAW_PRESTAGE);
+    return rawTx(radio, job, cb, cfg, buf, len, 1, at);
+}
+
+void radio_rawRx (u1_t radio, osjob_t* job, osjobcb_t cb, const rawcfg_t* cfg) {
+    ASSERT(getSf(cfg->rps) != FSK);
+    hal_disableIRQs();
+    hal_selectRadio(radio);
+    ASSERT(BULK.state == BULK_IDLE);
+    RAW.rxjob = job;
+    RAW.rxcb  = cb;
+    RAW.rxcfg = *cfg;
+    RAW.rxOn  = 1;
+    if( RAW.state != RAW_TX ) { // otherwise when TX is done
+        opmode(OPMODE_SLEEP);
+        rawStartRx();
+    }
+    hal_enableIRQs();
+}
+
+const rawframe_t* radio_rawPeek (u1_t radio) {
+    return raws[radio].head != raws[radio].tail ? &raws[radio].ring[raws[radio].tail % RAW_RING] : NULL;
+}
+
+void radio_rawPop (u1_t radio) {
+    hal_disableIRQs();
+    if( raws[radio].head != raws[radio].tail )
+        raws[radio].tail++;
+    hal_enableIRQs();
+}
+
+void radio_rawStop (u1_t radio) {
+    hal_disableIRQs();
+    hal_selectRadio(radio);
+    if( RAW.state != RAW_IDLE )
+        opmode(OPMODE_SLEEP);
+    if( RAW.txjob )
+        os_clearCallback(RAW.txjob);
+    if( RAW.rxjob )
+        os_clearCallback(RAW.rxjob);
+    RAW.state = RAW_IDLE;
+    RAW.rxOn  = 0;
+    hal_enableIRQs();
+}
+
+const rawstat_t* radio_rawStat (u1_t radio) {
+    return &raws[radio].stat;
+}
+
+s2_t radio_rawRssi (const rawframe_t* f) {
+    // back to RegPktRssiValue, which has the same offset as the noise RSSI
+    s2_t dBm = f->rssi + 125 - 64 + NOISE_RSSI_OFFSET;
+    return f->snr < 0 ? dBm + f->snr / 4 : dBm;
+}
+
+static void rawIrq (ostime_t now) {
+    u1_t flags = readReg(LORARegIrqFlags);
+    writeReg(LORARegIrqFlags, 0xFF);
+    if( RAW.state == RAW_TX ) {
+        if( (flags & IRQ_LORA_TXDONE_MASK) == 0 )
+            return;
+        RAW.stat.txend = now - us2osticks(43); // TXDONE FIXUP
+        RAW.stat.tx++;
+        opmode(OPMODE_SLEEP);
+        RAW.state = RAW_IDLE;
+        if( RAW.rxOn )
+            rawStartRx();
+        os_setCallback(RAW.txjob, RAW.txcb);
+        return;
+    }
+    // receiver keeps running
+    if( (flags & IRQ_LORA_RXDONE_MASK) == 0 )
+        return;
+    if( flags & IRQ_LORA_CRCERR_MASK ) {
+        RAW.stat.crcerr++;
+        return;
+    }
+    if( (u1_t)(RAW.head - RAW.tail) == RAW_RING ) {
+        RAW.stat.dropped++;
+        return;
+    }
+    rawframe_t* f = &RAW.ring[RAW.head % RAW_RING];
+    if( getBw(RAW.rxcfg.rps) == BW125 )
+        now -= LORA_RXDONE_FIXUP[getSf(RAW.rxcfg.rps)];
+    f->rxtime = now;
+    f->len = getIh(RAW.rxcfg.rps) ? readReg(LORARegPayloadLength) : readReg(LORARegRxNbBytes);
+    writeReg(LORARegFifoAddrPtr, readReg(LORARegFifoRxCurrentAddr));
+    readBuf(RegFifo, f->data, f->len);
+    f->snr  = readReg(LORARegPktSnrValue); // SNR [dB] * 4
+    f->rssi = readReg(LORARegPktRssiValue) - 125 + 64; // RSSI [dBm] (-196...+63)
+    RAW.head++;
+    RAW.stat.rx++;
+    os_setCallback(RAW.rxjob, RAW.rxcb);
+}
+
+#ifdef CFG_sx1276_radio
+
+enum { CAL_BUSY, CAL_IDLE, CAL_RXON_MAC, CAL_RXON_RAW };
+
+// Can the radio be taken for a few ms now? A continuous receiver can, if
+// no frame is coming in - it is resumed afterwards.
+static u1_t calWindow (u1_t radio) {
+    if( BULK.state != BULK_IDLE || RAW.state == RAW_TX )
+        return CAL_BUSY;
+    u1_t mode = readReg(RegOpMode);
+    if( (mode & OPMODE_MASK) == OPMODE_RX ) {
+        if( (mode & OPMODE_LORA) == 0 || (readReg(LORARegModemStat) & MODEMSTAT_RX_BUSY) )
+            return CAL_BUSY;
+        if( RAW.state == RAW_RX )
+            return CAL_RXON_RAW;
+    } else if( (mode & OPMODE_MASK) != OPMODE_SLEEP && (mode & OPMODE_MASK) != OPMODE_STANDBY ) {
+        return CAL_BUSY;
+    }
+    if( radio != macRadio )
+        return CAL_IDLE;
+    // TX/RX windows pending or the next MAC step close
+    if( (LMIC.opmode & OP_TXRXPEND) || (u4_t)(LMIC.osjob.deadline - os_getTime()) < (u4_t)CAL_GUARD )
+        return CAL_BUSY;
+    return (mode & OPMODE_MASK) == OPMODE_RX ? CAL_RXON_MAC : CAL_IDLE;
+}
+
+static void calCheck (xref2osjob_t j) {
+    u1_t r = 0;
+    while( &cals[r].job != j )
+        r++;
+    hal_disableIRQs();
+    hal_selectRadio(r);
+    u1_t w = calWindow(r);
+    if( w == CAL_BUSY ) {
+        CAL.stat.deferred++;
+        os_setTimedCallback(j, os_getTime() + CAL_RETRY, FUNC_ADDR(calCheck));
+    } else {
+        calRun(0);
+        if( w == CAL_RXON_RAW )
+            rawStartRx();
+        else if( w == CAL_RXON_MAC )
+            startrx(RXMODE_SCAN);
+        os_setTimedCallback(j, os_getTime() + sec2osticks(CAL_INTV), FUNC_ADDR(calCheck));
+    }
+    hal_enableIRQs();
+}
+
+#endif // CFG_sx1276_radio
+
+// called by hal ext IRQ handler with the radio selected, the IRQ flags
+// tell which DIO fired (radio goes to stanby mode after tx/rx operations)
+void radio_irq_handler (u1_t) {
     ostime_t now = os_getTime();
+    if( BULK.state != BULK_IDLE ) {
+        bulkIrq();
+        return;
+    }
+    if( RAW.state != RAW_IDLE ) {
+        rawIrq(now);
+        return;
+    }
+    if( hal_currentRadio() != macRadio )
+        return;
+    SPITRACE_BEGIN(SPIOP_IRQ);
     if( (readReg(RegOpMode) & OPMODE_LORA) != 0) { // LORA modem
         u1_t flags = readReg(LORARegIrqFlags);
         if( flags & IRQ_LORA_TXDONE_MASK ) {
@@ -759,9 +1503,14 @@ void radio_irq_handler (u1_t dio) {
             // read rx quality parameters
             LMIC.snr  = readReg(LORARegPktSnrValue); // SNR [dB] * 4
             LMIC.rssi = readReg(LORARegPktRssiValue) - 125 + 64; // RSSI [dBm] (-196...+63)
+            if( (flags & IRQ_LORA_CRCERR_MASK) == 0 )
+                xtalUpdate(LMIC.freq, LMIC.rps);
         } else if( flags & IRQ_LORA_RXTOUT_MASK ) {
             // indicate timeout
             LMIC.dataLen = 0;
+        } else if( flags & IRQ_LORA_CDDONE_MASK ) {
+            // LoRa preamble seen on the channel?
+            LMIC.cadBusy = (flags & IRQ_LORA_CDDETD_MASK) != 0;
         }
         // mask all radio IRQs
         writeReg(LORARegIrqFlagsMask, 0xFF);
@@ -793,12 +1542,14 @@ void radio_irq_handler (u1_t dio) {
     }
     // go from stanby to sleep
     opmode(OPMODE_SLEEP);
+    SPITRACE_END();
     // run os job (use preset func ptr)
     os_setCallback(&LMIC.osjob, LMIC.osjob.func);
 }
 
 void os_radio (u1_t mode) {
     hal_disableIRQs();
+    hal_selectRadio(macRadio);
     switch (mode) {
       case RADIO_RST:
         // put radio to sleep
@@ -819,6 +1570,11 @@ void os_radio (u1_t mode) {
         // start scanning for beacon now
         startrx(RXMODE_SCAN); // buf=LMIC.frame
         break;
+
+      case RADIO_CAD:
+        // check the channel for activity now
+        startcad(); // freq=LMIC.freq, rps=LMIC.rps
+        break;
     }
     hal_enableIRQs();
 }
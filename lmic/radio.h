@@ -0,0 +1,191 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * FSK bulk transfer: point-to-point frames of up to BULK_MAX_LEN bytes
+ * between two of our devices at 50 kbps, outside of LoRaWAN - e.g. for
+ * configuration and firmware distribution.
+ *
+ * The radio runs in unlimited length packet mode and frames are streamed
+ * through the 64 byte FIFO in chunks: DIO1 signals FifoEmpty while sending
+ * and FifoLevel while receiving. On air a frame is the payload length
+ * (2 bytes, LSB first), the payload and a CRC-32 of the payload (4 bytes),
+ * whitened, after a preamble and a sync word of its own.
+ *
+ * Refills have to keep up with the air: at 50 kbps there is one byte time
+ * (160 us) left after FifoEmpty, and 32 byte times after FifoLevel.
+ *
+ * A transfer takes over the radio - only start one while the MAC is idle
+ * (nothing queued, no class B/C). Duty cycle limits are up to the caller.
+ *
+ * Raw LoRa: frames of any SF/BW/CR between our own devices without the
+ * LoRaWAN MAC - no RX windows, no frame header or MIC, normal or inverted
+ * IQ, explicit or implicit header. Receiving is continuous, frames are
+ * queued in a ring buffer until the application reads them. A transmission
+ * pauses the receiver and resumes it when done. Same rule as above: the MAC
+ * must be idle.
+ *
+ * Crystal drift: every LoRa frame the MAC receives has its frequency error
+ * (FEI) read, assuming the network's gateways are on frequency. A filtered
+ * estimate of the crystal error corrects every frequency the radio is set
+ * to afterwards - MAC, bulk and raw, TX and RX. Raw mode frames do not feed
+ * the estimate, the peers there have crystals as cheap as ours.
+ *
+ * Image calibration (SX1276): the RX chain is calibrated for the band at
+ * start, at the temperature then. Every CAL_INTV seconds the temperature is
+ * read and once it has moved by CAL_TEMP_DELTA the calibration is run again
+ * - a few ms, only while nothing is due on the radio: no TX or RX windows
+ * pending, no MAC job within 50 ms, no transfer. A continuous receiver is
+ * paused unless a frame is coming in.
+ *
+ * Every call names the radio (see hal_selectRadio()), each radio serves one
+ * user at a time: the MAC (radio_bindMac()), a bulk transfer or raw mode.
+ * E.g. one module keeps the LoRaWAN session while another listens raw.
+ *******************************************************************************/
+
+#ifndef _radio_h_
+#define _radio_h_
+
+#include "oslmic.h"
+#include "lorabase.h"
+
+//! Radio used by the LoRaWAN MAC, 0 unless changed. Only change it while the MAC is idle.
+void radio_bindMac (u1_t radio);
+
+// ================================================================================
+// Crystal drift
+
+enum { XTAL_GAIN    = 8 };        // estimate moves by 1/XTAL_GAIN of each error
+enum { XTAL_MAX_PPB = 50000 };    // errors beyond +-50 ppm are ignored
+
+typedef struct xtalstat_t xtalstat_t;
+struct xtalstat_t {
+    s4_t ppb;       // estimated crystal error [ppb], > 0: fast
+    s4_t fei;       // error of the last frame [Hz], > 0: signal above our tuning
+    s4_t corr;      // correction of the last frequency set [Hz]
+    u4_t updates;   // frames used
+    u4_t rejected;  // frames with an implausible error
+};
+
+//! Estimate and corrections of radio.
+const xtalstat_t* radio_xtalStat (u1_t radio);
+
+//! Set the estimate, e.g. restored from storage. 0 starts over, the first
+//! frame then sets the estimate instead of moving it.
+void radio_setXtal (u1_t radio, s4_t ppb);
+
+// ================================================================================
+// Image calibration
+
+enum { CAL_INTV       = 60 };   // seconds between temperature readings
+enum { CAL_TEMP_DELTA = 10 };   // degrees C of drift before calibrating again
+
+typedef struct calstat_t calstat_t;
+struct calstat_t {
+    s1_t     temp;      // last reading [C], uncalibrated offset
+    s1_t     calTemp;   // reading at the last calibration
+    u4_t     reads;     // temperature readings
+    u4_t     cals;      // calibrations, incl. the one at start
+    u4_t     deferred;  // readings put off, the radio was busy
+    ostime_t busy;      // total time spent reading and calibrating
+    ostime_t last;      // time of the last calibration
+};
+
+//! Temperature and calibration counters of radio, NULL without SX1276.
+const calstat_t* radio_calStat (u1_t radio);
+
+// ================================================================================
+// FSK bulk transfer
+
+enum { BULK_MAX_LEN  = 4096 };    // max payload
+enum { BULK_BITRATE  = 50000 };   // bps
+enum { BULK_CHUNK    = 32 };      // bytes moved per FIFO refill or interrupt
+
+// Result of a transfer, see radio_bulkResult()
+enum { BULK_OK       =  0,  // sent (TX)
+       BULK_TIMEOUT  = -1,  // nothing received in time, or the radio stalled
+       BULK_CRCERR   = -2,  // received frame failed the CRC
+       BULK_TOOLONG  = -3,  // received frame longer than the buffer
+       BULK_OVERRUN  = -4,  // FIFO not emptied in time, bytes lost
+       BULK_ABORTED  = -5,  // radio_bulkAbort()
+       BULK_UNDERRUN = -6 }; // FIFO ran empty before the frame was out (TX)
+
+//! Send len bytes on freq with txpow dBm, then run cb on job.
+void radio_bulkTx (u1_t radio, osjob_t* job, osjobcb_t cb, u4_t freq, s1_t txpow, xref2cu1_t buf, u2_t len);
+
+//! Receive one frame of up to maxlen bytes into buf on freq, then run cb on
+//! job. Gives up if no frame has started by timeout (absolute time).
+void radio_bulkRx (u1_t radio, osjob_t* job, osjobcb_t cb, u4_t freq, xref2u1_t buf, u2_t maxlen, ostime_t timeout);
+
+//! Outcome of the last transfer: BULK_OK or the payload length received, or BULK_*.
+int  radio_bulkResult (u1_t radio);
+
+//! Stop a transfer in progress - its callback is not run.
+void radio_bulkAbort (u1_t radio);
+
+// ================================================================================
+// Raw LoRa
+
+enum { RAW_RING = 8 };          // frames buffered by the receiver
+
+enum { RAW_IQ_NORMAL, RAW_IQ_INVERTED };
+
+enum { RAW_SYNC_PUBLIC  = 0x34, // LoRaWAN
+       RAW_SYNC_PRIVATE = 0x12 };
+
+typedef struct rawcfg_t rawcfg_t;
+struct rawcfg_t {
+    u4_t  freq;
+    rps_t rps;      // makeRps(sf, bw, cr, ih, nocrc), ih=frame length for implicit header
+    s1_t  txpow;    // dBm
+    u1_t  iq;       // RAW_IQ_*
+    u1_t  sync;     // RAW_SYNC_* or any sync word
+};
+
+typedef struct rawframe_t rawframe_t;
+struct rawframe_t {
+    ostime_t rxtime;    // end of frame
+    s1_t     rssi;      // as in LMIC.rssi
+    s1_t     snr;       // as in LMIC.snr
+    u1_t     len;
+    u1_t     data[MAX_LEN_FRAME];
+};
+
+typedef struct rawstat_t rawstat_t;
+struct rawstat_t {
+    u4_t     tx;        // frames sent
+    u4_t     rx;        // frames queued
+    u4_t     crcerr;    // frames with a bad payload CRC
+    u4_t     dropped;   // frames lost to a full ring buffer
+    u4_t     rxAborted; // frames cut off by a TX
+    ostime_t txend;     // end of the last transmission
+};
+
+//! Send len bytes with cfg, then run cb on job.
+void radio_rawTx (u1_t radio, osjob_t* job, osjobcb_t cb, const rawcfg_t* cfg, xref2cu1_t buf, u1_t len);
+
+//! Send len bytes with cfg starting exactly at time at, then run cb on job.
+//! Blocks from about 2 ms before at, the receiver runs until then. Returns 0
+//! and sends nothing if at has passed already.
+bit_t radio_rawTxAt (u1_t radio, osjob_t* job, osjobcb_t cb, const rawcfg_t* cfg, xref2cu1_t buf, u1_t len, ostime_t at);
+
+//! Receive continuously with cfg, run cb on job whenever a frame was queued.
+void radio_rawRx (u1_t radio, osjob_t* job, osjobcb_t cb, const rawcfg_t* cfg);
+
+//! Oldest queued frame, NULL if there is none. Valid until radio_rawPop().
+const rawframe_t* radio_rawPeek (u1_t radio);
+
+//! Release the frame returned by radio_rawPeek().
+void radio_rawPop (u1_t radio);
+
+//! Stop receiving and any transmission in progress - callbacks are not run.
+void radio_rawStop (u1_t radio);
+
+//! Counters since the start of the program.
+const rawstat_t* radio_rawStat (u1_t radio);
+
+//! Signal strength of a received frame in dBm, corrected by its SNR below the noise floor.
+s2_t radio_rawRssi (const rawframe_t* f);
+
+#endif // _radio_h_
@@ -0,0 +1,196 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Warm restart snapshot of the MAC state, see snapshot.h.
+ *******************************************************************************/
+
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Fields of LMIC that are saved, in file order
+#define FIELD(f) { (u2_t)offsetof(struct lmic_t, f), (u2_t)sizeof(LMIC.f) }
+static const struct { u2_t off, len; } FIELDS[] = {
+#if defined(CFG_eu868)
+    FIELD(bands), FIELD(channelFreq), FIELD(channelDrMap), FIELD(channelMap),
+    FIELD(airlog), FIELD(airlogMinute), FIELD(airlogNow), FIELD(airlogStart),
+    FIELD(chnlStats), FIELD(chnlPolicy),
+#elif defined(CFG_us915)
+    FIELD(xchFreq), FIELD(xchDrMap), FIELD(channelMap), FIELD(chRnd),
+#endif
+    FIELD(txChnl), FIELD(globalDutyRate), FIELD(globalDutyAvail),
+    FIELD(netid), FIELD(opmode), FIELD(upRepeat), FIELD(adrTxPow), FIELD(datarate),
+    FIELD(errcr), FIELD(rejoinCnt), FIELD(joinHintOn), FIELD(joinHintChnl), FIELD(joinHintDr),
+    FIELD(devNonce), FIELD(nwkKey), FIELD(artKey), FIELD(devaddr), FIELD(seqnoDn), FIELD(seqnoUp),
+    FIELD(dnConf), FIELD(adrAckReq), FIELD(adrChanged), FIELD(margin),
+    FIELD(lchkReq), FIELD(lchkMargin), FIELD(lchkGws),
+    FIELD(lnkTarget), FIELD(lnkAckHist), FIELD(lnkAckCnt), FIELD(lnkSilent), FIELD(lnkHold), FIELD(lnkPowMax),
+    FIELD(adrEnabled), FIELD(macAns), FIELD(macAnsLen),
+    FIELD(dn2Dr), FIELD(dn2Freq), FIELD(lbtOn),
+};
+#define NFIELDS (sizeof(FIELDS)/sizeof(FIELDS[0]))
+
+// opmode bits that outlive a restart
+enum { OP_KEEP = OP_POLL|OP_REJOIN|OP_LINKDEAD|OP_TESTMODE|OP_CLASSC };
+
+// Slot header, all LSB first. The CRC covers the rest of the slot.
+enum { HDR_CRC=0, HDR_MAGIC=4, HDR_VERSION=8, HDR_LAYOUT=12, HDR_SEQ=16,
+       HDR_WALL=20, HDR_OSTIME=28, HDR_LEN=32 };
+#define SNAP_MAGIC 0x50534D4C   // "LMSP"
+
+static u1_t*  map;
+static size_t mapLen;
+static uint   slotLen;
+static u1_t   active;       // slot of the newest snapshot
+static u4_t   seq;          // its sequence number
+
+static s8_t wallms (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (s8_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Identifies the saved fields - a snapshot of another build is not restored
+static u4_t layout (void) {
+    return os_crc32((xref2cu1_t)FIELDS, sizeof(FIELDS)) ^ OSTICKS_PER_SEC;
+}
+
+static bit_t slotValid (u1_t* slot) {
+    return os_rlsbf4(slot+HDR_MAGIC) == SNAP_MAGIC
+        && os_rlsbf4(slot+HDR_VERSION) == SNAPSHOT_VERSION
+        && os_rlsbf4(slot+HDR_LAYOUT) == layout()
+        && os_rlsbf4(slot+HDR_CRC) == os_crc32(slot+HDR_MAGIC, slotLen-HDR_MAGIC);
+}
+
+// Pick the newest valid slot, returns 0 if there is none
+static bit_t findActive (void) {
+    bit_t v0 = slotValid(map), v1 = slotValid(map+slotLen);
+    if( !v0 && !v1 )
+        return 0;
+    u4_t s0 = os_rlsbf4(map+HDR_SEQ), s1 = os_rlsbf4(map+slotLen+HDR_SEQ);
+    active = v0 && (!v1 || (s4_t)(s0 - s1) > 0) ? 0 : 1;
+    seq = active ? s1 : s0;
+    return 1;
+}
+
+int snapshot_open (const char* path) {
+    snapshot_close();
+    slotLen = HDR_LEN;
+    for( uint i=0; i<NFIELDS; i++ )
+        slotLen += FIELDS[i].len;
+    mapLen = 2*slotLen;
+
+    int fd = open(path, O_RDWR|O_CREAT, 0644);
+    if( fd < 0 )
+        return -1;
+    struct stat st;
+    if( fstat(fd, &st) < 0 || (st.st_size != (off_t)mapLen && ftruncate(fd, mapLen) < 0) ) {
+        close(fd);
+        return -1;
+    }
+    void* m = mmap(NULL, mapLen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if( m == MAP_FAILED )
+        return -1;
+    map = (u1_t*)m;
+    if( !findActive() ) {
+        active = 1;     // first save goes to slot 0
+        seq = 0;
+    }
+    return 0;
+}
+
+// Time left until t as of the save, counted from now - past times become now
+static ostime_t rebase (ostime_t t, ostime_t saved, s8_t elapsed, ostime_t now) {
+    s8_t left = (s8_t)(s4_t)(t - saved) - elapsed;
+    return left > 0 ? now + (ostime_t)left : now;
+}
+
+#if defined(CFG_eu868)
+// Move the start of the airlog minute count to the new time base, the time
+// passed meanwhile included - the buckets keep their minute numbers
+static void rebaseAirlog (ostime_t saved, s8_t elapsed, ostime_t now) {
+    s8_t since = (s8_t)(s4_t)(saved - LMIC.airlogStart) + elapsed;
+    if( since >= (s8_t)AIRLOG_SLOTS * AIRLOG_TICKS ) {
+        os_clearMem(LMIC.airlog, sizeof(LMIC.airlog));  // all expired
+        since = 0;
+    }
+    LMIC.airlogStart = now - (ostime_t)since;
+}
+#endif
+
+int snapshot_restore (void) {
+    if( map == NULL )
+        return -1;
+    if( !findActive() )
+        return 0;
+    u1_t* slot = map + active*slotLen;
+    u1_t* p = slot + HDR_LEN;
+    for( uint i=0; i<NFIELDS; i++ ) {
+        os_copyMem((u1_t*)&LMIC + FIELDS[i].off, p, FIELDS[i].len);
+        p += FIELDS[i].len;
+    }
+
+    ostime_t now   = os_getTime();
+    ostime_t saved = os_rlsbf4(slot+HDR_OSTIME);
+    s8_t wall = (s8_t)os_rlsbf4(slot+HDR_WALL) | (s8_t)os_rlsbf4(slot+HDR_WALL+4) << 32;
+    s8_t elapsed = wallms() - wall;
+    elapsed = elapsed < 0 ? 0 : elapsed * OSTICKS_PER_SEC / 1000;
+#if defined(CFG_eu868)
+    for( u1_t bi=0; bi<MAX_BANDS; bi++ )
+        LMIC.bands[bi].avail = rebase(LMIC.bands[bi].avail, saved, elapsed, now);
+    rebaseAirlog(saved, elapsed, now);
+#endif
+    LMIC.globalDutyAvail = rebase(LMIC.globalDutyAvail, saved, elapsed, now);
+
+    LMIC.opmode &= OP_KEEP;
+    LMIC.lnkMargin = LNK_NOMARGIN;
+    if( LMIC.devaddr == 0 )
+        return 0;
+    LMIC.opmode |= OP_NEXTCHNL;
+    if( LMIC.opmode & OP_CLASSC )
+        LMIC_setClassC(1);  // listen again right away
+    return 1;
+}
+
+int snapshot_save (void) {
+    if( map == NULL )
+        return -1;
+    u1_t* slot = map + (active^1)*slotLen;
+    u1_t* p = slot + HDR_LEN;
+    for( uint i=0; i<NFIELDS; i++ ) {
+        os_copyMem(p, (u1_t*)&LMIC + FIELDS[i].off, FIELDS[i].len);
+        p += FIELDS[i].len;
+    }
+    s8_t wall = wallms();
+    os_wlsbf4(slot+HDR_MAGIC,   SNAP_MAGIC);
+    os_wlsbf4(slot+HDR_VERSION, SNAPSHOT_VERSION);
+    os_wlsbf4(slot+HDR_LAYOUT,  layout());
+    os_wlsbf4(slot+HDR_SEQ,     seq+1);
+    os_wlsbf4(slot+HDR_WALL,    (u4_t)wall);
+    os_wlsbf4(slot+HDR_WALL+4,  (u4_t)(wall >> 32));
+    os_wlsbf4(slot+HDR_OSTIME,  os_getTime());
+    os_wlsbf4(slot+HDR_CRC,     os_crc32(slot+HDR_MAGIC, slotLen-HDR_MAGIC));
+    active ^= 1;
+    seq += 1;
+    return 0;
+}
+
+int snapshot_sync (void) {
+    if( map == NULL )
+        return -1;
+    return msync(map, mapLen, MS_SYNC);
+}
+
+void snapshot_close (void) {
+    if( map != NULL )
+        munmap(map, mapLen);
+    map = NULL;
+}
@@ -0,0 +1,50 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Warm restart snapshot of the MAC state. The session (keys, address,
+ * counters, DevNonce), the channel plan, duty cycle state, RX2 and ADR /
+ * link controller settings, the join hint and pending MAC answers are
+ * copied into a memory mapped file, so a restarted process can continue
+ * without a new join and without losing track of its duty cycle. Frames
+ * in flight, queued uplinks and class B state are not kept.
+ *
+ * Time fields are stored against the wall clock and rebased onto
+ * os_getTime() on restore. The file holds two slots written alternately,
+ * each with a CRC, so a crash in the middle of a save leaves the previous
+ * snapshot intact. A snapshot from a build with a different layout of the
+ * saved fields is ignored.
+ *
+ * Saving only copies memory - the kernel writes the pages back, which
+ * survives a process crash. snapshot_sync() also makes it power safe.
+ * Use fcntlog alongside for frame counters: open it after the restore,
+ * it keeps the higher of both counters.
+ *******************************************************************************/
+
+#ifndef _snapshot_h_
+#define _snapshot_h_
+
+#include "lmic.h"
+
+enum { SNAPSHOT_VERSION = 1 };
+
+//! Map the snapshot file at path, creating it if needed. Returns 0 or -1.
+int  snapshot_open (const char* path);
+
+//! Restore the MAC state from the newest valid snapshot - call right after
+//! LMIC_reset(). Returns 1 if a session was restored (no join needed),
+//! 0 if there was no usable snapshot or it had no session, -1 if not open.
+//! A restored class C session resumes continuous RX.
+int  snapshot_restore (void);
+
+//! Copy the current MAC state into the mapping, e.g. on EV_JOINED and
+//! EV_TXCOMPLETE. Returns 0 or -1 if not open.
+int  snapshot_save (void);
+
+//! Flush the mapping to storage. Returns 0 or -1.
+int  snapshot_sync (void);
+
+void snapshot_close (void);
+
+#endif // _snapshot_h_
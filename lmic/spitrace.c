@@ -0,0 +1,128 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * SPI traffic tracer, see spitrace.h.
+ *******************************************************************************/
+
+#include "spitrace.h"
+
+#if defined(CFG_spitrace)
+
+#include <time.h>
+
+// Single producer ring: records are only written by the current SPI owner
+// (NSS framing serializes it), head/tail are published with release stores
+// so a reader on another thread never sees a half written record.
+static spitrace_rec_t ring[SPITRACE_RING];
+static u4_t ringHead, ringTail, ringDropped;
+
+enum { XFER_IDLE, XFER_ADDR, XFER_DATA };
+
+static spitrace_opstat_t stats[SPIOP_MAX];
+static spitrace_rec_t cur;
+static u1_t curOp;
+static u1_t xfer;       // XFER_* state of the current transaction
+static u1_t enabled;
+
+static u4_t nanos (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (u4_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void push (const spitrace_rec_t* rec) {
+    u4_t head = ringHead;
+    if( head - __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE) >= SPITRACE_RING ) {
+        ringDropped++;
+        return;
+    }
+    ring[head & (SPITRACE_RING-1)] = *rec;
+    __atomic_store_n(&ringHead, head+1, __ATOMIC_RELEASE);
+}
+
+void spitrace_enable (u1_t on) {
+    enabled = on;
+}
+
+void spitrace_reset (void) {
+    os_clearMem(stats, sizeof(stats));
+    __atomic_store_n(&ringTail, __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    ringDropped = 0;
+}
+
+void spitrace_nss (u1_t val) {
+    if( !enabled )
+        return;
+    if( val == 0 ) {
+        cur.start = nanos();
+        cur.len = 0;
+        cur.op = curOp;
+        xfer = XFER_ADDR;
+    } else if( xfer == XFER_DATA ) { // ignore release without address byte
+        cur.dur = nanos() - cur.start;
+        spitrace_opstat_t* s = &stats[cur.op];
+        s->xfers += 1;
+        s->bytes += 1 + cur.len;
+        s->ns    += cur.dur;
+        push(&cur);
+        xfer = XFER_IDLE;
+    }
+}
+
+void spitrace_byte (u1_t out) {
+    if( !enabled )
+        return;
+    if( xfer == XFER_ADDR ) {
+        cur.addr  = out & 0x7F;
+        cur.write = out >> 7;
+        xfer = XFER_DATA;
+    } else if( xfer == XFER_DATA ) {
+        cur.len++;
+    }
+}
+
+u1_t spitrace_begin (u1_t op) {
+    u1_t prev = curOp;
+    curOp = op;
+    if( enabled )
+        stats[op].calls++;
+    return prev;
+}
+
+void spitrace_end (u1_t prev) {
+    curOp = prev;
+}
+
+int spitrace_read (spitrace_rec_t* recs, int max) {
+    u4_t tail = ringTail;
+    u4_t head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while( tail != head && n < max )
+        recs[n++] = ring[tail++ & (SPITRACE_RING-1)];
+    __atomic_store_n(&ringTail, tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+u4_t spitrace_dropped (void) {
+    return ringDropped;
+}
+
+const spitrace_opstat_t* spitrace_stats (u1_t op) {
+    return op < SPIOP_MAX ? &stats[op] : NULL;
+}
+
+// Per operation summary as one JSON object
+void spitrace_dump (FILE* fp) {
+    static const char* const names[SPIOP_MAX] = { "other", "starttx", "startrx", "irq", "startcad" };
+    fprintf(fp, "{");
+    for( u1_t op=0; op<SPIOP_MAX; op++ ) {
+        const spitrace_opstat_t* s = &stats[op];
+        fprintf(fp, "%s\"%s\": {\"calls\": %u, \"xfers\": %u, \"bytes\": %u, \"ns\": %u}",
+                op ? ", " : "", names[op], s->calls, s->xfers, s->bytes, s->ns);
+    }
+    fprintf(fp, ", \"dropped\": %u}\n", ringDropped);
+}
+
+#endif // CFG_spitrace
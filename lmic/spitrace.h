@@ -0,0 +1,75 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 which accompanies this
+ * distribution, and is available at http://www.eclipse.org/legal/epl-v10.html
+ *
+ * SPI traffic tracer. The HAL reports every NSS edge and SPI byte, radio.c
+ * brackets its operations, and each NSS framed transaction is logged into
+ * a ring and accounted to the operation that caused it.
+ *
+ * Compiled in with CFG_spitrace, switched on at runtime with spitrace_enable().
+ *******************************************************************************/
+
+#ifndef _spitrace_h_
+#define _spitrace_h_
+
+#include "oslmic.h"
+#include <stdio.h>
+
+// Radio operations transactions are accounted to
+enum { SPIOP_OTHER, SPIOP_STARTTX, SPIOP_STARTRX, SPIOP_IRQ, SPIOP_STARTCAD, SPIOP_MAX };
+
+enum { SPITRACE_RING = 256 };   // must be a power of two
+
+//! One NSS framed SPI transaction.
+struct spitrace_rec_t {
+    u4_t start;     //!< Start time [ns], monotonic clock, wraps
+    u4_t dur;       //!< Time NSS was asserted [ns]
+    u1_t addr;      //!< Register address (write bit stripped)
+    u1_t write;     //!< 1 for register write, 0 for read
+    u1_t len;       //!< Data bytes following the address byte
+    u1_t op;        //!< SPIOP_* active at the time
+};
+typedef struct spitrace_rec_t spitrace_rec_t;
+
+//! Accumulated cost of one kind of radio operation.
+struct spitrace_opstat_t {
+    u4_t calls;     //!< Number of operations
+    u4_t xfers;     //!< NSS framed transactions
+    u4_t bytes;     //!< Bytes clocked, address bytes included
+    u4_t ns;        //!< Total time NSS was asserted [ns]
+};
+typedef struct spitrace_opstat_t spitrace_opstat_t;
+
+#if defined(CFG_spitrace)
+
+void spitrace_enable (u1_t on);
+void spitrace_reset (void);
+
+// Hooks - HAL and radio.c
+void spitrace_nss (u1_t val);
+void spitrace_byte (u1_t out);
+u1_t spitrace_begin (u1_t op);
+void spitrace_end (u1_t prev);
+
+// Consumer side - may run on a different thread than the SPI owner
+int  spitrace_read (spitrace_rec_t* recs, int max);
+u4_t spitrace_dropped (void);
+const spitrace_opstat_t* spitrace_stats (u1_t op);
+void spitrace_dump (FILE* fp);
+
+#define SPITRACE_NSS(v)     spitrace_nss(v)
+#define SPITRACE_BYTE(b)    spitrace_byte(b)
+#define SPITRACE_BEGIN(op)  u1_t spitrace_prev = spitrace_begin(op)
+#define SPITRACE_END()      spitrace_end(spitrace_prev)
+
+#else
+
+#define SPITRACE_NSS(v)     ((void)0)
+#define SPITRACE_BYTE(b)    ((void)0)
+#define SPITRACE_BEGIN(op)  ((void)0)
+#define SPITRACE_END()      ((void)0)
+
+#endif // CFG_spitrace
+
+#endif // _spitrace_h_